@@ -0,0 +1,385 @@
+/*
+ * This file contains the logic to copy batches of small files. A batch names
+ * several small files (and links) inside one source directory. The rank that
+ * processes it creates, copies, truncates, and compares each one in a single
+ * pass instead of sending every file through the individual stages.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "batch.h"
+#include "diff.h"
+#include "journal.h"
+#include "digest.h"
+#include "dirtable.h"
+#include "manifest.h"
+#include "memscan.h"
+#include "throttle.h"
+#include "treewalk.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/* Buffers to hold file contents, reused across batches. */
+static char* DCOPY_batch_src_buf = NULL;
+static char* DCOPY_batch_dest_buf = NULL;
+static size_t DCOPY_batch_buf_size = 0;
+
+/*
+ * Make sure the batch buffers can hold at least size bytes. They are page
+ * aligned so they also work for direct I/O.
+ */
+static void DCOPY_batch_reserve(size_t size)
+{
+    if(size <= DCOPY_batch_buf_size) {
+        return;
+    }
+
+    free(DCOPY_batch_src_buf);
+    free(DCOPY_batch_dest_buf);
+
+    DCOPY_batch_src_buf = NULL;
+    DCOPY_batch_dest_buf = NULL;
+
+    if(posix_memalign((void**) &DCOPY_batch_src_buf, DCOPY_DIRECT_ALIGN, size) != 0 || \
+            posix_memalign((void**) &DCOPY_batch_dest_buf, DCOPY_DIRECT_ALIGN, size) != 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate %zu bytes for batch buffers.", size);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    DCOPY_batch_buf_size = size;
+}
+
+/*
+ * Open the source of a batched file and get its stat info from the open
+ * descriptor, so the directory rank's lstat is the only other lookup of the
+ * name. Links can't be opened without following them, so they (and whatever
+ * fails to open) are looked at with lstat instead, and in_fd is set to -1.
+ */
+static int DCOPY_batch_stat(const char* src_path, \
+                            struct stat64* statbuf, \
+                            int* in_fd)
+{
+    *in_fd = DCOPY_open_file(AT_FDCWD, src_path, \
+                             O_RDONLY | O_NOATIME | O_NOFOLLOW | O_NONBLOCK, 0);
+
+    if(*in_fd < 0) {
+        return lstat64(src_path, statbuf);
+    }
+
+    if(fstat64(*in_fd, statbuf) < 0) {
+        close(*in_fd);
+        *in_fd = -1;
+        return -1;
+    }
+
+    if(!DCOPY_user_opts.direct) {
+        posix_fadvise64(*in_fd, 0, statbuf->st_size, POSIX_FADV_SEQUENTIAL);
+    }
+
+    return 0;
+}
+
+/*
+ * Copy, truncate, and (unless the compare is skipped) verify one small file
+ * from the open descriptor of its source.
+ */
+static int DCOPY_batch_copy_file(DCOPY_operation_t* op, \
+                                 const struct stat64* statbuf, \
+                                 int in_fd)
+{
+    size_t size = (size_t) statbuf->st_size;
+    int rc = -1;
+
+    /* Direct I/O moves whole aligned blocks, even at the tail. */
+    size_t io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(size) : size;
+
+    DCOPY_batch_reserve(io_len > 0 ? io_len : DCOPY_DIRECT_ALIGN);
+
+    if(in_fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to open input file `%s'.", op->operand);
+        return -1;
+    }
+
+    int out_fd = DCOPY_open_output_fd(op);
+
+    if(out_fd < 0 && DCOPY_user_opts.force) {
+        DCOPY_unlink_destination(op);
+        out_fd = DCOPY_open_output_fd(op);
+    }
+
+    if(out_fd < 0) {
+        return -1;
+    }
+
+    DCOPY_throttle(size);
+
+    ssize_t num_of_bytes_read = DCOPY_read_fully(in_fd, DCOPY_batch_src_buf, io_len, 0);
+
+    if(num_of_bytes_read < 0) {
+        LOG(DCOPY_LOG_ERR, "Read error when copying from `%s'. errno=%d %s", \
+            op->operand, errno, strerror(errno));
+        goto out;
+    }
+
+    if(num_of_bytes_read > (ssize_t) size) {
+        num_of_bytes_read = (ssize_t) size;
+    }
+
+    size_t write_len = (size_t) num_of_bytes_read;
+    size_t written = 0;
+
+    if(DCOPY_user_opts.direct) {
+        write_len = DCOPY_DIRECT_ROUND(write_len);
+        memset(DCOPY_batch_src_buf + num_of_bytes_read, 0, write_len - (size_t) num_of_bytes_read);
+    }
+
+    while(written < write_len) {
+        ssize_t num_of_bytes_written = pwrite64(out_fd, DCOPY_batch_src_buf + written, \
+                                                write_len - written, \
+                                                (off64_t) written);
+
+        if(num_of_bytes_written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            LOG(DCOPY_LOG_ERR, "Write error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            goto out;
+        }
+
+        written += (size_t) num_of_bytes_written;
+    }
+
+    /* waiting for small files to be written back would take too long */
+    DCOPY_start_writeback(out_fd, 0, (off64_t) write_len);
+    DCOPY_drop_behind(in_fd, -1, 0, (off64_t) size);
+
+    if(ftruncate64(out_fd, (off64_t) num_of_bytes_read) < 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to truncate destination file: %s (errno=%d %s)", \
+            op->dest_full_path, errno, strerror(errno));
+        goto out;
+    }
+
+    if(DCOPY_user_opts.fsync && fsync(out_fd) < 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to flush `%s' to disk. errno=%d %s", \
+            op->dest_full_path, errno, strerror(errno));
+        goto out;
+    }
+
+    DCOPY_statistics.total_bytes_copied += num_of_bytes_read;
+
+    if(!DCOPY_user_opts.skip_compare) {
+        /* read the destination back through a fresh descriptor */
+        DCOPY_throttle((size_t) num_of_bytes_read);
+        close(out_fd);
+        out_fd = DCOPY_open_compare_fd(op);
+
+        if(out_fd < 0) {
+            goto out;
+        }
+
+        ssize_t num_of_out_bytes = DCOPY_read_fully(out_fd, DCOPY_batch_dest_buf, \
+                                                    DCOPY_user_opts.direct ? \
+                                                    DCOPY_DIRECT_ROUND((size_t) num_of_bytes_read) : \
+                                                    (size_t) num_of_bytes_read, 0);
+
+        if(num_of_out_bytes != num_of_bytes_read || \
+                !DCOPY_mem_equal(DCOPY_batch_src_buf, DCOPY_batch_dest_buf, (size_t) num_of_bytes_read)) {
+            LOG(DCOPY_LOG_ERR, "Compare mismatch when copying from file `%s'.", \
+                op->operand);
+            goto out;
+        }
+    }
+
+    /* compared or not, this is what was written */
+    if(DCOPY_manifest_enabled()) {
+        DCOPY_manifest_file(op->dest_full_path, statbuf);
+        DCOPY_manifest_chunk(op->dest_full_path, 0, (off64_t) num_of_bytes_read, \
+                             DCOPY_crc32c(0, DCOPY_batch_src_buf, (size_t) num_of_bytes_read));
+    }
+
+    rc = 1;
+
+out:
+
+    if(out_fd >= 0 && close(out_fd) < 0) {
+        LOG(DCOPY_LOG_DBG, "Close on destination file failed. errno=%d %s", errno, strerror(errno));
+    }
+
+    return rc;
+}
+
+/*
+ * Compare one small file with its existing destination, which has already
+ * been found to have the same size, without copying anything.
+ */
+static int DCOPY_batch_compare_file(DCOPY_operation_t* op, \
+                                    const struct stat64* statbuf, \
+                                    int in_fd)
+{
+    size_t size = (size_t) statbuf->st_size;
+    size_t io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(size) : size;
+    int rc = -1;
+
+    DCOPY_batch_reserve(io_len > 0 ? io_len : DCOPY_DIRECT_ALIGN);
+
+    if(in_fd < 0) {
+        return -1;
+    }
+
+    int out_fd = DCOPY_open_compare_fd(op);
+
+    if(out_fd < 0) {
+        return -1;
+    }
+
+    DCOPY_throttle(size);
+
+    ssize_t num_of_in_bytes = DCOPY_read_fully(in_fd, DCOPY_batch_src_buf, io_len, 0);
+    ssize_t num_of_out_bytes = DCOPY_read_fully(out_fd, DCOPY_batch_dest_buf, io_len, 0);
+
+    if(num_of_in_bytes < 0 || num_of_out_bytes < 0) {
+        LOG(DCOPY_LOG_ERR, "Read error when comparing `%s'. errno=%d %s", \
+            op->operand, errno, strerror(errno));
+        goto out;
+    }
+
+    if(num_of_in_bytes > (ssize_t) size) {
+        num_of_in_bytes = (ssize_t) size;
+    }
+
+    if(num_of_out_bytes > (ssize_t) size) {
+        num_of_out_bytes = (ssize_t) size;
+    }
+
+    DCOPY_drop_behind(in_fd, out_fd, 0, (off64_t) size);
+    DCOPY_statistics.total_bytes_compared += num_of_in_bytes;
+
+    if(num_of_in_bytes != num_of_out_bytes || \
+            !DCOPY_mem_equal(DCOPY_batch_src_buf, DCOPY_batch_dest_buf, (size_t) num_of_in_bytes)) {
+        DCOPY_diff_chunk(op->dest_full_path, 0, (off64_t) size);
+    }
+
+    rc = 1;
+
+out:
+    close(out_fd);
+
+    return rc;
+}
+
+/* The entrance point to the batch operation. */
+void DCOPY_do_batch(DCOPY_operation_t* op, \
+                    CIRCLE_handle* handle)
+{
+    char src_path[PATH_MAX];
+    char dest_path[PATH_MAX];
+
+    char* name = op->batch;
+
+    /* files which are walked again on their own are counted in a group, which
+     * takes the place of this batch in its directory */
+    op->parent = DCOPY_dir_table_add(NULL, NULL, &op->parent);
+
+    while(name != NULL && *name != '\0') {
+        /* split off the next name */
+        char* next = strchr(name, '/');
+
+        if(next != NULL) {
+            *next++ = '\0';
+        }
+
+        int src_written = snprintf(src_path, sizeof(src_path), "%s/%s", op->operand, name);
+        int dest_written = snprintf(dest_path, sizeof(dest_path), "%s/%s", op->dest_full_path, name);
+
+        if(src_written >= (int) sizeof(src_path) || dest_written >= (int) sizeof(dest_path)) {
+            LOG(DCOPY_LOG_ERR, "Path too long for `%s' in `%s'.", name, op->operand);
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        /* describe this file as if it had been walked on its own */
+        DCOPY_operation_t file_op = *op;
+        file_op.code = TREEWALK;
+        file_op.operand = src_path;
+        file_op.dest_full_path = dest_path;
+        file_op.batch = NULL;
+
+        struct stat64 statbuf;
+        int in_fd;
+
+        if(DCOPY_batch_stat(src_path, &statbuf, &in_fd) < 0) {
+            LOG(DCOPY_LOG_DBG, "Could not get info for `%s'. errno=%d %s", src_path, errno, strerror(errno));
+            DCOPY_dir_table_update(&op->parent, 1);
+            DCOPY_retry_failed_operation(TREEWALK, handle, &file_op);
+        }
+        else if(!DCOPY_stat_is_batchable(&statbuf)) {
+            /* this changed since the directory was read, so walk it normally */
+            char* newop = DCOPY_encode_operation(TREEWALK, 0, src_path, \
+                                                 op->source_base_offset, \
+                                                 op->dest_base_appendix, 0, 0, NULL, 0, 0, \
+                                                 &op->parent);
+            DCOPY_dir_table_update(&op->parent, 1);
+            handle->enqueue(newop);
+            free(newop);
+        }
+        else if(DCOPY_user_opts.compare_only) {
+            /* the contents are only compared if the type and size match */
+            if(DCOPY_diff_check(&file_op, &statbuf) && \
+                    DCOPY_batch_compare_file(&file_op, &statbuf, in_fd) < 0) {
+                DCOPY_diff_chunk(dest_path, 0, statbuf.st_size);
+            }
+        }
+        else if(DCOPY_user_opts.update && DCOPY_stat_unchanged(&file_op, &statbuf)) {
+            /* already up to date */
+        }
+        else if(S_ISREG(statbuf.st_mode) && DCOPY_journal_file_done(dest_path, &statbuf)) {
+            /* copied by an earlier run, which may not have set its metadata */
+            DCOPY_stat_record(dest_path, &statbuf);
+            DCOPY_statistics.total_files_copied++;
+            DCOPY_statistics.total_chunks_resumed++;
+            DCOPY_statistics.total_bytes_resumed += statbuf.st_size;
+        }
+        else if(S_ISLNK(statbuf.st_mode)) {
+            DCOPY_stat_record(dest_path, &statbuf);
+            DCOPY_stat_process_link(&file_op, &statbuf, handle);
+        }
+        else {
+            DCOPY_stat_create_file(&file_op, &statbuf);
+
+            if(DCOPY_batch_copy_file(&file_op, &statbuf, in_fd) < 0) {
+                DCOPY_dir_table_update(&op->parent, 1);
+                DCOPY_retry_failed_operation(TREEWALK, handle, &file_op);
+            }
+            else {
+                DCOPY_stat_record(dest_path, &statbuf);
+                DCOPY_statistics.total_files_copied++;
+                DCOPY_journal_chunk(dest_path, statbuf.st_size, \
+                                    statbuf.st_size > 0 ? statbuf.st_size : 1, 0);
+            }
+        }
+
+        if(in_fd >= 0 && close(in_fd) < 0) {
+            LOG(DCOPY_LOG_DBG, "Close on source file failed. errno=%d %s", errno, strerror(errno));
+        }
+
+        name = next;
+    }
+
+    return;
+}
+
+/* EOF */
@@ -0,0 +1,11 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_BATCH_H
+#define __DCP_BATCH_H
+
+#include "common.h"
+
+void DCOPY_do_batch(DCOPY_operation_t* op, \
+                    CIRCLE_handle* handle);
+
+#endif /* __DCP_BATCH_H */
@@ -1,15 +1,26 @@
 /*
  * This file contains the logic to truncate the the destination as well as
  * preserve permissions and ownership. Since it would be redundant, we only
- * pay attention to the first chunk of each file and pass the rest along.
-
+ * pay attention to the last chunk of each file and pass the rest along.
+ *
+ * Whichever rank finishes the last chunk of a file to go through all stages,
+ * which need not be the last chunk of the file, gives the file its
+ * ownership, permissions, and timestamps through the descriptor it already
+ * has open, rather than leaving it to the metadata pass at the end.
+ *
  * See the file "COPYING" for the full license governing this code.
  */
 
 #include "cleanup.h"
+#include "dirtable.h"
+#include "fdcache.h"
+#include "filetable.h"
+#include "journal.h"
+#include "manifest.h"
 #include "dcp.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
@@ -21,45 +32,129 @@
 /** Options specified by the user. */
 extern DCOPY_options_t DCOPY_user_opts;
 
-static void DCOPY_truncate_file(DCOPY_operation_t* op, \
-                         CIRCLE_handle* handle)
-{
-    char dest_path_recursive[PATH_MAX];
-    char dest_path_file_to_file[PATH_MAX];
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
 
-    if(op->dest_base_appendix == NULL) {
-        sprintf(dest_path_recursive, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->operand + op->source_base_offset + 1);
+/* The index of the last chunk of the file op names. */
+static int64_t DCOPY_cleanup_last_chunk(const DCOPY_operation_t* op)
+{
+    return op->file_size > 0 ? (op->file_size - 1) / op->chunk_size : 0;
+}
 
-        strncpy(dest_path_file_to_file, DCOPY_user_opts.dest_path, PATH_MAX);
+/*
+ * Give the file of op, whose chunks are all finished, the ownership,
+ * permissions, and timestamps of its source with -p, or otherwise only its
+ * permissions, and take it off the pending work of its directory. The size
+ * was already set when its last chunk was cleaned up.
+ */
+static void DCOPY_finish_file(DCOPY_operation_t* op, \
+                              const struct stat64* statbuf, \
+                              const DCOPY_dir_id_t* parent)
+{
+    int fd = DCOPY_fd_cache_dest(op);
+
+    if(fd < 0) {
+        /* a file its owner can't open still gets its attributes by path */
+        LOG(DCOPY_LOG_DBG, "Failed to open `%s' to set its attributes, " \
+            "setting them by path. errno=%d %s", \
+            op->dest_full_path, errno, strerror(errno));
+        DCOPY_copy_metadata(statbuf, op->dest_full_path);
     }
     else {
-        sprintf(dest_path_recursive, "%s/%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix, \
-                op->operand + op->source_base_offset + 1);
-
-        sprintf(dest_path_file_to_file, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix);
+        if(DCOPY_user_opts.fsync && fsync(fd) < 0) {
+            LOG(DCOPY_LOG_ERR, "Failed to flush `%s' to disk. errno=%d %s", \
+                op->dest_full_path, errno, strerror(errno));
+        }
+
+        if(DCOPY_user_opts.preserve && fchown(fd, statbuf->st_uid, statbuf->st_gid) < 0) {
+            LOG(DCOPY_LOG_ERR, "Failed to change ownership on %s fchown() errno=%d %s.", \
+                op->dest_full_path, errno, strerror(errno));
+        }
+
+        /* TODO: set permissions based on source permissons masked by umask */
+        if(fchmod(fd, statbuf->st_mode) < 0) {
+            LOG(DCOPY_LOG_ERR, "Failed to change permissions on %s fchmod() errno=%d %s.", \
+                op->dest_full_path, errno, strerror(errno));
+        }
+
+        if(DCOPY_user_opts.preserve) {
+            struct timespec times[2];
+
+            times[0] = statbuf->st_atim;
+            times[1] = statbuf->st_mtim;
+
+            if(futimens(fd, times) < 0) {
+                LOG(DCOPY_LOG_ERR, "Failed to change timestamps on %s futimens() " \
+                    "errno=%d %s.", op->dest_full_path, errno, strerror(errno));
+            }
+        }
+
+        /* nothing touches the file again */
+        DCOPY_fd_cache_evict(op);
+        DCOPY_statistics.files_finished_early++;
     }
 
+    DCOPY_statistics.total_files_copied++;
+    DCOPY_dir_table_update(parent, -1);
+}
+
+/*
+ * Take done chunks of the file op names off its count, and finish the file if
+ * none are left. The treewalk stage calls this once it has enqueued all of
+ * them, to take off what it held back.
+ */
+void DCOPY_cleanup_finish_chunks(DCOPY_operation_t* op, \
+                                 int64_t done)
+{
+    struct stat64 statbuf;
+    DCOPY_dir_id_t parent;
+
+    if(DCOPY_file_table_finish(op, done, &statbuf, &parent)) {
+        DCOPY_finish_file(op, &statbuf, &parent);
+    }
+}
+
+/*
+ * Record a chunk which made it through its last stage in the journal, and
+ * take it off the count of its file. A file which is not counted is taken as
+ * copied once its last chunk is done.
+ */
+void DCOPY_cleanup_chunk_done(DCOPY_operation_t* op)
+{
+    DCOPY_journal_chunk(op->dest_full_path, op->file_size, op->chunk_size, op->chunk);
+
+    if(op->file_id.rank < 0) {
+        if(op->chunk == DCOPY_cleanup_last_chunk(op)) {
+            DCOPY_statistics.total_files_copied++;
+        }
+
+        return;
+    }
+
+    DCOPY_cleanup_finish_chunks(op, 1);
+}
+
+static int DCOPY_truncate_file(DCOPY_operation_t* op, \
+                               CIRCLE_handle* handle)
+{
+    int out_fd = DCOPY_fd_cache_dest(op);
+
     LOG(DCOPY_LOG_DBG, "Truncating file to `%" PRId64 "'.", op->file_size);
 
     /*
-     * Try the recursive file before file-to-file. The cast below requires us
-     * to have a maximum file_size of 2^63, not 2^64.
+     * The cast below requires us to have a maximum file_size of 2^63, not
+     * 2^64.
      */
-    if(truncate64(dest_path_recursive, op->file_size) < 0) {
-        if(truncate64(dest_path_file_to_file, op->file_size) < 0) {
-            LOG(DCOPY_LOG_ERR, "Failed to truncate destination file: %s (errno=%d %s)",
-                dest_path_recursive, errno, strerror(errno));
+    if(out_fd < 0 || ftruncate64(out_fd, op->file_size) < 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to truncate destination file of `%s' (errno=%d %s)",
+            op->operand, errno, strerror(errno));
 
-            DCOPY_retry_failed_operation(COPY, handle, op);
-            return;
-        }
+        DCOPY_fd_cache_evict(op);
+        DCOPY_retry_failed_operation(COPY, handle, op);
+        return -1;
     }
+
+    return 1;
 }
 
 void DCOPY_do_cleanup(DCOPY_operation_t* op, \
@@ -68,13 +163,18 @@ void DCOPY_do_cleanup(DCOPY_operation_t* op, \
     char* newop;
 
     /*
-     * Only bother truncating on the first chunk of
-     * the file.
+     * Only bother truncating on the last chunk of the file. It is always
+     * copied, even when it is a hole, and truncating after it has been
+     * written also trims any padding left by direct I/O.
      */
-    if(op->chunk == 0) {
+    if(op->chunk == DCOPY_cleanup_last_chunk(op) && !(op->flags & DCOPY_OP_PREALLOCATED)) {
         /* truncate file to appropriate size, to do this before
-         * setting permissions in case file does not have write permission */
-        DCOPY_truncate_file(op, handle);
+         * setting permissions in case file does not have write permission,
+         * a preallocated file was given its size when it was created */
+        if(DCOPY_truncate_file(op, handle) < 0) {
+            /* the chunk is copied again, so it must not be compared yet */
+            return;
+        }
 
         /* since we still may access the file in the compare step,
          * delay setting permissions and timestamps until final phase */
@@ -82,16 +182,17 @@ void DCOPY_do_cleanup(DCOPY_operation_t* op, \
 
     /*
      * If the user is feeling brave, this is where we let them skip the
-     * comparison stage.
+     * comparison stage. A manifest still needs the destination read back.
      */
-    if(!DCOPY_user_opts.skip_compare) {
-        newop = DCOPY_encode_operation(COMPARE, op->chunk, op->operand, \
-                                       op->source_base_offset, \
-                                       op->dest_base_appendix, op->file_size);
+    if(!DCOPY_user_opts.skip_compare || DCOPY_manifest_enabled()) {
+        newop = DCOPY_encode_chunk(COMPARE, op, op->chunk, op->flags, op->digest);
 
         handle->enqueue(newop);
         free(newop);
     }
+    else {
+        DCOPY_cleanup_chunk_done(op);
+    }
 
     return;
 }
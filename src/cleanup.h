@@ -8,4 +8,9 @@
 void DCOPY_do_cleanup(DCOPY_operation_t* op,
                       CIRCLE_handle* handle);
 
+void DCOPY_cleanup_finish_chunks(DCOPY_operation_t* op, \
+                                 int64_t done);
+
+void DCOPY_cleanup_chunk_done(DCOPY_operation_t* op);
+
 #endif /* __DCP_CLEANUP_H */
@@ -0,0 +1,660 @@
+/*
+ * This file contains the encoding of work operations for the libcircle
+ * queue, which only carries NUL-terminated strings of less than
+ * CIRCLE_MAX_STRING_LEN bytes.
+ *
+ * An encoded operation is a version byte followed by its fields in a fixed
+ * order. Numbers are variable-length, six bits per byte starting with the
+ * lowest: 0b10xxxxxx for every group but the last, which is 0b01xxxxxx.
+ * Strings are a length followed by their bytes. No byte of an encoding is
+ * ever NUL, so nothing needs escaping.
+ *
+ *     version code flags digest chunk more_chunks file
+ *     file_disp file_len                                   (if file > 0)
+ *     parent [parent_index] file_size chunk_size root      (otherwise)
+ *     [source_base_offset]
+ *     operand_len operand appendix [appendix_len appendix]
+ *     batch [batch_len batch]
+ *
+ * An operation stands for more_chunks + 1 chunks from chunk on, which is more
+ * than one only for a range of chunks from the treewalk stage.
+ *
+ * The chunks of a file only carry the ID of its record in the file table
+ * (filetable.c): file is the rank which owns the record plus one, followed by
+ * its address and length there. The paths and sizes come from the record.
+ *
+ * The parent of a walk or batch is 0 if it has none, and otherwise the rank
+ * which keeps its entry in the directory table (dirtable.c) plus one,
+ * followed by the index of the entry there.
+ *
+ * Most operands are a path below one of the source paths given on the command
+ * line. Those are sent as the index of that source path plus one (root), and
+ * only the part of the operand past it; the source base offset is then its
+ * length. Otherwise root is 0, the source base offset follows, and the whole
+ * operand is sent. The destination base appendix is 0 if there is none, 1 if
+ * it is the base name of the root, and its length plus 2 otherwise. The batch
+ * list is 0 if there is none and its length plus 1 otherwise.
+ *
+ * Decoding does not allocate. Strings are NUL-terminated in place in the
+ * message, and the operand (if it has a root) and the destination path are
+ * built in a DCOPY_operation_paths_t the caller provides.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "common.h"
+#include "filetable.h"
+
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/* Bumped whenever the layout above changes. */
+#define DCOPY_CODEC_VERSION (0x04)
+
+/* The bits of a number each byte holds, and the tags of those bytes. */
+#define DCOPY_CODEC_BITS  (6)
+#define DCOPY_CODEC_MASK  (0x3f)
+#define DCOPY_CODEC_MORE  (0x80)
+#define DCOPY_CODEC_LAST  (0x40)
+
+/* A source path operands may be sent relative to. */
+typedef struct {
+    const char* path;
+    size_t len;
+    char* base;
+} DCOPY_codec_root_t;
+
+/* The source paths in the order given, so an index names the same one on every rank. */
+static DCOPY_codec_root_t* DCOPY_codec_roots = NULL;
+
+/* The source paths sorted by length and then bytes, for DCOPY_codec_find_root. */
+static DCOPY_codec_root_t** DCOPY_codec_sorted = NULL;
+
+static int DCOPY_codec_num_roots = -1;
+
+/* Order roots by length first, which is all most lookups need. */
+static int DCOPY_codec_root_cmp(const void* a, \
+                                const void* b)
+{
+    const DCOPY_codec_root_t* x = *(DCOPY_codec_root_t* const*) a;
+    const DCOPY_codec_root_t* y = *(DCOPY_codec_root_t* const*) b;
+
+    if(x->len != y->len) {
+        return (x->len < y->len) ? -1 : 1;
+    }
+
+    return memcmp(x->path, y->path, x->len);
+}
+
+/*
+ * Build the table of source paths on first use. Every rank has the same
+ * source paths once the arguments have been parsed.
+ */
+static void DCOPY_codec_init_roots(void)
+{
+    int n = DCOPY_user_opts.num_src_paths;
+    int i;
+
+    if(DCOPY_user_opts.src_path == NULL || n < 0) {
+        n = 0;
+    }
+
+    DCOPY_codec_roots = (DCOPY_codec_root_t*) malloc(sizeof(DCOPY_codec_root_t) * (size_t)(n + 1));
+    DCOPY_codec_sorted = (DCOPY_codec_root_t**) malloc(sizeof(DCOPY_codec_root_t*) * (size_t)(n + 1));
+
+    if(DCOPY_codec_roots == NULL || DCOPY_codec_sorted == NULL) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate the table of source paths.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < n; i++) {
+        DCOPY_codec_root_t* root = &DCOPY_codec_roots[i];
+        char* tmp = strdup(DCOPY_user_opts.src_path[i]);
+
+        if(tmp == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the table of source paths.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        root->path = DCOPY_user_opts.src_path[i];
+        root->len = strlen(root->path);
+
+        /* the same base name the create callback appends */
+        root->base = strdup(basename(tmp));
+        free(tmp);
+
+        if(root->base == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the table of source paths.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        DCOPY_codec_sorted[i] = root;
+    }
+
+    qsort(DCOPY_codec_sorted, (size_t) n, sizeof(DCOPY_codec_root_t*), \
+          DCOPY_codec_root_cmp);
+
+    DCOPY_codec_num_roots = n;
+}
+
+/*
+ * Find the source path which is the first source_base_offset bytes of the
+ * operand, and return its index plus one, or 0 if there is none.
+ */
+static int DCOPY_codec_find_root(const char* operand, \
+                                 size_t len, \
+                                 uint16_t source_base_offset)
+{
+    DCOPY_codec_root_t key;
+    DCOPY_codec_root_t* keyp = &key;
+    DCOPY_codec_root_t** found;
+
+    if(DCOPY_codec_num_roots < 0) {
+        DCOPY_codec_init_roots();
+    }
+
+    if(source_base_offset > len || DCOPY_codec_num_roots == 0) {
+        return 0;
+    }
+
+    key.path = operand;
+    key.len = source_base_offset;
+
+    found = (DCOPY_codec_root_t**) bsearch(&keyp, DCOPY_codec_sorted, \
+                                           (size_t) DCOPY_codec_num_roots, \
+                                           sizeof(DCOPY_codec_root_t*), \
+                                           DCOPY_codec_root_cmp);
+
+    if(found == NULL) {
+        return 0;
+    }
+
+    return (int)(*found - DCOPY_codec_roots) + 1;
+}
+
+/*
+ * Append a number to an encoding which must end before end. This returns
+ * the byte past it, or NULL if it did not fit or ptr was NULL already.
+ */
+static char* DCOPY_codec_put_number(char* ptr, \
+                                    const char* end, \
+                                    uint64_t value)
+{
+    if(ptr == NULL) {
+        return NULL;
+    }
+
+    while(value > DCOPY_CODEC_MASK) {
+        if(ptr >= end) {
+            return NULL;
+        }
+
+        *ptr++ = (char)(DCOPY_CODEC_MORE | (value & DCOPY_CODEC_MASK));
+        value >>= DCOPY_CODEC_BITS;
+    }
+
+    if(ptr >= end) {
+        return NULL;
+    }
+
+    *ptr++ = (char)(DCOPY_CODEC_LAST | value);
+
+    return ptr;
+}
+
+/* Append len bytes of str to an encoding, like DCOPY_codec_put_number. */
+static char* DCOPY_codec_put_bytes(char* ptr, \
+                                   const char* end, \
+                                   const char* str, \
+                                   size_t len)
+{
+    if(ptr == NULL || len > (size_t)(end - ptr)) {
+        return NULL;
+    }
+
+    memcpy(ptr, str, len);
+
+    return ptr + len;
+}
+
+/* Allocate a message and write the fields every operation starts with. */
+static char* DCOPY_codec_put_header(char* op, \
+                                    const char* end, \
+                                    DCOPY_operation_code_t code, \
+                                    int64_t chunk, \
+                                    int64_t num_chunks, \
+                                    uint32_t flags, \
+                                    uint64_t digest)
+{
+    char* ptr = op;
+
+    *ptr++ = (char) DCOPY_CODEC_VERSION;
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) code);
+    ptr = DCOPY_codec_put_number(ptr, end, flags);
+    ptr = DCOPY_codec_put_number(ptr, end, digest);
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) chunk);
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t)(num_chunks - 1));
+
+    return ptr;
+}
+
+/* Allocate a message for DCOPY_codec_encode or DCOPY_codec_encode_chunk. */
+static char* DCOPY_codec_alloc(void)
+{
+    char* op = (char*) malloc(sizeof(char) * CIRCLE_MAX_STRING_LEN);
+
+    if(op == NULL) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate an encoded operation.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    return op;
+}
+
+/*
+ * Encode an operation with its paths, for num_chunks chunks from chunk on,
+ * counted in the directory table entry parent, if any.
+ */
+static char* DCOPY_codec_encode(DCOPY_operation_code_t code, \
+                                int64_t chunk, \
+                                int64_t num_chunks, \
+                                char* operand, \
+                                uint16_t source_base_offset, \
+                                char* dest_base_appendix, \
+                                int64_t file_size, \
+                                int64_t chunk_size, \
+                                char* batch, \
+                                uint32_t flags, \
+                                uint64_t digest, \
+                                const DCOPY_dir_id_t* parent)
+{
+    char* op = DCOPY_codec_alloc();
+
+    /* leave room for the terminating NUL */
+    const char* end = op + CIRCLE_MAX_STRING_LEN - 1;
+
+    size_t len = strlen(operand);
+    int root = DCOPY_codec_find_root(operand, len, source_base_offset);
+
+    char* ptr = DCOPY_codec_put_header(op, end, code, chunk, num_chunks, flags, digest);
+    ptr = DCOPY_codec_put_number(ptr, end, 0);
+
+    if(parent == NULL || parent->rank < 0) {
+        ptr = DCOPY_codec_put_number(ptr, end, 0);
+    }
+    else {
+        ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) parent->rank + 1);
+        ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) parent->index);
+    }
+
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) file_size);
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) chunk_size);
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) root);
+
+    if(root > 0) {
+        ptr = DCOPY_codec_put_number(ptr, end, len - source_base_offset);
+        ptr = DCOPY_codec_put_bytes(ptr, end, operand + source_base_offset, \
+                                    len - source_base_offset);
+    }
+    else {
+        ptr = DCOPY_codec_put_number(ptr, end, source_base_offset);
+        ptr = DCOPY_codec_put_number(ptr, end, len);
+        ptr = DCOPY_codec_put_bytes(ptr, end, operand, len);
+    }
+
+    if(dest_base_appendix == NULL) {
+        ptr = DCOPY_codec_put_number(ptr, end, 0);
+    }
+    else if(root > 0 && strcmp(dest_base_appendix, DCOPY_codec_roots[root - 1].base) == 0) {
+        ptr = DCOPY_codec_put_number(ptr, end, 1);
+    }
+    else {
+        len = strlen(dest_base_appendix);
+        ptr = DCOPY_codec_put_number(ptr, end, len + 2);
+        ptr = DCOPY_codec_put_bytes(ptr, end, dest_base_appendix, len);
+    }
+
+    if(batch == NULL) {
+        ptr = DCOPY_codec_put_number(ptr, end, 0);
+    }
+    else {
+        len = strlen(batch);
+        ptr = DCOPY_codec_put_number(ptr, end, len + 1);
+        ptr = DCOPY_codec_put_bytes(ptr, end, batch, len);
+    }
+
+    if(ptr == NULL) {
+        LOG(DCOPY_LOG_ERR, "The operation for `%s' does not fit in a " \
+            "libcircle message of `%d' bytes.", operand, CIRCLE_MAX_STRING_LEN);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    *ptr = '\0';
+
+    return op;
+}
+
+/**
+ * Encode an operation code for use on the distributed queue structure.
+ */
+char* DCOPY_encode_operation(DCOPY_operation_code_t code, \
+                             int64_t chunk, \
+                             char* operand, \
+                             uint16_t source_base_offset, \
+                             char* dest_base_appendix, \
+                             int64_t file_size, \
+                             int64_t chunk_size, \
+                             char* batch, \
+                             uint32_t flags, \
+                             uint64_t digest, \
+                             const DCOPY_dir_id_t* parent)
+{
+    return DCOPY_codec_encode(code, chunk, 1, operand, source_base_offset, \
+                              dest_base_appendix, file_size, chunk_size, batch, \
+                              flags, digest, parent);
+}
+
+/*
+ * Encode num_chunks chunks from chunk on of the file op names. If the file is
+ * in the file table, they only carry its ID.
+ */
+static char* DCOPY_codec_encode_chunk(DCOPY_operation_code_t code, \
+                                      DCOPY_operation_t* op, \
+                                      int64_t chunk, \
+                                      int64_t num_chunks, \
+                                      uint32_t flags, \
+                                      uint64_t digest)
+{
+    if(op->file_id.rank < 0) {
+        return DCOPY_codec_encode(code, chunk, num_chunks, op->operand, \
+                                  op->source_base_offset, op->dest_base_appendix, \
+                                  op->file_size, op->chunk_size, NULL, flags, digest, \
+                                  NULL);
+    }
+
+    char* msg = DCOPY_codec_alloc();
+
+    /* leave room for the terminating NUL */
+    const char* end = msg + CIRCLE_MAX_STRING_LEN - 1;
+
+    char* ptr = DCOPY_codec_put_header(msg, end, code, chunk, num_chunks, flags, digest);
+    ptr = DCOPY_codec_put_number(ptr, end, (uint64_t) op->file_id.rank + 1);
+    ptr = DCOPY_codec_put_number(ptr, end, op->file_id.disp);
+    ptr = DCOPY_codec_put_number(ptr, end, op->file_id.len);
+
+    /* a header always fits */
+    *ptr = '\0';
+
+    return msg;
+}
+
+/**
+ * Encode a chunk of the file op names for the copy, cleanup, or compare
+ * stage. If the file is in the file table, the chunk only carries its ID.
+ */
+char* DCOPY_encode_chunk(DCOPY_operation_code_t code, \
+                         DCOPY_operation_t* op, \
+                         int64_t chunk, \
+                         uint32_t flags, \
+                         uint64_t digest)
+{
+    return DCOPY_codec_encode_chunk(code, op, chunk, 1, flags, digest);
+}
+
+/**
+ * Encode num_chunks chunks from chunk on of the file op names as a single
+ * operation, which DCOPY_process_objects splits up as it is dequeued.
+ */
+char* DCOPY_encode_range(DCOPY_operation_code_t code, \
+                         DCOPY_operation_t* op, \
+                         int64_t chunk, \
+                         int64_t num_chunks, \
+                         uint32_t flags)
+{
+    return DCOPY_codec_encode_chunk(code, op, chunk, num_chunks, flags, 0);
+}
+
+/*
+ * Read a number from an encoding which ends at end. This returns the byte
+ * past it, or NULL if the number is malformed or ptr was NULL already.
+ */
+static char* DCOPY_codec_get_number(char* ptr, \
+                                    const char* end, \
+                                    uint64_t* value)
+{
+    int shift = 0;
+
+    *value = 0;
+
+    if(ptr == NULL) {
+        return NULL;
+    }
+
+    while(ptr < end && shift < 64) {
+        unsigned char byte = (unsigned char) *ptr++;
+
+        *value |= (uint64_t)(byte & DCOPY_CODEC_MASK) << shift;
+
+        if((byte & ~DCOPY_CODEC_MASK) == DCOPY_CODEC_LAST) {
+            return ptr;
+        }
+
+        if((byte & ~DCOPY_CODEC_MASK) != DCOPY_CODEC_MORE) {
+            return NULL;
+        }
+
+        shift += DCOPY_CODEC_BITS;
+    }
+
+    return NULL;
+}
+
+/*
+ * Read the length of a string and find its bytes. This returns the byte past
+ * the string, or NULL if it is malformed or runs past end.
+ */
+static char* DCOPY_codec_get_string(char* ptr, \
+                                    const char* end, \
+                                    uint64_t bias, \
+                                    uint64_t* tag, \
+                                    char** str, \
+                                    size_t* len)
+{
+    ptr = DCOPY_codec_get_number(ptr, end, tag);
+
+    *str = NULL;
+    *len = 0;
+
+    if(ptr == NULL || *tag < bias) {
+        return ptr;
+    }
+
+    if(*tag - bias > (uint64_t)(end - ptr)) {
+        return NULL;
+    }
+
+    *str = ptr;
+    *len = (size_t)(*tag - bias);
+
+    return ptr + *len;
+}
+
+/**
+ * Decode the operation code from a message on the distributed queue
+ * structure into op. The message is modified, and op points into it and into
+ * paths afterwards, so both must outlive op.
+ */
+void DCOPY_decode_operation(char* msg, \
+                            DCOPY_operation_t* op, \
+                            DCOPY_operation_paths_t* paths)
+{
+    const char* end = msg + strlen(msg);
+    char* ptr = msg;
+    char* operand;
+    char* appendix;
+    char* batch;
+    size_t operand_len;
+    size_t appendix_len;
+    size_t batch_len;
+    uint64_t code, flags, digest, chunk, more_chunks, file, file_size, chunk_size, root;
+    uint64_t parent, parent_index = 0;
+    uint64_t source_base_offset = 0;
+    uint64_t operand_tag, appendix_tag, batch_tag;
+
+    if(DCOPY_codec_num_roots < 0) {
+        DCOPY_codec_init_roots();
+    }
+
+    if(ptr == end || (unsigned char) *ptr++ != DCOPY_CODEC_VERSION) {
+        LOG(DCOPY_LOG_ERR, "Could not decode an operation of an unknown version.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    ptr = DCOPY_codec_get_number(ptr, end, &code);
+    ptr = DCOPY_codec_get_number(ptr, end, &flags);
+    ptr = DCOPY_codec_get_number(ptr, end, &digest);
+    ptr = DCOPY_codec_get_number(ptr, end, &chunk);
+    ptr = DCOPY_codec_get_number(ptr, end, &more_chunks);
+    ptr = DCOPY_codec_get_number(ptr, end, &file);
+
+    op->code = (DCOPY_operation_code_t) code;
+    op->flags = (uint32_t) flags;
+    op->digest = digest;
+    op->chunk = (int64_t) chunk;
+    op->num_chunks = (int64_t) more_chunks + 1;
+    op->batch = NULL;
+
+    /* a chunk of a file in the file table */
+    if(ptr != NULL && file > 0) {
+        uint64_t disp, len;
+
+        ptr = DCOPY_codec_get_number(ptr, end, &disp);
+        ptr = DCOPY_codec_get_number(ptr, end, &len);
+
+        if(ptr != end || code > VERIFY || file > (uint64_t) DCOPY_global_size) {
+            LOG(DCOPY_LOG_ERR, "Could not decode a malformed operation.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        op->file_id.rank = (int)(file - 1);
+        op->file_id.disp = disp;
+        op->file_id.len = (uint32_t) len;
+        op->parent.rank = -1;
+
+        DCOPY_file_table_lookup(op);
+        return;
+    }
+
+    op->file_id.rank = -1;
+
+    ptr = DCOPY_codec_get_number(ptr, end, &parent);
+
+    if(ptr != NULL && parent > 0) {
+        ptr = DCOPY_codec_get_number(ptr, end, &parent_index);
+    }
+
+    ptr = DCOPY_codec_get_number(ptr, end, &file_size);
+    ptr = DCOPY_codec_get_number(ptr, end, &chunk_size);
+    ptr = DCOPY_codec_get_number(ptr, end, &root);
+
+    if(ptr != NULL && root == 0) {
+        ptr = DCOPY_codec_get_number(ptr, end, &source_base_offset);
+    }
+
+    ptr = DCOPY_codec_get_string(ptr, end, 0, &operand_tag, &operand, &operand_len);
+    ptr = DCOPY_codec_get_string(ptr, end, 2, &appendix_tag, &appendix, &appendix_len);
+    ptr = DCOPY_codec_get_string(ptr, end, 1, &batch_tag, &batch, &batch_len);
+
+    if(ptr != end || code > VERIFY || root > (uint64_t) DCOPY_codec_num_roots || \
+            (appendix_tag == 1 && root == 0) || parent > (uint64_t) DCOPY_global_size) {
+        LOG(DCOPY_LOG_ERR, "Could not decode a malformed operation.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    op->file_size = (int64_t) file_size;
+    op->chunk_size = (int64_t) chunk_size;
+    op->parent.rank = (int) parent - 1;
+    op->parent.index = (int64_t) parent_index;
+
+    /* every field is read, so the byte past each string can be overwritten */
+    if(root > 0) {
+        const DCOPY_codec_root_t* r = &DCOPY_codec_roots[root - 1];
+
+        if(r->len + operand_len >= sizeof(paths->operand)) {
+            LOG(DCOPY_LOG_ERR, "Operand path buffer too small.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        memcpy(paths->operand, r->path, r->len);
+        memcpy(paths->operand + r->len, operand, operand_len);
+        operand_len += r->len;
+        paths->operand[operand_len] = '\0';
+
+        op->operand = paths->operand;
+        op->source_base_offset = (uint16_t) r->len;
+    }
+    else {
+        operand[operand_len] = '\0';
+
+        op->operand = operand;
+        op->source_base_offset = (uint16_t) source_base_offset;
+    }
+
+    op->dest_base_appendix = appendix;
+
+    if(appendix_tag == 1) {
+        op->dest_base_appendix = DCOPY_codec_roots[root - 1].base;
+    }
+    else if(appendix != NULL) {
+        appendix[appendix_len] = '\0';
+    }
+
+    op->batch = batch;
+
+    if(batch != NULL) {
+        batch[batch_len] = '\0';
+    }
+
+    /* get pointer to first character past source base path, if one exists */
+    const char* last_component = NULL;
+    if(op->source_base_offset < operand_len) {
+        last_component = op->operand + op->source_base_offset + 1;
+    }
+
+    /* build destination object name */
+    int written;
+    char* dest_path_recursive = paths->dest_full_path;
+    size_t size = sizeof(paths->dest_full_path);
+    if(op->dest_base_appendix == NULL) {
+        if (last_component == NULL) {
+            written = snprintf(dest_path_recursive, size,
+                "%s", DCOPY_user_opts.dest_path);
+        } else {
+            written = snprintf(dest_path_recursive, size,
+                "%s/%s", DCOPY_user_opts.dest_path, last_component);
+        }
+    }
+    else {
+        if (last_component == NULL) {
+            written = snprintf(dest_path_recursive, size,
+                "%s/%s", DCOPY_user_opts.dest_path, op->dest_base_appendix);
+        } else {
+            written = snprintf(dest_path_recursive, size,
+                "%s/%s/%s", DCOPY_user_opts.dest_path, op->dest_base_appendix, last_component);
+        }
+    }
+
+    /* fail if we would have overwritten the buffer */
+    if(written < 0 || (size_t) written >= size) {
+        LOG(DCOPY_LOG_ERR, "Destination path buffer too small.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    op->dest_full_path = dest_path_recursive;
+}
+
+/* EOF */
@@ -0,0 +1,219 @@
+/*
+ * A microbenchmark of the work operation codec (codec.c). It encodes and
+ * decodes a few typical operations in a loop and reports the time each one
+ * takes and the size of its encoding. Chunks refer to a file registered in
+ * the file table of this rank, so the cost of fetching records from other
+ * ranks is not included. It is not built by default:
+ *
+ *     make -C src codec_bench
+ *     ./src/codec_bench [iterations]
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "common.h"
+#include "filetable.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The globals codec.c uses, which dcp.c and common.c define otherwise. */
+DCOPY_loglevel DCOPY_debug_level = DCOPY_LOG_ERR;
+DCOPY_options_t DCOPY_user_opts;
+DCOPY_statistics_t DCOPY_statistics;
+FILE* DCOPY_debug_stream;
+int CIRCLE_global_rank;
+int DCOPY_global_size = 1;
+
+void DCOPY_abort(int code)
+{
+    exit(code);
+}
+
+typedef struct {
+    const char* name;
+    DCOPY_operation_code_t code;
+    int64_t chunk;
+    char* operand;
+    uint16_t source_base_offset;
+    char* dest_base_appendix;
+    int64_t file_size;
+    int64_t chunk_size;
+    char* batch;
+    uint32_t flags;
+    uint64_t digest;
+    DCOPY_operation_t* file;    /* the registered file of a chunk, if any */
+} DCOPY_bench_op_t;
+
+static double DCOPY_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static char* DCOPY_bench_encode(const DCOPY_bench_op_t* b)
+{
+    if(b->file != NULL) {
+        return DCOPY_encode_chunk(b->code, b->file, b->chunk, b->flags, b->digest);
+    }
+
+    return DCOPY_encode_operation(b->code, b->chunk, b->operand, \
+                                  b->source_base_offset, b->dest_base_appendix, \
+                                  b->file_size, b->chunk_size, b->batch, \
+                                  b->flags, b->digest, NULL);
+}
+
+/* Check that an operation comes back from the codec as it went in. */
+static int DCOPY_bench_check(const DCOPY_bench_op_t* b)
+{
+    DCOPY_operation_t op;
+    DCOPY_operation_paths_t paths;
+    char* msg = DCOPY_bench_encode(b);
+
+    DCOPY_decode_operation(msg, &op, &paths);
+
+    if(b->file != NULL) {
+        int ok = op.code == b->code && op.chunk == b->chunk && \
+                 strcmp(op.operand, b->operand) == 0 && \
+                 strcmp(op.dest_full_path, b->file->dest_full_path) == 0 && \
+                 op.file_size == b->file_size && op.chunk_size == b->chunk_size && \
+                 op.flags == b->flags && op.digest == b->digest;
+
+        free(msg);
+
+        return ok;
+    }
+
+    int ok = op.code == b->code && op.chunk == b->chunk && \
+             strcmp(op.operand, b->operand) == 0 && \
+             op.source_base_offset == b->source_base_offset && \
+             op.file_size == b->file_size && op.chunk_size == b->chunk_size && \
+             op.flags == b->flags && op.digest == b->digest && \
+             (op.dest_base_appendix == NULL) == (b->dest_base_appendix == NULL) && \
+             (op.dest_base_appendix == NULL || \
+              strcmp(op.dest_base_appendix, b->dest_base_appendix) == 0) && \
+             (op.batch == NULL) == (b->batch == NULL) && \
+             (op.batch == NULL || strcmp(op.batch, b->batch) == 0);
+
+    free(msg);
+
+    return ok;
+}
+
+int main(int argc, \
+         char** argv)
+{
+    static char root[] = "/scratch/project/input";
+    static char dest[] = "/scratch/project/output";
+    static char appendix[] = "input";
+    static char record[] = "C 536870912 536870912 9e3779b9 simulation/fields";
+    static char* src_path[] = { root };
+    static char deep[PATH_MAX];
+    static char batch[CIRCLE_MAX_STRING_LEN / 2];
+    static char dest_deep[PATH_MAX];
+    DCOPY_operation_t file;
+    struct stat64 file_sb;
+    long iterations = 1000000;
+    size_t len = 0;
+    int i;
+
+    MPI_Init(&argc, &argv);
+
+    if(argc > 1) {
+        iterations = strtol(argv[1], NULL, 10);
+    }
+
+    DCOPY_debug_stream = stderr;
+    DCOPY_user_opts.src_path = src_path;
+    DCOPY_user_opts.num_src_paths = 1;
+    DCOPY_user_opts.dest_path = dest;
+
+    snprintf(deep, sizeof(deep), "%s/simulation/run-0042/checkpoints/" \
+             "step-000123456/rank-000789/fields", src_path[0]);
+
+    snprintf(dest_deep, sizeof(dest_deep), "%s/%s", dest, deep + strlen(root) + 1);
+
+    DCOPY_file_table_init();
+
+    memset(&file, 0, sizeof(file));
+    memset(&file_sb, 0, sizeof(file_sb));
+    file.operand = deep;
+    file.source_base_offset = (uint16_t) strlen(root);
+    file.dest_full_path = dest_deep;
+    file.parent.rank = -1;
+    file_sb.st_size = 21474836480LL;
+    DCOPY_file_table_register(&file, &file_sb, 536870912);
+
+    for(i = 0; i < 200 && len + 16 < sizeof(batch); i++) {
+        len += (size_t) snprintf(batch + len, sizeof(batch) - len, \
+                                 "%sparticle.%05d.h5", i ? "/" : "", i);
+    }
+
+    DCOPY_bench_op_t ops[] = {
+        { "treewalk", TREEWALK, 0, deep, (uint16_t) strlen(src_path[0]), \
+          appendix, 0, 0, NULL, 0, 0, NULL },
+        { "copy", COPY, 37, deep, (uint16_t) strlen(src_path[0]), \
+          NULL, 21474836480LL, 536870912, NULL, 0x1, 0, &file },
+        { "compare", COMPARE, 37, deep, (uint16_t) strlen(src_path[0]), \
+          NULL, 21474836480LL, 536870912, NULL, 0x5, 0x9e3779b97f4a7c15ULL, &file },
+        { "batch", BATCH, 0, deep, (uint16_t) strlen(src_path[0]), \
+          NULL, 0, 0, batch, 0, 0, NULL },
+        { "verify", VERIFY, 0, record, (uint16_t) strlen(record), \
+          NULL, 0, 0, NULL, 0, 0, NULL },
+    };
+
+    printf("%-10s %8s %12s %12s\n", "operation", "bytes", "encode ns", "decode ns");
+
+    for(i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+        DCOPY_bench_op_t* b = &ops[i];
+        char msg[CIRCLE_MAX_STRING_LEN];
+        DCOPY_operation_t op;
+        DCOPY_operation_paths_t paths;
+        long n;
+
+        if(!DCOPY_bench_check(b)) {
+            fprintf(stderr, "The %s operation did not decode to what was encoded.\n", b->name);
+            return EXIT_FAILURE;
+        }
+
+        char* encoded = DCOPY_bench_encode(b);
+        size_t size = strlen(encoded) + 1;
+        free(encoded);
+
+        double start = DCOPY_bench_now();
+
+        for(n = 0; n < iterations; n++) {
+            free(DCOPY_bench_encode(b));
+        }
+
+        double encode = DCOPY_bench_now() - start;
+
+        encoded = DCOPY_bench_encode(b);
+        start = DCOPY_bench_now();
+
+        /* the message is changed by decoding, as it is on the queue */
+        for(n = 0; n < iterations; n++) {
+            memcpy(msg, encoded, size);
+            DCOPY_decode_operation(msg, &op, &paths);
+        }
+
+        double decode = DCOPY_bench_now() - start;
+        free(encoded);
+
+        printf("%-10s %8zu %12.1f %12.1f\n", b->name, size, \
+               encode * 1e9 / (double) iterations, decode * 1e9 / (double) iterations);
+    }
+
+    DCOPY_file_table_finalize();
+    MPI_Finalize();
+
+    return EXIT_SUCCESS;
+}
+
+/* EOF */
@@ -2,6 +2,11 @@
 
 #include "common.h"
 #include "handle_args.h"
+#include "dirtable.h"
+#include "fdcache.h"
+#include "journal.h"
+#include "manifest.h"
+#include "memscan.h"
 
 #include <stdlib.h>
 #include <inttypes.h>
@@ -26,12 +31,11 @@ FILE* DCOPY_debug_stream;
 /** What rank the current process is. */
 int CIRCLE_global_rank;
 
-/* variables to track linked list */
-DCOPY_stat_elem_t* DCOPY_list_head = NULL;
-DCOPY_stat_elem_t* DCOPY_list_tail = NULL;
+/** How many ranks are in the job. */
+int DCOPY_global_size;
 
 /** A table of function pointers used for core operation. */
-void (*DCOPY_jump_table[5])(DCOPY_operation_t* op, CIRCLE_handle* handle);
+void (*DCOPY_jump_table[6])(DCOPY_operation_t* op, CIRCLE_handle* handle);
 
 void DCOPY_retry_failed_operation(DCOPY_operation_code_t target, \
                                   CIRCLE_handle* handle, \
@@ -47,443 +51,507 @@ void DCOPY_retry_failed_operation(DCOPY_operation_code_t target, \
     else {
         LOG(DCOPY_LOG_INFO, "Attempting to retry operation.");
 
-        new_op = DCOPY_encode_operation(target, op->chunk, op->operand, \
-                                        op->source_base_offset, \
-                                        op->dest_base_appendix, op->file_size);
+        if(op->file_id.rank >= 0) {
+            new_op = DCOPY_encode_chunk(target, op, op->chunk, op->flags, op->digest);
+        }
+        else {
+            new_op = DCOPY_encode_operation(target, op->chunk, op->operand, \
+                                            op->source_base_offset, \
+                                            op->dest_base_appendix, op->file_size, \
+                                            op->chunk_size, op->batch, op->flags, \
+                                            op->digest, &op->parent);
+        }
 
         handle->enqueue(new_op);
         free(new_op);
+
+        /* the new operation is counted in the directory instead */
+        op->parent.rank = -1;
     }
 
     return;
 }
 
 /**
- * Encode an operation code for use on the distributed queue structure.
+ * The initial seeding callback for items to process on the distributed queue
+ * structure. We send all of our source items to the queue here.
  */
-char* DCOPY_encode_operation(DCOPY_operation_code_t code, \
-                             int64_t chunk, \
-                             char* operand, \
-                             uint16_t source_base_offset, \
-                             char* dest_base_appendix, \
-                             int64_t file_size)
+void DCOPY_add_objects(CIRCLE_handle* handle)
 {
-    /*
-     * FIXME: This requires architecture changes in libcircle -- a redesign of
-     * internal queue data structures to allow void* types as queue elements
-     * instead of null terminated strings. Ignoring this problem by commenting
-     * out this check will likely cause silent data corruption.
-     */
-
-    /* allocate memory to encode op */
-    char* op = (char*) malloc(sizeof(char) * CIRCLE_MAX_STRING_LEN);
-
-    /* set pointer to next byte to write to and record number of bytes left */
-    char* ptr = op;
-    size_t remaining = CIRCLE_MAX_STRING_LEN;
-
-    /* encode operation and get number of bytes required to do so */
-    size_t len = strlen(operand);
-    int written = snprintf(ptr, remaining, "%" PRId64 ":%" PRId64 ":%" PRIu16 ":%d:%d:%s", \
-                       file_size, chunk, source_base_offset, code, (int)len, operand);
-
-    /* snprintf returns number of bytes written excluding terminating NUL,
-     * so if we're equal, we'd write one byte too many */
-    if(written >= remaining) {
-        LOG(DCOPY_LOG_DBG, \
-            "Exceeded libcircle message size due to large file path. " \
-            "This is a known bug in dcp that we intend to fix. Sorry!");
-        DCOPY_abort(EXIT_FAILURE);
+    if(DCOPY_user_opts.verify_path != NULL) {
+        DCOPY_manifest_enqueue(handle);
     }
+    else {
+        DCOPY_enqueue_work_objects(handle);
+    }
+}
 
-    /* update pointer and number of bytes remaining,
-     * note that we don't include the terminating NUL in this case */
-    ptr += written;
-    remaining -= written;
-
-    /* tack on destination base appendix if we have one */
-    if(dest_base_appendix) {
-        len = strlen(dest_base_appendix);
-        written = snprintf(ptr, remaining, ":%d:%s", (int)len, dest_base_appendix);
+/*
+ * Peel the first chunk off a range of chunks, and send the rest back to the
+ * queue in two halves. The internal queue is a stack, so the lower half is
+ * worked on next, and the upper half waits below it, where libcircle takes
+ * work from for other ranks. A range of n chunks is never more than about
+ * log2(n) operations on the queue.
+ */
+static void DCOPY_split_range(DCOPY_operation_t* op, \
+                              CIRCLE_handle* handle)
+{
+    int64_t lower = (op->num_chunks - 1) / 2;
+    int64_t upper = op->num_chunks - 1 - lower;
+    char* newop;
 
-        /* snprintf returns number of bytes written excluding terminating NUL,
-         * so if we're equal, we'd write one byte too many */
-        if(written >= remaining) {
-            LOG(DCOPY_LOG_DBG, \
-                "Exceeded libcircle message size due to large file path. " \
-                "This is a known bug in dcp that we intend to fix. Sorry!");
-            DCOPY_abort(EXIT_FAILURE);
-        }
+    newop = DCOPY_encode_range(op->code, op, op->chunk + 1 + lower, upper, op->flags);
+    handle->enqueue(newop);
+    free(newop);
 
-        /* update pointer and number of bytes remaining,
-         * note that we don't include the terminating NUL in this case */
-        ptr += written;
-        remaining -= written;
+    if(lower > 0) {
+        newop = DCOPY_encode_range(op->code, op, op->chunk + 1, lower, op->flags);
+        handle->enqueue(newop);
+        free(newop);
     }
 
-    return op;
+    op->num_chunks = 1;
 }
 
 /**
- * Decode the operation code from a message on the distributed queue structure.
+ * The process callback for items found on the distributed queue structure.
  */
-DCOPY_operation_t* DCOPY_decode_operation(char* op)
+void DCOPY_process_objects(CIRCLE_handle* handle)
 {
-    DCOPY_operation_t* ret = (DCOPY_operation_t*) malloc(sizeof(DCOPY_operation_t));
+    char op[CIRCLE_MAX_STRING_LEN];
+    DCOPY_operation_t opt;
+    DCOPY_operation_paths_t paths;
+    /*
+        const char* DCOPY_op_string_table[] = {
+            "TREEWALK",
+            "COPY",
+            "CLEANUP",
+            "COMPARE"
+        };
+    */
 
-    if(sscanf(strtok(op, ":"), "%" SCNd64, &(ret->file_size)) != 1) {
-        LOG(DCOPY_LOG_ERR, "Could not decode file size attribute.");
-        DCOPY_abort(EXIT_FAILURE);
-    }
+    /* Take finished work of other ranks off the directory table. */
+    DCOPY_dir_table_poll();
 
-    if(sscanf(strtok(NULL, ":"), "%" SCNd64, &(ret->chunk)) != 1) {
-        LOG(DCOPY_LOG_ERR, "Could not decode chunk index attribute.");
-        DCOPY_abort(EXIT_FAILURE);
-    }
+    /* Pop an item off the queue */
+    handle->dequeue(op);
 
-    if(sscanf(strtok(NULL, ":"), "%" SCNu16, &(ret->source_base_offset)) != 1) {
-        LOG(DCOPY_LOG_ERR, "Could not decode source base offset attribute.");
-        DCOPY_abort(EXIT_FAILURE);
+    /* past the walltime, work is only drained, for a resume to redo */
+    if(DCOPY_journal_expired()) {
+        DCOPY_statistics.operations_deferred++;
+        return;
     }
 
-    if(sscanf(strtok(NULL, ":"), "%d", (int*) &(ret->code)) != 1) {
-        LOG(DCOPY_LOG_ERR, "Could not decode stage code attribute.");
-        DCOPY_abort(EXIT_FAILURE);
-    }
+    DCOPY_decode_operation(op, &opt, &paths);
 
-    /* get number of characters in operand string */
-    int op_len;
-    char* str = strtok(NULL, ":");
-    if(sscanf(str, "%d", &op_len) != 1) {
-        LOG(DCOPY_LOG_ERR, "Could not decode operand string length.");
-        DCOPY_abort(EXIT_FAILURE);
+    if(opt.num_chunks > 1) {
+        DCOPY_split_range(&opt, handle);
     }
 
-    /* skip over digits and trailing ':' to get pointer to operand */
-    char* operand = str + strlen(str) + 1;
-    ret->operand = operand;
+    /*
+        LOG(DCOPY_LOG_DBG, "Performing operation `%s' on operand `%s' (`%d' remain on local queue).", \
+            DCOPY_op_string_table[opt.code], opt.operand, handle->local_queue_size());
+    */
+
+    DCOPY_jump_table[opt.code](&opt, handle);
 
-    /* if operand ends with ':', then the dest_base_appendix is next */
-    int dest_base_exists = 0;
-    if(operand[op_len] == ':') {
-        dest_base_exists = 1;
+    /* a walk or batch which didn't hand its work on is done */
+    if(opt.parent.rank >= 0) {
+        DCOPY_dir_table_update(&opt.parent, -1);
     }
 
-    /* NUL-terminate the operand string */
-    operand[op_len] = '\0';
+    return;
+}
 
-    ret->dest_base_appendix = NULL;
-    if(dest_base_exists) {
-        /* get pointer to first character of dest_base_len */
-        str = operand + op_len + 1;
+/*
+ * Find the directory descriptor and name to reach the destination of op
+ * with the *at() calls. If the directory can't be opened, this falls back
+ * to AT_FDCWD and the full path.
+ */
+static const char* DCOPY_dest_at(DCOPY_operation_t* op, \
+                                 int* dir_fd)
+{
+    char dir_path[PATH_MAX];
+    const char* path = op->dest_full_path;
+    const char* slash = strrchr(path, '/');
 
-        /* tokenize length and scan it in */
-        int dest_len;
-        str = strtok(str, ":");
-        if(sscanf(str, "%d", &dest_len) != 1) {
-            LOG(DCOPY_LOG_ERR, "Could not decode destination base appendix string length.");
-            DCOPY_abort(EXIT_FAILURE);
-        }
+    *dir_fd = AT_FDCWD;
 
-        /* skip over digits and trailing ':' to get pointer to
-         * destination base, and NUL-terminate the string */
-        char* base = str + strlen(str) + 1;
-        ret->dest_base_appendix = base;
-        base[dest_len] = '\0';
-    }
-
-    /* get pointer to first character past source base path, if one exists */
-    const char* last_component = NULL;
-    if(ret->source_base_offset < op_len) {
-        last_component = ret->operand + ret->source_base_offset + 1;
-    }
-
-    /* build destination object name */
-    int written;
-    char dest_path_recursive[PATH_MAX];
-    if(ret->dest_base_appendix == NULL) {
-        if (last_component == NULL) {
-            written = snprintf(dest_path_recursive, sizeof(dest_path_recursive),
-                "%s", DCOPY_user_opts.dest_path);
-        } else {
-            written = snprintf(dest_path_recursive, sizeof(dest_path_recursive),
-                "%s/%s", DCOPY_user_opts.dest_path, last_component);
-        }
-    }
-    else {
-        if (last_component == NULL) {
-            written = snprintf(dest_path_recursive, sizeof(dest_path_recursive),
-                "%s/%s", DCOPY_user_opts.dest_path, ret->dest_base_appendix);
-        } else {
-            written = snprintf(dest_path_recursive, sizeof(dest_path_recursive),
-                "%s/%s/%s", DCOPY_user_opts.dest_path, ret->dest_base_appendix, last_component);
-        }
+    if(slash == NULL || slash[1] == '\0') {
+        return path;
     }
 
-    /* fail if we would have overwritten the buffer */
-    if(written >= sizeof(dest_path_recursive)) {
-        LOG(DCOPY_LOG_ERR, "Destination path buffer too small.");
-        DCOPY_abort(EXIT_FAILURE);
-    }
+    /* keep the slash if the parent is the root directory */
+    size_t len = (slash == path) ? 1 : (size_t)(slash - path);
 
-    /* record destination path in operation descriptor */
-    ret->dest_full_path = strdup(dest_path_recursive);
-    if(ret->dest_full_path == NULL) {
-        LOG(DCOPY_LOG_ERR, "Failed to allocate full destination path.");
-        DCOPY_abort(EXIT_FAILURE);
+    memcpy(dir_path, path, len);
+    dir_path[len] = '\0';
+
+    int fd = DCOPY_fd_cache_dir(dir_path);
+
+    if(fd < 0) {
+        return path;
     }
 
-    return ret;
+    *dir_fd = fd;
+    return slash + 1;
 }
 
-/* given the address of a pointer to an operation_t struct,
- * free associated memory and set pointer to NULL */
-void DCOPY_opt_free(DCOPY_operation_t** optptr)
+/* Unlink the destination file. */
+void DCOPY_unlink_destination(DCOPY_operation_t* op)
 {
-    if(optptr != NULL) {
-        /* get pointer to operation_t struct */
-        DCOPY_operation_t* opt = (*optptr);
-
-        if(opt != NULL) {
-            /* free memory and then the object itself */
-            free(opt->dest_full_path);
-            free(opt);
-        }
+    int dir_fd;
+    const char* name = DCOPY_dest_at(op, &dir_fd);
 
-        /* set caller's pointer to NULL to catch bugs */
-        *optptr = NULL;
+    if(unlinkat(dir_fd, name, 0) < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to unlink destination `%s'. %s", \
+            op->dest_full_path, strerror(errno));
     }
 
     return;
 }
 
-/**
- * The initial seeding callback for items to process on the distributed queue
- * structure. We send all of our source items to the queue here.
- */
-void DCOPY_add_objects(CIRCLE_handle* handle)
+/* Check whether two links point to the same place. */
+bool DCOPY_same_link(const char* src_path, \
+                     const char* dest_path)
 {
-    DCOPY_enqueue_work_objects(handle);
+    char src_target[PATH_MAX + 1];
+    char dest_target[PATH_MAX + 1];
+
+    ssize_t src_len = readlink(src_path, src_target, sizeof(src_target) - 1);
+    ssize_t dest_len = readlink(dest_path, dest_target, sizeof(dest_target) - 1);
+
+    if(src_len < 0 || dest_len < 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to read link `%s' or `%s'. errno=%d %s", \
+            src_path, dest_path, errno, strerror(errno));
+        return false;
+    }
+
+    return src_len == dest_len && memcmp(src_target, dest_target, (size_t) src_len) == 0;
 }
 
-/**
- * The process callback for items found on the distributed queue structure.
+/*
+ * Open a file relative to dir_fd (or AT_FDCWD), with O_DIRECT if direct I/O
+ * was requested. Filesystems which refuse O_DIRECT get the file opened
+ * normally instead.
  */
-void DCOPY_process_objects(CIRCLE_handle* handle)
+int DCOPY_open_file(int dir_fd, \
+                    const char* path, \
+                    int flags, \
+                    mode_t mode)
 {
-    char op[CIRCLE_MAX_STRING_LEN];
-    /*
-        const char* DCOPY_op_string_table[] = {
-            "TREEWALK",
-            "COPY",
-            "CLEANUP",
-            "COMPARE"
-        };
-    */
+    static bool warned = false;
 
-    /* Pop an item off the queue */
-    handle->dequeue(op);
-    DCOPY_operation_t* opt = DCOPY_decode_operation(op);
+    if(DCOPY_user_opts.direct) {
+        int fd = openat64(dir_fd, path, flags | O_DIRECT, mode);
 
-    /*
-        LOG(DCOPY_LOG_DBG, "Performing operation `%s' on operand `%s' (`%d' remain on local queue).", \
-            DCOPY_op_string_table[opt->code], opt->operand, handle->local_queue_size());
-    */
+        if(fd >= 0 || errno != EINVAL) {
+            return fd;
+        }
 
-    DCOPY_jump_table[opt->code](opt, handle);
+        if(!warned) {
+            LOG(DCOPY_LOG_WARN, "Direct I/O is not supported for `%s', " \
+                "using the page cache.", path);
+            warned = true;
+        }
+    }
 
-    DCOPY_opt_free(&opt);
-    return;
+    return openat64(dir_fd, path, flags, mode);
 }
 
-/* Unlink the destination file. */
-void DCOPY_unlink_destination(DCOPY_operation_t* op)
+/* Open the input file as an fd. */
+int DCOPY_open_input_fd(DCOPY_operation_t* op, \
+                        off64_t offset, \
+                        off64_t len)
 {
-    char dest_path_recursive[PATH_MAX];
-    char dest_path_file_to_file[PATH_MAX];
-
-    if(op->dest_base_appendix == NULL) {
-        sprintf(dest_path_recursive, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->operand + op->source_base_offset + 1);
+    int in_fd = DCOPY_open_file(AT_FDCWD, op->operand, O_RDONLY | O_NOATIME, 0);
 
-        strncpy(dest_path_file_to_file, DCOPY_user_opts.dest_path, PATH_MAX);
+    if(in_fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to open input file `%s'. %s", \
+            op->operand, strerror(errno));
+        /* Handle operation requeue in parent function. */
     }
-    else {
-        sprintf(dest_path_recursive, "%s/%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix, \
-                op->operand + op->source_base_offset + 1);
-
-        sprintf(dest_path_file_to_file, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix);
+    else if(!DCOPY_user_opts.direct) {
+        posix_fadvise64(in_fd, offset, len, POSIX_FADV_SEQUENTIAL);
     }
 
-    if(unlink(dest_path_recursive) < 0) {
-        LOG(DCOPY_LOG_DBG, "Failed to unlink recursive style destination. " \
-            "%s", strerror(errno));
-    }
+    return in_fd;
+}
 
-    if(unlink(dest_path_file_to_file) < 0) {
-        LOG(DCOPY_LOG_DBG, "Failed to unlink file-to-file style destination. " \
-            "%s", strerror(errno));
-    }
+/*
+ * Open the destination of op with the given flags, relative to the cached
+ * descriptor of its directory.
+ */
+int DCOPY_open_dest_fd(DCOPY_operation_t* op, \
+                       int flags)
+{
+    int dir_fd;
+    const char* name = DCOPY_dest_at(op, &dir_fd);
 
-    return;
+    return DCOPY_open_file(dir_fd, name, flags, DCOPY_DEF_PERMS_FILE);
 }
 
-/* Open the input file as a stream. */
-FILE* DCOPY_open_input_stream(DCOPY_operation_t* op)
+/* Open the output file for reading back what was copied. */
+int DCOPY_open_compare_fd(DCOPY_operation_t* op)
 {
-    FILE* in_ptr = fopen64(op->operand, "rb");
+    int out_fd = DCOPY_open_dest_fd(op, O_RDONLY | O_NOATIME);
+
+    if(out_fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to open destination path `%s' when comparing " \
+            "from source `%s'. %s", op->dest_full_path, op->operand, strerror(errno));
 
-    if(in_ptr == NULL) {
-        LOG(DCOPY_LOG_DBG, "Failed to open input file `%s'. %s", \
-            op->operand, strerror(errno));
         /* Handle operation requeue in parent function. */
     }
 
-    return in_ptr;
+    return out_fd;
 }
 
-/* Open the input file as an fd. */
-int DCOPY_open_input_fd(DCOPY_operation_t* op, \
-                        off64_t offset, \
-                        off64_t len)
+/*
+ * Open the output file and return a descriptor. The treewalk stage has
+ * already setup a directory structure for us to use.
+ */
+int DCOPY_open_output_fd(DCOPY_operation_t* op)
 {
-    int in_fd = open64(op->operand, O_RDONLY | O_NOATIME);
+    int out_fd = DCOPY_open_dest_fd(op, O_WRONLY | O_CREAT | O_NOATIME);
+
+    if(out_fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to open destination path `%s' when copying " \
+            "from source `%s'. %s", op->dest_full_path, op->operand, strerror(errno));
 
-    if(in_fd < 0) {
-        LOG(DCOPY_LOG_DBG, "Failed to open input file `%s'. %s", \
-            op->operand, strerror(errno));
         /* Handle operation requeue in parent function. */
     }
 
-    posix_fadvise64(in_fd, offset, len, POSIX_FADV_SEQUENTIAL);
-    return in_fd;
+    return out_fd;
 }
 
 /*
- * Open the output file and return a stream.
- *
- * This function needs figure out if this is a file-to-file copy or a
- * recursive copy, then return a FILE* based on the result.
+ * With drop-behind, start writing back [offset, offset + len) of a file that
+ * was just written, without waiting for it.
  */
-FILE* DCOPY_open_output_stream(DCOPY_operation_t* op)
+void DCOPY_start_writeback(int fd, \
+                           off64_t offset, \
+                           off64_t len)
 {
-    char dest_path_recursive[PATH_MAX];
-    char dest_path_file_to_file[PATH_MAX];
+    if(!DCOPY_user_opts.drop_behind || DCOPY_user_opts.direct || len <= 0) {
+        return;
+    }
 
-    FILE* out_ptr = NULL;
+#ifdef HAVE_SYNC_FILE_RANGE
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+#endif
+}
 
-    if(op->dest_base_appendix == NULL) {
-        sprintf(dest_path_recursive, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->operand + op->source_base_offset + 1);
+/*
+ * With drop-behind, remove [start, end) of the source and destination (either
+ * may be -1) from the page cache once we are done with it. Dirty pages of the
+ * destination have to be written back before they can be dropped, so this
+ * waits for them.
+ */
+void DCOPY_drop_behind(int in_fd, \
+                       int out_fd, \
+                       off64_t start, \
+                       off64_t end)
+{
+    if(!DCOPY_user_opts.drop_behind || DCOPY_user_opts.direct || end <= start) {
+        return;
+    }
 
-        strncpy(dest_path_file_to_file, DCOPY_user_opts.dest_path, PATH_MAX);
+    if(out_fd >= 0) {
+#ifdef HAVE_SYNC_FILE_RANGE
+        sync_file_range(out_fd, start, end - start, SYNC_FILE_RANGE_WAIT_BEFORE | \
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+        posix_fadvise64(out_fd, start, end - start, POSIX_FADV_DONTNEED);
     }
-    else {
-        sprintf(dest_path_recursive, "%s/%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix, \
-                op->operand + op->source_base_offset + 1);
 
-        sprintf(dest_path_file_to_file, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix);
+    if(in_fd >= 0) {
+        posix_fadvise64(in_fd, start, end - start, POSIX_FADV_DONTNEED);
     }
+}
 
-    /*
-        LOG(DCOPY_LOG_DBG, "Opening destination path `%s' (recursive).", \
-            dest_path_recursive);
-    */
+/*
+ * Read up to len bytes at offset, stopping early only at end of file. With
+ * direct I/O, a read that ends off a DCOPY_DIRECT_ALIGN boundary can only
+ * mean end of file, and reading on from there would fail.
+ */
+ssize_t DCOPY_read_fully(int fd, \
+                         void* buf, \
+                         size_t len, \
+                         off64_t offset)
+{
+    size_t total = 0;
 
-    /*
-     * If we're recursive, we'll be doing this again and again, so try
-     * recursive first. If it fails, then do the file-to-file.
-     */
-    if((out_ptr = fopen64(dest_path_recursive, "rb")) == NULL) {
+    while(total < len) {
+        ssize_t num_of_bytes_read = pread64(fd, (char*) buf + total, \
+                                            len - total, offset + (off64_t) total);
+
+        if(num_of_bytes_read < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
 
-        /*
-                LOG(DCOPY_LOG_DBG, "Opening destination path `%s' " \
-                    "(file-to-file fallback).", \
-                    dest_path_file_to_file);
-        */
+        if(num_of_bytes_read == 0) {
+            break;
+        }
+
+        total += (size_t) num_of_bytes_read;
 
-        out_ptr = fopen64(dest_path_file_to_file, "rb");
+        if(DCOPY_user_opts.direct && total % DCOPY_DIRECT_ALIGN != 0) {
+            break;
+        }
     }
 
-    if(out_ptr == NULL) {
-        LOG(DCOPY_LOG_DBG, "Failed to open destination path when comparing " \
-            "from source `%s'. %s", op->operand, strerror(errno));
+    return (ssize_t) total;
+}
 
-        /* Handle operation requeue in parent function. */
+/*
+ * Find the first byte of data at or after pos and before end in a possibly
+ * sparse file, and the end of that run of data (clipped to end) in
+ * *data_end. Returns end if there is only hole left. Files whose holes
+ * can't be found are treated as all data.
+ */
+off64_t DCOPY_seek_data(int fd, \
+                        off64_t pos, \
+                        off64_t end, \
+                        off64_t* data_end)
+{
+    *data_end = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off64_t data = lseek64(fd, pos, SEEK_DATA);
+
+    if(data < 0) {
+        /* ENXIO means there is no data past pos. */
+        return errno == ENXIO ? end : pos;
+    }
+
+    if(data >= end) {
+        return end;
+    }
+
+    off64_t hole = lseek64(fd, data, SEEK_HOLE);
+
+    if(hole > data && hole < end) {
+        *data_end = hole;
     }
 
-    return out_ptr;
+    return data;
+#else
+    return pos;
+#endif
 }
 
 /*
- * Open the output file and return a descriptor.
- *
- * This function needs figure out if this is a file-to-file copy or a
- * recursive copy, then return an fd based on the result. The treewalk
- * stage has already setup a directory structure for us to use.
+ * Check that [pos, end) of a file reads as zeros. Ranges which are holes
+ * are not read at all.
  */
-int DCOPY_open_output_fd(DCOPY_operation_t* op)
+int DCOPY_check_zeros(int fd, \
+                      off64_t pos, \
+                      off64_t end)
 {
-    char dest_path_recursive[PATH_MAX];
-    char dest_path_file_to_file[PATH_MAX];
+    int rc = 1;
+    void* buf = NULL;
+
+    while(pos < end && rc > 0) {
+        off64_t data_end;
+        pos = DCOPY_seek_data(fd, pos, end, &data_end);
+
+        if(pos >= end) {
+            break;
+        }
+
+        if(buf == NULL) {
+            buf = DCOPY_buffer_get();
+        }
 
-    int out_fd = -1;
+        /* Direct I/O reads from an aligned offset; skip what is before pos. */
+        size_t skip = DCOPY_user_opts.direct ? (size_t)(pos % DCOPY_DIRECT_ALIGN) : 0;
 
-    if(op->dest_base_appendix == NULL) {
-        sprintf(dest_path_recursive, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->operand + op->source_base_offset + 1);
+        while(pos < data_end) {
+            size_t len = FD_BLOCK_SIZE - skip;
 
-        strncpy(dest_path_file_to_file, DCOPY_user_opts.dest_path, PATH_MAX);
+            if((off64_t) len > data_end - pos) {
+                len = (size_t)(data_end - pos);
+            }
+
+            size_t io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(skip + len) : len;
+            ssize_t num_of_bytes_read = DCOPY_read_fully(fd, buf, io_len, pos - (off64_t) skip);
+
+            if(num_of_bytes_read < 0) {
+                rc = -1;
+                break;
+            }
+
+            num_of_bytes_read = num_of_bytes_read > (ssize_t) skip ? \
+                                num_of_bytes_read - (ssize_t) skip : 0;
+
+            if(num_of_bytes_read > (ssize_t) len) {
+                num_of_bytes_read = (ssize_t) len;
+            }
+
+            if(!DCOPY_mem_zero((const char*) buf + skip, (size_t) num_of_bytes_read)) {
+                rc = -1;
+            }
+
+            if(rc < 0 || num_of_bytes_read < (ssize_t) len) {
+                /* A short read means the file ends here, which is zeros too. */
+                pos = end;
+                break;
+            }
+
+            pos += (off64_t) len;
+            skip = 0;
+        }
     }
-    else {
-        sprintf(dest_path_recursive, "%s/%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix, \
-                op->operand + op->source_base_offset + 1);
 
-        sprintf(dest_path_file_to_file, "%s/%s", \
-                DCOPY_user_opts.dest_path, \
-                op->dest_base_appendix);
+    if(buf != NULL) {
+        DCOPY_buffer_put(buf);
     }
 
-    /*
-        LOG(DCOPY_LOG_DBG, "Opening destination path `%s' (recursive).", \
-            dest_path_recursive);
-    */
+    return rc;
+}
 
-    /*
-     * If we're recursive, we'll be doing this again and again, so try
-     * recursive first. If it fails, then do the file-to-file.
-     */
-    if((out_fd = open64(dest_path_recursive, O_WRONLY | O_CREAT | O_NOATIME, DCOPY_DEF_PERMS_FILE)) < 0) {
-        /*
-                LOG(DCOPY_LOG_DBG, "Opening destination path `%s' " \
-                    "(file-to-file fallback).", \
-                    dest_path_file_to_file);
-        */
+/* Page-aligned buffers of FD_BLOCK_SIZE bytes, kept for reuse. */
+static void* DCOPY_buffer_pool[DCOPY_BUFFER_POOL_SIZE];
+static int DCOPY_buffer_pool_count = 0;
+
+/* Take a buffer from the pool, allocating one if the pool is empty. */
+void* DCOPY_buffer_get(void)
+{
+    void* buf = NULL;
 
-        out_fd = open64(dest_path_file_to_file, O_WRONLY | O_CREAT | O_NOATIME, DCOPY_DEF_PERMS_FILE);
+    if(DCOPY_buffer_pool_count > 0) {
+        return DCOPY_buffer_pool[--DCOPY_buffer_pool_count];
     }
 
-    if(out_fd < 0) {
-        LOG(DCOPY_LOG_DBG, "Failed to open destination path when copying " \
-            "from source `%s'. %s", op->operand, strerror(errno));
+    if(posix_memalign(&buf, DCOPY_DIRECT_ALIGN, FD_BLOCK_SIZE) != 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate an I/O buffer.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
 
-        /* Handle operation requeue in parent function. */
+    return buf;
+}
+
+/* Give a buffer back to the pool. */
+void DCOPY_buffer_put(void* buf)
+{
+    if(DCOPY_buffer_pool_count < DCOPY_BUFFER_POOL_SIZE) {
+        DCOPY_buffer_pool[DCOPY_buffer_pool_count++] = buf;
+    }
+    else {
+        free(buf);
     }
+}
 
-    return out_fd;
+/* Free every buffer held by the pool. */
+void DCOPY_buffer_pool_free(void)
+{
+    while(DCOPY_buffer_pool_count > 0) {
+        free(DCOPY_buffer_pool[--DCOPY_buffer_pool_count]);
+    }
 }
 
 void DCOPY_copy_xattrs(
@@ -677,32 +745,38 @@ void DCOPY_copy_timestamps(
     const struct stat64* statbuf,
     const char* dest_path)
 {
-    /* TODO: see stat-time.h and get_stat_atime/mtime/ctime to read sub-second times,
-     * and use utimensat to set sub-second times */
-    /* as last step, change timestamps */
-    if(! S_ISLNK(statbuf->st_mode)) {
-        struct utimbuf times;
-        times.actime  = statbuf->st_atime;
-        times.modtime = statbuf->st_mtime;
+    /* as last step, change timestamps, of a link itself if path is one */
+    struct timespec times[2];
 
-        if(utime(dest_path, &times) != 0) {
-            LOG(DCOPY_LOG_ERR, "Failed to change timestamps on %s utime() errno=%d %s.",
-                dest_path, errno, strerror(errno)
-               );
-        }
+    times[0] = statbuf->st_atim;
+    times[1] = statbuf->st_mtim;
+
+    if(utimensat(AT_FDCWD, dest_path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to change timestamps on %s utimensat() errno=%d %s.",
+            dest_path, errno, strerror(errno)
+           );
+    }
+
+    return;
+}
+
+/*
+ * Give a copied object the ownership, permissions, and timestamps of its
+ * source with -p, or otherwise only its permissions.
+ */
+void DCOPY_copy_metadata(
+    const struct stat64* statbuf,
+    const char* dest_path)
+{
+    if(DCOPY_user_opts.preserve) {
+        DCOPY_copy_ownership(statbuf, dest_path);
+        DCOPY_copy_permissions(statbuf, dest_path);
+        DCOPY_copy_timestamps(statbuf, dest_path);
     }
     else {
-        struct timeval tv[2];
-        tv[0].tv_sec  = statbuf->st_atime;
-        tv[0].tv_usec = 0;
-        tv[1].tv_sec  = statbuf->st_mtime;
-        tv[1].tv_usec = 0;
-
-        if(lutimes(dest_path, tv) != 0) {
-            LOG(DCOPY_LOG_ERR, "Failed to change timestamps on %s utime() errno=%d %s.",
-                dest_path, errno, strerror(errno)
-               );
-        }
+        /* TODO: set permissions based on source permissons
+         * masked by umask */
+        DCOPY_copy_permissions(statbuf, dest_path);
     }
 
     return;
@@ -711,6 +785,9 @@ void DCOPY_copy_timestamps(
 /* called by single process upon detection of a problem */
 void DCOPY_abort(int code)
 {
+    /* keep what was finished for a resume */
+    DCOPY_journal_sync();
+
     MPI_Abort(MPI_COMM_WORLD, code);
     exit(code);
 }
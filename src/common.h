@@ -49,12 +49,41 @@
 #include <attr/xattr.h>
 
 /*
- * This is the size of each chunk to be processed (in bytes).
+ * This is the preferred size of each chunk to be processed (in bytes). The
+ * actual size is picked per file by the treewalk stage (or forced with
+ * --chunk-size) and travels with each operation.
  */
-/* #define DCOPY_CHUNK_SIZE (1073741824) 1GB chunk */
 #define DCOPY_CHUNK_SIZE (536870912) /* 512MB chunk */
-/* #define DCOPY_CHUNK_SIZE (33554432)  32MB chunk */
-/* #define DCOPY_CHUNK_SIZE (33554432) 16MB chunk */
+
+/*
+ * Bounds for adaptive chunk sizes. A chunk is never smaller than
+ * DCOPY_CHUNK_SIZE_MIN (unless the file itself is) nor larger than
+ * DCOPY_CHUNK_SIZE_MAX.
+ */
+#define DCOPY_CHUNK_SIZE_MIN (16777216)   /* 16MB chunk */
+#define DCOPY_CHUNK_SIZE_MAX (4294967296LL) /* 4GB chunk */
+
+/*
+ * Upper bound on the number of chunks a single file is split into, per rank
+ * in the job. This keeps huge files from flooding the queue.
+ */
+#define DCOPY_CHUNKS_PER_RANK (16)
+
+/*
+ * Regular files up to this size (in bytes) and links are copied in batches
+ * by default. A single batch carries at most DCOPY_BATCH_MAX_BYTES of data,
+ * and no larger threshold may be given, since the rank copying a batch holds
+ * each file in memory twice.
+ */
+#define DCOPY_BATCH_THRESHOLD (1048576)
+#define DCOPY_BATCH_MAX_BYTES (16777216)
+#define DCOPY_BATCH_THRESHOLD_MAX DCOPY_BATCH_MAX_BYTES
+
+/*
+ * Bytes of a batch operation taken up by fields other than the operand, the
+ * destination base appendix, and the list of names.
+ */
+#define DCOPY_BATCH_OVERHEAD (128)
 
 /* default mode to create new files or directories */
 #define DCOPY_DEF_PERMS_FILE (S_IRUSR | S_IWUSR)
@@ -71,10 +100,75 @@
 
 /*
  * block size to read and write file data,
- * should evenly divide DCOPY_CHUNK_SIZE
+ * should evenly divide every chunk size
  * */
 #define FD_BLOCK_SIZE (1048576)
 
+/*
+ * Alignment of buffers, offsets, and lengths for direct I/O. Every chunk
+ * offset is a multiple of this, so only the tail of a file needs care.
+ */
+#define DCOPY_DIRECT_ALIGN (4096)
+#define DCOPY_DIRECT_ROUND(x) \
+    (((x) + DCOPY_DIRECT_ALIGN - 1) / DCOPY_DIRECT_ALIGN * DCOPY_DIRECT_ALIGN)
+
+/*
+ * Number of open source and destination descriptors each rank keeps around
+ * for later chunks and stages of the same files.
+ */
+#define DCOPY_FD_CACHE_SIZE (64)
+
+/*
+ * The file table (filetable.c) is kept in slabs of this many bytes, and each
+ * rank caches this many records it looked up on other ranks.
+ */
+#define DCOPY_FILE_TABLE_SLAB (1048576)
+#define DCOPY_FILE_TABLE_CACHE_SIZE (64)
+
+/* What the count of unfinished chunks of a file starts at (filetable.c). */
+#define DCOPY_FILE_PENDING_HOLD (INT64_C(1) << 62)
+
+/*
+ * Counts of finished work for directories kept on other ranks (dirtable.c)
+ * are sent once this many are collected, or once the oldest has waited this
+ * many seconds.
+ */
+#define DCOPY_DIR_TABLE_BATCH (256)
+#define DCOPY_DIR_TABLE_DELAY (0.01)
+
+/*
+ * The records of the metadata pass (statstore.c) are packed into segments of
+ * this many bytes. By default, each rank keeps this many bytes of them in
+ * memory before it spills the oldest segments to local disk.
+ */
+#define DCOPY_STAT_SEGMENT (1048576)
+#define DCOPY_STAT_MEMORY (1073741824LL)
+
+/*
+ * With a bandwidth limit or drop-behind, data is moved in slices of at most
+ * this many bytes.
+ */
+#define DCOPY_SLICE_SIZE (4 * FD_BLOCK_SIZE)
+
+/* How far (in nanoseconds) a rank may run ahead of its allowed rate. */
+#define DCOPY_THROTTLE_BURST_NS (100000000LL)
+
+/* Most bytes a rank takes from the job-wide bandwidth limit at once. */
+#define DCOPY_THROTTLE_JOB_BATCH (4 * DCOPY_SLICE_SIZE)
+
+/* Number of idle FD_BLOCK_SIZE buffers each rank keeps around for reuse. */
+#define DCOPY_BUFFER_POOL_SIZE (4)
+
+/* Seconds between writes of the journal to disk. */
+#define DCOPY_JOURNAL_INTERVAL (10)
+
+/*
+ * Default number of blocks the io_uring copy engine keeps in flight per
+ * rank, and the most it will allow.
+ */
+#define DCOPY_QUEUE_DEPTH     (4)
+#define DCOPY_QUEUE_DEPTH_MAX (64)
+
 #ifndef PATH_MAX
 #define PATH_MAX (4096)
 #endif
@@ -86,9 +180,43 @@
 #endif
 
 typedef enum {
-    TREEWALK, COPY, CLEANUP, COMPARE
+    TREEWALK, COPY, CLEANUP, COMPARE, BATCH, VERIFY
 } DCOPY_operation_code_t;
 
+/*
+ * Flags carried by the chunks of a file through the copy, cleanup, and
+ * compare stages.
+ */
+#define DCOPY_OP_PREALLOCATED (1u << 0) /* destination already has its final size */
+#define DCOPY_OP_CLONED       (1u << 1) /* chunk shares its blocks with the source */
+#define DCOPY_OP_DIGEST       (1u << 2) /* digest holds the data the copy wrote */
+#define DCOPY_OP_DELTA        (1u << 3) /* only write what differs from the destination */
+#define DCOPY_OP_MATCHED      (1u << 4) /* destination already held this chunk */
+
+/*
+ * Where the record of a file is kept in the file table: the rank which
+ * registered it, and the address and length of the record on that rank.
+ */
+typedef struct {
+    int rank;       /* -1 if the file is not in the table */
+    uint32_t len;
+    uint64_t disp;
+} DCOPY_file_id_t;
+
+/*
+ * An entry of the directory table, which counts the work left below a
+ * directory: the rank which keeps it, and its index there.
+ */
+typedef struct {
+    int rank;       /* -1 if there is none */
+    int64_t index;
+} DCOPY_dir_id_t;
+
+/* Ways to move file data in the copy stage. */
+typedef enum {
+    DCOPY_ENGINE_RW, DCOPY_ENGINE_KERNEL, DCOPY_ENGINE_URING
+} DCOPY_copy_engine_t;
+
 typedef struct {
     /*
      * The total file size.
@@ -100,15 +228,39 @@ typedef struct {
      */
     int64_t chunk;
 
+    /*
+     * The number of chunks from chunk on which this operation stands for.
+     * Only the treewalk stage sends more than one, as a range which is split
+     * up when it is dequeued.
+     */
+    int64_t num_chunks;
+
+    /*
+     * The size of each chunk of this file (in bytes). The offset of this
+     * chunk is chunk * chunk_size.
+     */
+    int64_t chunk_size;
+
     /*
      * This offset represents the index into the operand path that gives the
-     * starting index of the root path to copy from.
+     * starting index of the root path to copy from. For a file-to-file copy,
+     * it is the length of the operand, so nothing is appended to the
+     * destination path.
      */
     uint16_t source_base_offset;
 
     /* The operation type. */
     DCOPY_operation_code_t code;
 
+    /* A mask of DCOPY_OP_* flags. */
+    uint32_t flags;
+
+    /*
+     * With DCOPY_OP_DIGEST, the digest of the data the copy stage wrote to
+     * this chunk, so the compare stage does not need to read the source.
+     */
+    uint64_t digest;
+
     /* The full source path. */
     char* operand;
 
@@ -120,12 +272,72 @@ typedef struct {
      */
     char* dest_base_appendix;
 
-    /* the full dest path */
+    /*
+     * The full dest path, built once when the operation is decoded. This is
+     * the only place the destination is named.
+     */
     char* dest_full_path;
+
+    /*
+     * For batch operations, the names of the small files inside the operand
+     * directory to process, separated by '/'.
+     */
+    char* batch;
+
+    /*
+     * For the chunks of a file, its record in the file table, which the
+     * operand, destination path, and sizes come from when it is decoded.
+     */
+    DCOPY_file_id_t file_id;
+
+    /*
+     * For walks and batches, the entry of the directory table they are
+     * counted in, so the directory is finished once all of them are done.
+     * A stage which hands the work on to another operation clears it.
+     */
+    DCOPY_dir_id_t parent;
 } DCOPY_operation_t;
 
+/*
+ * Storage for the paths of a decoded operation which are not in the message
+ * itself (codec.c), so decoding needs no allocation.
+ */
+typedef struct {
+    char operand[PATH_MAX];
+    char dest_full_path[PATH_MAX];
+} DCOPY_operation_paths_t;
+
 typedef struct {
     int64_t  total_bytes_copied;
+    int64_t  total_files_copied;
+    int64_t  total_bytes_cloned;
+    int64_t  total_files_skipped;
+    int64_t  total_bytes_skipped;
+    int64_t  total_bytes_examined;
+    int64_t  total_bytes_rewritten;
+    int64_t  total_chunks_resumed;
+    int64_t  total_bytes_resumed;
+    int64_t  operations_deferred;
+    int64_t  fd_cache_hits;
+    int64_t  fd_cache_misses;
+    int64_t  file_table_hits;
+    int64_t  file_table_misses;
+    int64_t  dirs_finished_early;
+    int64_t  files_finished_early;
+    int64_t  stat_bytes_spilled;
+    int64_t  throttled_ns;
+    int64_t  total_files_verified;
+    int64_t  total_bytes_verified;
+    int64_t  verify_failures;
+    int64_t  verify_mtime_changes;
+    int64_t  total_files_compared;
+    int64_t  total_bytes_compared;
+    int64_t  diff_missing;
+    int64_t  diff_extra;
+    int64_t  diff_changed;
+    int64_t  diff_chunks;
+    int64_t  differences;       /* the diff_* counts of all ranks, set by the epilogue */
+    int64_t  unfinished;        /* operations_deferred of all ranks, set after the copy */
     time_t   time_started;
     time_t   time_ended;
     double   wtime_started;
@@ -136,36 +348,66 @@ typedef struct {
     char*  dest_path;
     int    num_src_paths;
     char** src_path;
+    int64_t chunk_size;
+    int64_t batch_threshold;
+    DCOPY_copy_engine_t copy_engine;
+    int    queue_depth;
+    int64_t max_bandwidth;
+    int64_t max_rank_bandwidth;
+    char*  manifest_path;
+    char*  verify_path;
+    char*  diff_path;
+    char*  journal_path;
+    int64_t walltime;
+    int64_t stat_memory;
+    char*  spill_dir;
     bool   conditional;
+    bool   compare_only;
+    bool   update;
+    bool   delta;
+    bool   resume;
+    bool   direct;
     bool   skip_compare;
     bool   force;
     bool   preserve;
+    bool   preallocate;
+    bool   drop_behind;
+    bool   fsync;
     bool   recursive;
     bool   recursive_unspecified;
     bool   reliable_filesystem;
 } DCOPY_options_t;
 
-/* struct for elements in linked list */
-typedef struct list_elem {
-  char* file;             /* file name */
-  struct stat64* sb;      /* stat info */
-  int depth;
-  struct list_elem* next; /* pointer to next item */
-} DCOPY_stat_elem_t;
-
-extern DCOPY_stat_elem_t* DCOPY_list_head;
-extern DCOPY_stat_elem_t* DCOPY_list_tail;
-
-DCOPY_operation_t* DCOPY_decode_operation(char* op);
+/* number of ranks in the job */
+extern int DCOPY_global_size;
 
-void DCOPY_opt_free(DCOPY_operation_t** opt);
+void DCOPY_decode_operation(char* msg, \
+                            DCOPY_operation_t* op, \
+                            DCOPY_operation_paths_t* paths);
 
 char* DCOPY_encode_operation(DCOPY_operation_code_t code, \
                              int64_t chunk, \
                              char* operand, \
                              uint16_t source_base_offset, \
                              char* dest_base_appendix, \
-                             int64_t file_size);
+                             int64_t file_size, \
+                             int64_t chunk_size, \
+                             char* batch, \
+                             uint32_t flags, \
+                             uint64_t digest, \
+                             const DCOPY_dir_id_t* parent);
+
+char* DCOPY_encode_chunk(DCOPY_operation_code_t code, \
+                         DCOPY_operation_t* op, \
+                         int64_t chunk, \
+                         uint32_t flags, \
+                         uint64_t digest);
+
+char* DCOPY_encode_range(DCOPY_operation_code_t code, \
+                         DCOPY_operation_t* op, \
+                         int64_t chunk, \
+                         int64_t num_chunks, \
+                         uint32_t flags);
 
 void DCOPY_retry_failed_operation(DCOPY_operation_code_t target, \
                                   CIRCLE_handle* handle, \
@@ -177,16 +419,54 @@ void DCOPY_process_objects(CIRCLE_handle* handle);
 
 void DCOPY_unlink_destination(DCOPY_operation_t* op);
 
-FILE* DCOPY_open_input_stream(DCOPY_operation_t* op);
+bool DCOPY_same_link(const char* src_path, \
+                     const char* dest_path);
+
+int DCOPY_open_file(int dir_fd, \
+                    const char* path, \
+                    int flags, \
+                    mode_t mode);
 
 int DCOPY_open_input_fd(DCOPY_operation_t* op, \
                         off64_t offset, \
                         off64_t len);
 
-FILE* DCOPY_open_output_stream(DCOPY_operation_t* op);
+int DCOPY_open_dest_fd(DCOPY_operation_t* op, \
+                       int flags);
+
+int DCOPY_open_compare_fd(DCOPY_operation_t* op);
 
 int DCOPY_open_output_fd(DCOPY_operation_t* op);
 
+void DCOPY_start_writeback(int fd, \
+                           off64_t offset, \
+                           off64_t len);
+
+void DCOPY_drop_behind(int in_fd, \
+                       int out_fd, \
+                       off64_t start, \
+                       off64_t end);
+
+ssize_t DCOPY_read_fully(int fd, \
+                         void* buf, \
+                         size_t len, \
+                         off64_t offset);
+
+off64_t DCOPY_seek_data(int fd, \
+                        off64_t pos, \
+                        off64_t end, \
+                        off64_t* data_end);
+
+int DCOPY_check_zeros(int fd, \
+                      off64_t pos, \
+                      off64_t end);
+
+void* DCOPY_buffer_get(void);
+
+void DCOPY_buffer_put(void* buf);
+
+void DCOPY_buffer_pool_free(void);
+
 void DCOPY_copy_xattrs(
     DCOPY_operation_t* op,
     const struct stat64* statbuf,
@@ -208,6 +488,11 @@ void DCOPY_copy_timestamps(
     const char* dest_path
 );
 
+void DCOPY_copy_metadata(
+    const struct stat64* statbuf,
+    const char* dest_path
+);
+
 /* called by single process upon detection of a problem */
 void DCOPY_abort(int code) __attribute__((noreturn));
 
@@ -1,10 +1,18 @@
 /* See the file "COPYING" for the full license governing this code. */
 
 #include "compare.h"
+#include "cleanup.h"
+#include "diff.h"
+#include "digest.h"
+#include "fdcache.h"
+#include "manifest.h"
+#include "memscan.h"
+#include "throttle.h"
 #include "dcp.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -19,92 +27,274 @@ extern DCOPY_options_t DCOPY_user_opts;
 /** Statistics to gather for summary output. */
 extern DCOPY_statistics_t DCOPY_statistics;
 
+/*
+ * In compare-only mode, there is no copy to redo, so a chunk that can't be
+ * read or doesn't match is recorded as a difference instead.
+ */
+static void DCOPY_compare_only(DCOPY_operation_t* op, \
+                               off64_t offset)
+{
+    off64_t len = op->file_size - offset < op->chunk_size ? \
+                  op->file_size - offset : op->chunk_size;
+
+    int in_fd = DCOPY_fd_cache_source(op);
+    int out_fd = in_fd < 0 ? -1 : DCOPY_fd_cache_dest(op);
+
+    if(out_fd < 0) {
+        DCOPY_fd_cache_evict(op);
+        DCOPY_diff_chunk(op->dest_full_path, offset, len);
+    }
+    else if(DCOPY_perform_compare(op, in_fd, out_fd, offset) < 0) {
+        DCOPY_diff_chunk(op->dest_full_path, offset, len);
+    }
+
+    DCOPY_statistics.total_bytes_compared += len;
+}
+
 /* The entrance point to the compare operation. */
 void DCOPY_do_compare(DCOPY_operation_t* op, \
                       CIRCLE_handle* handle)
 {
-    FILE* in_ptr = DCOPY_open_input_stream(op);
+    off64_t offset = op->chunk_size * op->chunk;
 
-    if(in_ptr == NULL) {
-        LOG(DCOPY_LOG_DBG, "Failed to open input stream. %s", strerror(errno));
-        DCOPY_retry_failed_operation(COPY, handle, op);
+    if(DCOPY_user_opts.compare_only) {
+        DCOPY_compare_only(op, offset);
         return;
     }
 
-    FILE* out_ptr = DCOPY_open_output_stream(op);
+    /*
+     * A clone shares its blocks with the source, so it can't differ, and a
+     * delta that wrote nothing has just been compared block by block.
+     */
+    if((op->flags & (DCOPY_OP_CLONED | DCOPY_OP_MATCHED)) && !DCOPY_manifest_enabled()) {
+        DCOPY_cleanup_chunk_done(op);
+        return;
+    }
+
+    int in_fd = DCOPY_fd_cache_source(op);
 
-    if(out_ptr == NULL) {
-        LOG(DCOPY_LOG_DBG, "Failed to open output stream. %s", strerror(errno));
+    if(in_fd < 0) {
         DCOPY_retry_failed_operation(COPY, handle, op);
         return;
     }
 
-    if(DCOPY_perform_compare(op, in_ptr, out_ptr) < 0) {
+    int out_fd = DCOPY_fd_cache_dest(op);
+
+    if(out_fd < 0) {
         DCOPY_retry_failed_operation(COPY, handle, op);
         return;
     }
 
-    if(fclose(in_ptr) < 0) {
-        LOG(DCOPY_LOG_DBG, "Close on source file failed. %s", strerror(errno));
+    if(DCOPY_perform_compare(op, in_fd, out_fd, offset) < 0) {
+        DCOPY_fd_cache_evict(op);
+        DCOPY_retry_failed_operation(COPY, handle, op);
+        return;
     }
 
-    if(fclose(out_ptr) < 0) {
-        LOG(DCOPY_LOG_DBG, "Close on destination file failed. %s", strerror(errno));
-    }
+    DCOPY_cleanup_chunk_done(op);
 
     return;
 }
 
 /*
- * Perform the compare on this chunk.
+ * Compare [pos, end) of both files, one block at a time. With in_fd < 0,
+ * only the destination is read, and the digest of its blocks is added to
+ * *digest. The CRC32C of what is read from the destination is added to *crc.
+ */
+static int DCOPY_compare_range(DCOPY_operation_t* op, \
+                               int in_fd, \
+                               int out_fd, \
+                               off64_t* pos, \
+                               off64_t end, \
+                               void* src_buf, \
+                               void* dest_buf, \
+                               uint64_t* digest, \
+                               uint32_t* crc)
+{
+    off64_t start = *pos;
+    off64_t dropped = *pos;
+
+    while(*pos < end) {
+        size_t len = FD_BLOCK_SIZE;
+
+        if((off64_t) len > end - *pos) {
+            len = (size_t)(end - *pos);
+        }
+
+        /* Direct I/O reads whole aligned blocks, even at the tail. */
+        size_t io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(len) : len;
+
+        DCOPY_throttle(len);
+
+        if(in_fd < 0) {
+            ssize_t num_of_out_bytes = DCOPY_read_fully(out_fd, dest_buf, io_len, *pos);
+
+            if(num_of_out_bytes < 0) {
+                LOG(DCOPY_LOG_DBG, "Read error when comparing file `%s'. errno=%d %s", \
+                    op->operand, errno, strerror(errno));
+                return -1;
+            }
+
+            if(num_of_out_bytes > (ssize_t) len) {
+                num_of_out_bytes = (ssize_t) len;
+            }
+
+            *digest ^= DCOPY_digest_block(*pos, dest_buf, (size_t) num_of_out_bytes);
+            *crc = DCOPY_crc32c(*crc, dest_buf, (size_t) num_of_out_bytes);
+            *pos += num_of_out_bytes;
+
+            if(*pos - dropped >= DCOPY_SLICE_SIZE) {
+                DCOPY_drop_behind(in_fd, out_fd, start, *pos);
+                dropped = *pos;
+            }
+
+            if(num_of_out_bytes < (ssize_t) len) {
+                break;
+            }
+
+            continue;
+        }
+
+        ssize_t num_of_in_bytes = DCOPY_read_fully(in_fd, src_buf, io_len, *pos);
+        ssize_t num_of_out_bytes = DCOPY_read_fully(out_fd, dest_buf, io_len, *pos);
+
+        if(num_of_in_bytes < 0 || num_of_out_bytes < 0) {
+            LOG(DCOPY_LOG_DBG, "Read error when comparing file `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            return -1;
+        }
+
+        if(num_of_in_bytes > (ssize_t) len) {
+            num_of_in_bytes = (ssize_t) len;
+        }
+
+        if(num_of_out_bytes > (ssize_t) len) {
+            num_of_out_bytes = (ssize_t) len;
+        }
+
+        if(num_of_in_bytes != num_of_out_bytes) {
+            LOG(DCOPY_LOG_DBG, "Source byte count `%zd' does not match " \
+                "destination byte count '%zd' of total file size `%" PRId64 "'.", \
+                num_of_in_bytes, num_of_out_bytes, op->file_size);
+            return -1;
+        }
+
+        if(!DCOPY_mem_equal(src_buf, dest_buf, (size_t) num_of_in_bytes)) {
+            LOG(DCOPY_LOG_ERR, "Compare mismatch when copying from file `%s'.", \
+                op->operand);
+            return -1;
+        }
+
+        *crc = DCOPY_crc32c(*crc, dest_buf, (size_t) num_of_in_bytes);
+
+        *pos += num_of_in_bytes;
+
+        /* as in the copy stage, drop everything read so far */
+        if(*pos - dropped >= DCOPY_SLICE_SIZE) {
+            DCOPY_drop_behind(in_fd, out_fd, start, *pos);
+            dropped = *pos;
+        }
+
+        if(num_of_in_bytes < (ssize_t) len) {
+            break;
+        }
+    }
+
+    DCOPY_drop_behind(in_fd, out_fd, start, *pos);
+
+    return 1;
+}
+
+/*
+ * Perform the compare on this chunk. Holes in the source are not read; the
+ * destination only has to read as zeros there. If the copy stage left a
+ * digest of the data it wrote, the source is not read at all, and neither is
+ * it for chunks that are only read back for the manifest (cloned, or with
+ * the compare skipped).
  */
 int DCOPY_perform_compare(DCOPY_operation_t* op, \
-                          FILE* in_ptr, \
-                          FILE* out_ptr)
+                          int in_fd, \
+                          int out_fd, \
+                          off64_t offset)
 {
-    size_t num_of_in_bytes = 0;
-    size_t num_of_out_bytes = 0;
+    off64_t end = offset + op->chunk_size;
+    off64_t pos = offset;
+    void* src_buf = NULL;
+    void* dest_buf = NULL;
+    uint64_t digest = 0;
+    uint32_t crc = 0;
+    bool read_source = !(op->flags & (DCOPY_OP_DIGEST | DCOPY_OP_CLONED)) && \
+                       !DCOPY_user_opts.skip_compare;
+    int rc = 1;
+
+    if(end > op->file_size) {
+        end = op->file_size;
+    }
+
+    while(pos < end && rc > 0) {
+        off64_t data_end;
+        off64_t data = DCOPY_seek_data(in_fd, pos, end, &data_end);
 
-    void* src_buf = (void*) malloc(sizeof(char) * DCOPY_CHUNK_SIZE);
-    void* dest_buf = (void*) malloc(sizeof(char) * DCOPY_CHUNK_SIZE);
+        /* Direct I/O needs aligned ranges, just like the copy. */
+        if(DCOPY_user_opts.direct) {
+            data -= data % DCOPY_DIRECT_ALIGN;
 
-    fseeko64(in_ptr, (int64_t)DCOPY_CHUNK_SIZE * (int64_t)op->chunk, SEEK_SET);
-    fseeko64(out_ptr, DCOPY_CHUNK_SIZE * op->chunk, SEEK_SET);
+            if(data_end < end) {
+                data_end = DCOPY_DIRECT_ROUND(data_end);
+                data_end = data_end < end ? data_end : end;
+            }
+        }
 
-    num_of_in_bytes = fread(src_buf, 1, DCOPY_CHUNK_SIZE, in_ptr);
-    num_of_out_bytes = fread(dest_buf, 1, DCOPY_CHUNK_SIZE, out_ptr);
+        if(data > pos) {
+            if(DCOPY_check_zeros(out_fd, pos, data) < 0) {
+                LOG(DCOPY_LOG_ERR, "Compare mismatch in a hole when copying " \
+                    "from file `%s'.", op->operand);
+                rc = -1;
+                break;
+            }
 
-    if(num_of_in_bytes != num_of_out_bytes) {
-        LOG(DCOPY_LOG_DBG, "Source byte count `%zu' does not match " \
-            "destination byte count '%zu' of total file size `%zu'.", \
-            num_of_in_bytes, num_of_out_bytes, op->file_size);
+            crc = DCOPY_crc32c_zeros(crc, data - pos);
+            pos = data;
+        }
 
-        free(src_buf);
-        free(dest_buf);
+        if(pos >= end) {
+            break;
+        }
 
-        return -1;
+        if(src_buf == NULL) {
+            src_buf = DCOPY_buffer_get();
+            dest_buf = DCOPY_buffer_get();
+        }
+
+        rc = DCOPY_compare_range(op, read_source ? in_fd : -1, out_fd, &pos, data_end, \
+                                 src_buf, dest_buf, &digest, &crc);
+
+        if(pos < data_end) {
+            break;
+        }
+    }
+
+    if(src_buf != NULL) {
+        DCOPY_buffer_put(src_buf);
+        DCOPY_buffer_put(dest_buf);
     }
 
-    if(memcmp(src_buf, dest_buf, num_of_in_bytes) != 0) {
+    if(rc > 0 && (op->flags & DCOPY_OP_DIGEST) && digest != op->digest) {
         LOG(DCOPY_LOG_ERR, "Compare mismatch when copying from file `%s'.", \
             op->operand);
+        rc = -1;
+    }
 
-        free(src_buf);
-        free(dest_buf);
-
-        return -1;
+    if(rc > 0) {
+        DCOPY_manifest_chunk(op->dest_full_path, offset, pos - offset, crc);
     }
-    else {
-        /*
-                LOG(DCOPY_LOG_DBG, "File `%s' (chunk `%d') compare successful.", \
-                    op->operand, op->chunk);
-        */
 
-        free(src_buf);
-        free(dest_buf);
+    /*
+            LOG(DCOPY_LOG_DBG, "File `%s' (chunk `%d') compare successful.", \
+                op->operand, op->chunk);
+    */
 
-        return 1;
-    }
+    return rc;
 }
 
 /* EOF */
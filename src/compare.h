@@ -9,7 +9,8 @@ void DCOPY_do_compare(DCOPY_operation_t* op, \
                       CIRCLE_handle* handle);
 
 int DCOPY_perform_compare(DCOPY_operation_t* op, \
-                          FILE* in_ptr, \
-                          FILE* out_ptr);
+                          int in_fd, \
+                          int out_fd, \
+                          off64_t offset);
 
 #endif /* __DCP_COMPARE_H */
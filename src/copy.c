@@ -1,7 +1,12 @@
 /* See the file "COPYING" for the full license governing this code. */
 
 #include "copy.h"
+#include "digest.h"
+#include "fdcache.h"
+#include "memscan.h"
+#include "throttle.h"
 #include "treewalk.h"
+#include "uring.h"
 #include "dcp.h"
 
 #include <errno.h>
@@ -13,7 +18,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <inttypes.h>
-// #include <sys/sendfile.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 /** Options specified by the user. */
 extern DCOPY_options_t DCOPY_user_opts;
@@ -25,109 +38,811 @@ extern DCOPY_statistics_t DCOPY_statistics;
 void DCOPY_do_copy(DCOPY_operation_t* op, \
                    CIRCLE_handle* handle)
 {
-    off64_t offset = DCOPY_CHUNK_SIZE * op->chunk;
-    int in_fd = DCOPY_open_input_fd(op, offset, DCOPY_CHUNK_SIZE);
+    off64_t offset = op->chunk_size * op->chunk;
+    int in_fd = DCOPY_fd_cache_source(op);
+
+    /* a retried chunk is copied from scratch */
+    op->flags &= ~(DCOPY_OP_CLONED | DCOPY_OP_DIGEST | DCOPY_OP_MATCHED);
 
     if(in_fd < 0) {
         DCOPY_retry_failed_operation(COPY, handle, op);
         return;
     }
 
-    int out_fd = DCOPY_open_output_fd(op);
+    int out_fd = DCOPY_fd_cache_dest(op);
 
+    /*
+     * With force, the treewalk stage already replaced a destination it could
+     * not open. Unlinking it here would lose the chunks other ranks wrote,
+     * and could change its directory after that got its attributes.
+     */
     if(out_fd < 0) {
+        DCOPY_retry_failed_operation(COPY, handle, op);
+        return;
+    }
+
+    if(DCOPY_perform_copy(op, in_fd, out_fd, offset) < 0) {
+        /* Start over with fresh descriptors. */
+        DCOPY_fd_cache_evict(op);
+        DCOPY_retry_failed_operation(COPY, handle, op);
+        return;
+    }
+
+    DCOPY_enqueue_cleanup_stage(op, handle);
+
+    return;
+}
+
+/*
+ * Write len bytes of buf to the destination at pos. With direct I/O, the
+ * write is padded with zeros to a whole aligned block, so buf must have room
+ * for that. Returns -1 on error.
+ */
+static int DCOPY_copy_write(DCOPY_operation_t* op, \
+                            int out_fd, \
+                            char* buf, \
+                            size_t len, \
+                            off64_t pos)
+{
+    size_t write_len = len;
+
+    if(DCOPY_user_opts.direct) {
+        write_len = DCOPY_DIRECT_ROUND(write_len);
+        memset(buf + len, 0, write_len - len);
+    }
+
+    size_t total_bytes_written = 0;
+
+    while(total_bytes_written < write_len) {
+        ssize_t num_of_bytes_written = pwrite64(out_fd, \
+                                                buf + total_bytes_written, \
+                                                write_len - total_bytes_written, \
+                                                pos + (off64_t) total_bytes_written);
+
+        if(num_of_bytes_written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            LOG(DCOPY_LOG_ERR, "Write error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            return -1;
+        }
+
+        total_bytes_written += (size_t) num_of_bytes_written;
+    }
+
+    return 1;
+}
+
+/*
+ * Copy the rest of [*pos, end) with pread and pwrite through a userspace
+ * buffer. This always works, so it is also the fallback for the kernel
+ * engine. With direct I/O, the tail of the file is read and written as a
+ * whole aligned block and the cleanup stage truncates the padding off.
+ * Returns -1 on error.
+ */
+static int DCOPY_copy_rw(DCOPY_operation_t* op, \
+                         int in_fd, \
+                         int out_fd, \
+                         off64_t* pos, \
+                         off64_t end)
+{
+    char* io_buf = (char*) DCOPY_buffer_get();
+    int rc = 1;
+
+    while(*pos < end) {
+        size_t len = FD_BLOCK_SIZE;
+
+        if((off64_t) len > end - *pos) {
+            len = (size_t)(end - *pos);
+        }
+
+        size_t io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(len) : len;
+
         /*
-         * If the force option is specified, try to unlink the destination and
-         * reopen before doing the optional requeue.
+         * Only the end of the file cuts a block short, so the digest covers
+         * the same blocks the compare stage reads back.
          */
-        if(DCOPY_user_opts.force) {
-            DCOPY_unlink_destination(op);
-            out_fd = DCOPY_open_output_fd(op);
+        ssize_t num_of_bytes_read = DCOPY_read_fully(in_fd, io_buf, io_len, *pos);
+
+        if(num_of_bytes_read < 0) {
+            LOG(DCOPY_LOG_ERR, "Read error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            rc = -1;
+            break;
+        }
+
+        if(!num_of_bytes_read) {
+            /* The source shrank; cleanup truncates to the size we walked. */
+            break;
+        }
+
+        if(num_of_bytes_read > (ssize_t) len) {
+            num_of_bytes_read = (ssize_t) len;
+        }
+
+        if(op->flags & DCOPY_OP_DIGEST) {
+            op->digest ^= DCOPY_digest_block(*pos, io_buf, (size_t) num_of_bytes_read);
+        }
+
+        if(DCOPY_copy_write(op, out_fd, io_buf, (size_t) num_of_bytes_read, *pos) < 0) {
+            rc = -1;
+            break;
+        }
+
+        *pos += num_of_bytes_read;
+
+        /* A short read is the end of the file. */
+        if(num_of_bytes_read < (ssize_t) len) {
+            break;
+        }
+    }
+
+    DCOPY_buffer_put(io_buf);
+
+    return rc;
+}
+
+/*
+ * Bring [*pos, end) of an existing destination up to date with the source,
+ * one block at a time: both sides are read, and a block is only written if
+ * it differs. The data is digested as in DCOPY_copy_rw, so the compare stage
+ * still only reads the destination back. Returns -1 on error.
+ */
+static int DCOPY_copy_delta(DCOPY_operation_t* op, \
+                            int in_fd, \
+                            int out_fd, \
+                            off64_t* pos, \
+                            off64_t end)
+{
+    char* io_buf = (char*) DCOPY_buffer_get();
+    char* dest_buf = (char*) DCOPY_buffer_get();
+    off64_t start = *pos;
+    int rc = 1;
+
+    while(*pos < end) {
+        size_t len = FD_BLOCK_SIZE;
+
+        if((off64_t) len > end - *pos) {
+            len = (size_t)(end - *pos);
+        }
+
+        size_t io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(len) : len;
+
+        DCOPY_throttle(len);
 
-            if(out_fd < 0) {
-                DCOPY_retry_failed_operation(COPY, handle, op);
-                return;
+        ssize_t num_of_bytes_read = DCOPY_read_fully(in_fd, io_buf, io_len, *pos);
+
+        if(num_of_bytes_read < 0) {
+            LOG(DCOPY_LOG_ERR, "Read error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            rc = -1;
+            break;
+        }
+
+        if(!num_of_bytes_read) {
+            /* The source shrank; cleanup truncates to the size we walked. */
+            break;
+        }
+
+        if(num_of_bytes_read > (ssize_t) len) {
+            num_of_bytes_read = (ssize_t) len;
+        }
+
+        size_t n = (size_t) num_of_bytes_read;
+
+        if(op->flags & DCOPY_OP_DIGEST) {
+            op->digest ^= DCOPY_digest_block(*pos, io_buf, n);
+        }
+
+        /* a destination that is short or unreadable here just gets rewritten */
+        ssize_t num_of_dest_bytes = DCOPY_read_fully(out_fd, dest_buf, io_len, *pos);
+
+        if(num_of_dest_bytes < (ssize_t) n || !DCOPY_mem_equal(io_buf, dest_buf, n)) {
+            if(DCOPY_copy_write(op, out_fd, io_buf, n, *pos) < 0) {
+                rc = -1;
+                break;
             }
+
+            DCOPY_statistics.total_bytes_rewritten += (int64_t) n;
         }
-        else {
-            DCOPY_retry_failed_operation(COPY, handle, op);
-            return;
+
+        DCOPY_statistics.total_bytes_examined += (int64_t) n;
+        *pos += (off64_t) n;
+
+        /* A direct read that ends off alignment is the end of the file. */
+        if(DCOPY_user_opts.direct && n % DCOPY_DIRECT_ALIGN != 0) {
+            break;
         }
     }
 
-    if(DCOPY_perform_copy(op, in_fd, out_fd, offset) < 0) {
-        DCOPY_retry_failed_operation(COPY, handle, op);
-        return;
+    if(DCOPY_user_opts.drop_behind) {
+        DCOPY_drop_behind(in_fd, out_fd, start, *pos);
     }
 
-    if(close(in_fd) < 0) {
-        LOG(DCOPY_LOG_DBG, "Close on source file failed. errno=%d %s", errno, strerror(errno));
+    DCOPY_buffer_put(dest_buf);
+    DCOPY_buffer_put(io_buf);
+
+    return rc;
+}
+
+/*
+ * Kernel copy paths that turned out not to work for this job. Once one
+ * fails with an error that means "not here", this rank stops trying it.
+ */
+static bool DCOPY_skip_copy_file_range = false;
+static bool DCOPY_skip_sendfile = false;
+static bool DCOPY_skip_splice = false;
+static bool DCOPY_skip_clone = false;
+
+/* Pipe used to splice file data through the kernel, created on first use. */
+static int DCOPY_splice_pipe[2] = { -1, -1 };
+
+/*
+ * Check whether errno says a kernel copy path is unusable for these files,
+ * so the range falls back to another engine. Only a kernel or filesystem
+ * that lacks the path turns it off for the rest of the job (through skip).
+ * Anything else, e.g. EINVAL or EBADF for a file the path can't handle,
+ * only affects this range.
+ */
+static bool DCOPY_copy_fallback(int err, \
+                                bool* skip)
+{
+    if(err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == ENOTSUP) {
+        *skip = true;
+        return true;
     }
 
-    if(close(out_fd) < 0) {
-        LOG(DCOPY_LOG_DBG, "Close on destination file failed. errno=%d %s", errno, strerror(errno));
+    return err == EINVAL || err == EBADF;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Move [*pos, end) with copy_file_range, which lets the filesystem copy (or
+ * share) the data without it ever reaching userspace. Returns 1 when the
+ * range is done, 0 to fall back to another engine at *pos, -1 on error.
+ */
+static int DCOPY_copy_file_range(DCOPY_operation_t* op, \
+                                 int in_fd, \
+                                 int out_fd, \
+                                 off64_t* pos, \
+                                 off64_t end)
+{
+    while(*pos < end) {
+        loff_t in_off = *pos;
+        loff_t out_off = *pos;
+
+        ssize_t num_of_bytes = copy_file_range(in_fd, &in_off, out_fd, &out_off, \
+                                               (size_t)(end - *pos), 0);
+
+        if(num_of_bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(DCOPY_copy_fallback(errno, &DCOPY_skip_copy_file_range)) {
+                LOG(DCOPY_LOG_DBG, "copy_file_range not usable for `%s'. errno=%d %s", \
+                    op->operand, errno, strerror(errno));
+                return 0;
+            }
+
+            LOG(DCOPY_LOG_ERR, "Kernel copy error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            return -1;
+        }
+
+        if(!num_of_bytes) {
+            /* Let the read/write engine tell a short file from a lazy one. */
+            return 0;
+        }
+
+        *pos += num_of_bytes;
     }
 
-    DCOPY_enqueue_cleanup_stage(op, handle);
+    return 1;
+}
+#endif /* HAVE_COPY_FILE_RANGE */
 
-    return;
+#ifdef HAVE_SYS_SENDFILE_H
+/*
+ * Move [*pos, end) with sendfile. The destination is written at its file
+ * offset, so seek there first. Same return values as above.
+ */
+static int DCOPY_copy_sendfile(DCOPY_operation_t* op, \
+                               int in_fd, \
+                               int out_fd, \
+                               off64_t* pos, \
+                               off64_t end)
+{
+    if(lseek64(out_fd, *pos, SEEK_SET) < 0) {
+        LOG(DCOPY_LOG_ERR, "Couldn't seek in destination path (source is `%s'). errno=%d %s", \
+            op->operand, errno, strerror(errno));
+        return -1;
+    }
+
+    while(*pos < end) {
+        off64_t in_off = *pos;
+
+        ssize_t num_of_bytes = sendfile64(out_fd, in_fd, &in_off, \
+                                          (size_t)(end - *pos));
+
+        if(num_of_bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(DCOPY_copy_fallback(errno, &DCOPY_skip_sendfile)) {
+                LOG(DCOPY_LOG_DBG, "sendfile not usable for `%s'. errno=%d %s", \
+                    op->operand, errno, strerror(errno));
+                return 0;
+            }
+
+            LOG(DCOPY_LOG_ERR, "Kernel copy error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            return -1;
+        }
+
+        if(!num_of_bytes) {
+            return 0;
+        }
+
+        *pos += num_of_bytes;
+    }
+
+    return 1;
+}
+#endif /* HAVE_SYS_SENDFILE_H */
+
+#ifdef HAVE_SPLICE
+/* Close the splice pipe, e.g. when data got stuck in it after an error. */
+static void DCOPY_close_splice_pipe(void)
+{
+    if(DCOPY_splice_pipe[0] >= 0) {
+        close(DCOPY_splice_pipe[0]);
+        close(DCOPY_splice_pipe[1]);
+    }
+
+    DCOPY_splice_pipe[0] = -1;
+    DCOPY_splice_pipe[1] = -1;
+}
+
+/*
+ * Move [*pos, end) by splicing the source into a pipe and the pipe into the
+ * destination. Same return values as above.
+ */
+static int DCOPY_copy_splice(DCOPY_operation_t* op, \
+                             int in_fd, \
+                             int out_fd, \
+                             off64_t* pos, \
+                             off64_t end)
+{
+    if(DCOPY_splice_pipe[0] < 0) {
+        if(pipe(DCOPY_splice_pipe) < 0) {
+            LOG(DCOPY_LOG_DBG, "Could not create splice pipe. errno=%d %s", \
+                errno, strerror(errno));
+            DCOPY_skip_splice = true;
+            DCOPY_splice_pipe[0] = -1;
+            return 0;
+        }
+
+#ifdef F_SETPIPE_SZ
+        /* A larger pipe means fewer round trips; the default is fine too. */
+        fcntl(DCOPY_splice_pipe[1], F_SETPIPE_SZ, FD_BLOCK_SIZE);
+#endif
+    }
+
+    while(*pos < end) {
+        loff_t in_off = *pos;
+
+        ssize_t num_of_bytes_in = splice(in_fd, &in_off, DCOPY_splice_pipe[1], NULL, \
+                                         (size_t)(end - *pos), SPLICE_F_MOVE);
+
+        if(num_of_bytes_in < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(DCOPY_copy_fallback(errno, &DCOPY_skip_splice)) {
+                LOG(DCOPY_LOG_DBG, "splice not usable for `%s'. errno=%d %s", \
+                    op->operand, errno, strerror(errno));
+                return 0;
+            }
+
+            LOG(DCOPY_LOG_ERR, "Kernel copy error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            return -1;
+        }
+
+        if(!num_of_bytes_in) {
+            return 0;
+        }
+
+        ssize_t num_of_bytes_out = 0;
+
+        while(num_of_bytes_out < num_of_bytes_in) {
+            loff_t out_off = *pos + num_of_bytes_out;
+
+            ssize_t num_of_bytes = splice(DCOPY_splice_pipe[0], NULL, out_fd, &out_off, \
+                                          (size_t)(num_of_bytes_in - num_of_bytes_out), \
+                                          SPLICE_F_MOVE);
+
+            if(num_of_bytes <= 0) {
+                if(num_of_bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                int err = errno;
+
+                /* Whatever is left in the pipe belongs to this range. */
+                DCOPY_close_splice_pipe();
+
+                if(num_of_bytes < 0 && DCOPY_copy_fallback(err, &DCOPY_skip_splice)) {
+                    LOG(DCOPY_LOG_DBG, "splice not usable for `%s'. errno=%d %s", \
+                        op->operand, err, strerror(err));
+
+                    /* Resume after what did reach the destination. */
+                    *pos += num_of_bytes_out;
+                    return 0;
+                }
+
+                LOG(DCOPY_LOG_ERR, "Kernel copy error when copying from `%s'. errno=%d %s", \
+                    op->operand, err, strerror(err));
+                return -1;
+            }
+
+            num_of_bytes_out += num_of_bytes;
+        }
+
+        *pos += num_of_bytes_out;
+    }
+
+    return 1;
+}
+#endif /* HAVE_SPLICE */
+
+/*
+ * Move as much of [*pos, end) as possible without bouncing it through
+ * userspace, trying each kernel path in turn. Returns 1 when the range is
+ * done, 0 if the caller should finish it from *pos, and -1 on error.
+ */
+static int DCOPY_copy_kernel(DCOPY_operation_t* op, \
+                             int in_fd, \
+                             int out_fd, \
+                             off64_t* pos, \
+                             off64_t end)
+{
+    int rc = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+
+    if(rc == 0 && !DCOPY_skip_copy_file_range) {
+        rc = DCOPY_copy_file_range(op, in_fd, out_fd, pos, end);
+    }
+
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+
+    if(rc == 0 && !DCOPY_skip_sendfile) {
+        rc = DCOPY_copy_sendfile(op, in_fd, out_fd, pos, end);
+    }
+
+#endif
+
+#ifdef HAVE_SPLICE
+
+    if(rc == 0 && !DCOPY_skip_splice) {
+        rc = DCOPY_copy_splice(op, in_fd, out_fd, pos, end);
+    }
+
+#endif
+
+    return rc;
+}
+
+/* Release anything the copy engines kept open between operations. */
+void DCOPY_copy_finalize(void)
+{
+#ifdef HAVE_SPLICE
+    DCOPY_close_splice_pipe();
+#endif
+
+    DCOPY_uring_finalize();
+}
+
+/*
+ * Make sure [pos, end) of the destination reads as zeros, for a range that
+ * is a hole in the source. A fresh destination already has a hole there,
+ * so this only does work when an existing file is overwritten.
+ */
+static int DCOPY_copy_hole(DCOPY_operation_t* op, \
+                           int out_fd, \
+                           off64_t pos, \
+                           off64_t end)
+{
+    off64_t data_end;
+
+    if(DCOPY_seek_data(out_fd, pos, end, &data_end) >= end) {
+        return 1;
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+
+    if(fallocate64(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, \
+                   pos, end - pos) == 0) {
+        return 1;
+    }
+
+#endif
+
+    /* Without hole punching, old data has to be overwritten with zeros. */
+    char* zeros = (char*) DCOPY_buffer_get();
+    int rc = 1;
+
+    memset(zeros, 0, FD_BLOCK_SIZE);
+
+    while(pos < end && rc > 0) {
+        size_t len = FD_BLOCK_SIZE;
+
+        if((off64_t) len > end - pos) {
+            len = (size_t)(end - pos);
+        }
+
+        ssize_t num_of_bytes_written = pwrite64(out_fd, zeros, \
+                                                DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(len) : len, \
+                                                pos);
+
+        if(num_of_bytes_written < 0 && errno != EINTR) {
+            LOG(DCOPY_LOG_ERR, "Write error when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            rc = -1;
+        }
+        else if(num_of_bytes_written > 0) {
+            pos += num_of_bytes_written;
+        }
+    }
+
+    DCOPY_buffer_put(zeros);
+
+    return rc;
+}
+
+#ifdef FICLONERANGE
+/*
+ * Make [offset, end) of the destination a copy-on-write clone of the same
+ * range of the source, so no data is moved at all. This only works when both
+ * files are on the same filesystem and it supports sharing blocks (e.g.
+ * btrfs or XFS). Returns 1 when the range was cloned, 0 to copy it instead.
+ */
+static int DCOPY_copy_clone(DCOPY_operation_t* op, \
+                            int in_fd, \
+                            int out_fd, \
+                            off64_t offset, \
+                            off64_t end)
+{
+    struct file_clone_range range;
+
+    range.src_fd = in_fd;
+    range.src_offset = (uint64_t) offset;
+    range.src_length = (uint64_t)(end - offset);
+    range.dest_offset = (uint64_t) offset;
+
+    if(ioctl(out_fd, FICLONERANGE, &range) == 0) {
+        return 1;
+    }
+
+    /* Anything else, e.g. EINVAL for an odd range, only affects this chunk. */
+    if(errno == EXDEV || errno == EOPNOTSUPP || errno == ENOTSUP || \
+            errno == ENOTTY || errno == ENOSYS) {
+        LOG(DCOPY_LOG_DBG, "Cloning is not supported for `%s', copying data " \
+            "instead. errno=%d %s", op->operand, errno, strerror(errno));
+        DCOPY_skip_clone = true;
+    }
+
+    return 0;
+}
+#endif /* FICLONERANGE */
+
+/*
+ * Copy [*pos, end), which should all be data, with the chosen engine.
+ */
+static int DCOPY_copy_range(DCOPY_operation_t* op, \
+                            int in_fd, \
+                            int out_fd, \
+                            off64_t* pos, \
+                            off64_t end)
+{
+    int rc = 0;
+
+    /* The kernel paths would go through the page cache. */
+    if(DCOPY_user_opts.copy_engine == DCOPY_ENGINE_KERNEL && !DCOPY_user_opts.direct) {
+        off64_t start = *pos;
+
+        rc = DCOPY_copy_kernel(op, in_fd, out_fd, pos, end);
+
+        /* We never saw that data, so the compare has to read the source. */
+        if(*pos != start) {
+            op->flags &= ~DCOPY_OP_DIGEST;
+        }
+    }
+    else if(DCOPY_user_opts.copy_engine == DCOPY_ENGINE_URING) {
+        rc = DCOPY_uring_copy(op, in_fd, out_fd, pos, end);
+    }
+
+    if(rc == 0) {
+        rc = DCOPY_copy_rw(op, in_fd, out_fd, pos, end);
+    }
+
+    return rc;
+}
+
+/*
+ * Copy [*pos, end) with the chosen engine. With a bandwidth limit or
+ * drop-behind, this goes in slices of DCOPY_SLICE_SIZE bytes. Each slice
+ * first waits for the bandwidth limits. Once it is written, its writeback is
+ * started and what was written before it, since the last drop, is dropped
+ * from the page cache. The page cache only drops whole folios, which may
+ * straddle a slice boundary, so the whole range is dropped once more at the
+ * end to catch those.
+ */
+static int DCOPY_copy_slices(DCOPY_operation_t* op, \
+                             int in_fd, \
+                             int out_fd, \
+                             off64_t* pos, \
+                             off64_t end)
+{
+    if(!DCOPY_throttle_enabled() && !DCOPY_user_opts.drop_behind) {
+        return DCOPY_copy_range(op, in_fd, out_fd, pos, end);
+    }
+
+    off64_t start = *pos;
+    off64_t dropped = start;
+    int rc = 1;
+
+    while(*pos < end) {
+        off64_t slice_start = *pos;
+        off64_t slice_end = end;
+
+        if(slice_end - slice_start > DCOPY_SLICE_SIZE) {
+            slice_end = slice_start + DCOPY_SLICE_SIZE;
+        }
+
+        DCOPY_throttle((size_t)(slice_end - slice_start));
+
+        if(DCOPY_copy_range(op, in_fd, out_fd, pos, slice_end) < 0) {
+            rc = -1;
+            break;
+        }
+
+        DCOPY_start_writeback(out_fd, slice_start, *pos - slice_start);
+        DCOPY_drop_behind(in_fd, out_fd, dropped, slice_start);
+        dropped = slice_start;
+
+        if(*pos < slice_end) {
+            /* The source shrank; the caller notices. */
+            break;
+        }
+    }
+
+    DCOPY_drop_behind(in_fd, out_fd, start, *pos);
+
+    return rc;
 }
 
 /*
  * Perform the actual copy on this chunk and increment the global statistics
- * counter.
+ * counter. Exactly the bytes of this chunk, [offset, offset + chunk_size)
+ * clipped to the file size, are copied. Holes in the source are skipped, and
+ * only bytes of data are counted.
+ *
+ * The kernel engine first tries to clone the whole chunk. A cloned chunk is
+ * marked with DCOPY_OP_CLONED so the compare stage can skip it.
+ *
+ * Data that passes through userspace is digested on the way, block by block.
+ * If all of the chunk did, it is marked with DCOPY_OP_DIGEST and the compare
+ * stage checks the destination against the digest instead of the source.
+ *
+ * A chunk marked with DCOPY_OP_DELTA goes to an existing destination, and
+ * only the blocks that differ from the source are written. If none did, it
+ * is marked with DCOPY_OP_MATCHED so the compare stage can skip it.
  */
 int DCOPY_perform_copy(DCOPY_operation_t* op, \
                        int in_fd, \
                        int out_fd, \
                        off64_t offset)
 {
-    ssize_t num_of_bytes_read = 0;
-    ssize_t num_of_bytes_written = 0;
-    ssize_t total_bytes_written = 0;
+    off64_t end = offset + op->chunk_size;
+    off64_t pos = offset;
+    off64_t copied = 0;
+    bool delta = (op->flags & DCOPY_OP_DELTA) != 0;
+    int64_t rewritten = DCOPY_statistics.total_bytes_rewritten;
 
-    char io_buf[FD_BLOCK_SIZE];
+    if(end > op->file_size) {
+        end = op->file_size;
+    }
 
-    if(lseek64(in_fd, offset, SEEK_SET) < 0) {
-        LOG(DCOPY_LOG_ERR, "Couldn't seek in source path `%s'. errno=%d %s", \
-            op->operand, errno, strerror(errno));
-        /* Handle operation requeue in parent function. */
-        return -1;
+#ifdef FICLONERANGE
+
+    if(DCOPY_user_opts.copy_engine == DCOPY_ENGINE_KERNEL && \
+            !DCOPY_user_opts.direct && !DCOPY_skip_clone && !delta && pos < end && \
+            DCOPY_copy_clone(op, in_fd, out_fd, pos, end)) {
+        DCOPY_statistics.total_bytes_cloned += end - pos;
+        op->flags |= DCOPY_OP_CLONED;
+        return 1;
     }
 
-    if(lseek64(out_fd, offset, SEEK_SET) < 0) {
-        LOG(DCOPY_LOG_ERR, "Couldn't seek in destination path (source is `%s'). errno=%d %s", \
-            op->operand, errno, strerror(errno));
-        return -1;
+#endif
+
+    op->digest = 0;
+
+    if(!DCOPY_user_opts.skip_compare) {
+        op->flags |= DCOPY_OP_DIGEST;
     }
 
-    while(total_bytes_written <= DCOPY_CHUNK_SIZE) {
+    while(pos < end) {
+        off64_t data_end;
+        off64_t data = DCOPY_seek_data(in_fd, pos, end, &data_end);
 
-        num_of_bytes_read = read(in_fd, &io_buf[0], sizeof(io_buf));
+        /* Direct I/O needs aligned ranges; copying a little hole is fine. */
+        if(DCOPY_user_opts.direct) {
+            data -= data % DCOPY_DIRECT_ALIGN;
 
-        if(!num_of_bytes_read) {
+            if(data_end < end) {
+                data_end = DCOPY_DIRECT_ROUND(data_end);
+                data_end = data_end < end ? data_end : end;
+            }
+        }
+
+        if(data > pos) {
+            if(DCOPY_copy_hole(op, out_fd, pos, data) < 0) {
+                return -1;
+            }
+
+            pos = data;
+        }
+
+        if(pos >= end) {
             break;
         }
 
-        num_of_bytes_written = write(out_fd, &io_buf[0], \
-                                     (size_t)num_of_bytes_read);
+        off64_t start = pos;
 
-        if(num_of_bytes_written != num_of_bytes_read) {
-            LOG(DCOPY_LOG_ERR, "Write error when copying from `%s'. errno=%d %s", \
-                op->operand, errno, strerror(errno));
+        if(delta) {
+            if(DCOPY_copy_delta(op, in_fd, out_fd, &pos, data_end) < 0) {
+                return -1;
+            }
+        }
+        else if(DCOPY_copy_slices(op, in_fd, out_fd, &pos, data_end) < 0) {
+            /* Handle operation requeue in parent function. */
             return -1;
         }
+        else {
+            copied += pos - start;
+        }
 
-        total_bytes_written += num_of_bytes_written;
+        if(pos < data_end) {
+            /* The source shrank; cleanup truncates to the size we walked. */
+            break;
+        }
+    }
+
+    /* Only what a delta actually rewrote counts as copied. */
+    if(delta) {
+        copied = DCOPY_statistics.total_bytes_rewritten - rewritten;
+
+        if(copied == 0) {
+            op->flags |= DCOPY_OP_MATCHED;
+        }
     }
 
     /* Increment the global counter. */
-    DCOPY_statistics.total_bytes_copied += total_bytes_written;
+    DCOPY_statistics.total_bytes_copied += copied;
 
     /*
-        LOG(DCOPY_LOG_DBG, "Wrote `%zu' bytes at segment `%" PRId64 \
+        LOG(DCOPY_LOG_DBG, "Wrote `%" PRId64 "' bytes at segment `%" PRId64 \
             "', offset `%" PRId64 "' (`%" PRId64 "' total).", \
-            num_of_bytes_written, op->chunk, DCOPY_CHUNK_SIZE * op->chunk, \
+            (int64_t) copied, op->chunk, offset, \
             DCOPY_statistics.total_bytes_copied);
     */
 
@@ -143,9 +858,7 @@ void DCOPY_enqueue_cleanup_stage(DCOPY_operation_t* op, \
 {
     char* newop;
 
-    newop = DCOPY_encode_operation(CLEANUP, op->chunk, op->operand, \
-                                   op->source_base_offset, \
-                                   op->dest_base_appendix, op->file_size);
+    newop = DCOPY_encode_chunk(CLEANUP, op, op->chunk, op->flags, op->digest);
 
     handle->enqueue(newop);
     free(newop);
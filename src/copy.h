@@ -13,6 +13,8 @@ int DCOPY_perform_copy(DCOPY_operation_t* op, \
                        int out_fd, \
                        off64_t offset);
 
+void DCOPY_copy_finalize(void);
+
 void DCOPY_enqueue_cleanup_stage(DCOPY_operation_t* op, \
                                  CIRCLE_handle* handle);
 
@@ -7,11 +7,22 @@
 #include "copy.h"
 #include "cleanup.h"
 #include "compare.h"
+#include "batch.h"
+#include "diff.h"
+#include "dirtable.h"
+#include "fdcache.h"
+#include "filetable.h"
+#include "journal.h"
+#include "manifest.h"
+#include "statstore.h"
+#include "throttle.h"
 
 #include <getopt.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <inttypes.h>
 
 /** Options specified by the user. */
@@ -27,57 +38,32 @@ extern DCOPY_statistics_t DCOPY_statistics;
  * all stages in a linear fashion unless a failure occurs. If a failure
  * occurs, the operation may be passed to a previous stage.
  */
-extern void (*DCOPY_jump_table[5])(DCOPY_operation_t* op, \
+extern void (*DCOPY_jump_table[6])(DCOPY_operation_t* op, \
                                    CIRCLE_handle* handle);
 
-/* iterate through linked list of files and set ownership, timestamps, and permissions
- * starting from deepest level and working backwards */
-static void DCOPY_set_metadata()
+/* iterate through the stat store and set ownership, timestamps, and permissions.
+ * Files come first, in a single pass, then the directories the directory table
+ * left over, starting from deepest level and working backwards */
+static void DCOPY_set_metadata(void)
 {
-    const DCOPY_stat_elem_t* elem;
+    struct stat64 sb;
+    const char* file;
+    int elem_depth;
 
     if (CIRCLE_global_rank == 0) {
         LOG(DCOPY_LOG_INFO, "Setting ownership, permissions, and timestamps.");
     }
 
-    /* get max depth across all procs */
-    int max_depth;
-    int depth = -1;
-    elem = DCOPY_list_head;
-    while (elem != NULL) {
-        if (elem->depth > depth) {
-            depth = elem->depth;
+    /* nothing else changes a file, so they don't wait on each other */
+    DCOPY_stat_store_rewind();
+    while ((file = DCOPY_stat_store_next(&sb, &elem_depth)) != NULL) {
+        if (elem_depth > 0) {
+            DCOPY_copy_metadata(&sb, file);
         }
-        elem = elem->next;
-    }
-    MPI_Allreduce(&depth, &max_depth, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
-
-    /* now set timestamps on files starting from deepest level */
-    for (depth = max_depth; depth > 0; depth--) {
-        /* cycle through our list of files and set timestamps
-         * for each one at this level */
-        elem = DCOPY_list_head;
-        while (elem != NULL) {
-            if (elem->depth == depth) {
-                if(DCOPY_user_opts.preserve) {
-                    DCOPY_copy_ownership(elem->sb, elem->file);
-                    DCOPY_copy_permissions(elem->sb, elem->file);
-                    DCOPY_copy_timestamps(elem->sb, elem->file);
-                }
-                else {
-                    /* TODO: set permissions based on source permissons
-                     * masked by umask */
-                    DCOPY_copy_permissions(elem->sb, elem->file);
-                }
-            }
-            elem = elem->next;
-        }
-        
-        /* wait for all procs to finish before we start
-         * with files at next level */
-        MPI_Barrier(MPI_COMM_WORLD);
     }
 
+    DCOPY_dir_table_set_metadata();
+
     return;
 }
 
@@ -89,6 +75,88 @@ static int64_t DCOPY_sum_int64(int64_t val)
     return (int64_t) sum;
 }
 
+/**
+ * Parse a byte count with an optional K, M, G, or T (binary) suffix.
+ *
+ * @return true if the string was a valid size, false otherwise.
+ */
+static bool DCOPY_parse_size(const char* str, int64_t* size)
+{
+    char* end = NULL;
+    long long multiplier = 1;
+    long long val;
+
+    errno = 0;
+    val = strtoll(str, &end, 10);
+
+    if(end == str || val < 0 || errno == ERANGE) {
+        return false;
+    }
+
+    switch(toupper((unsigned char) *end)) {
+        case 'T':
+            multiplier *= 1024;
+            /* fall through */
+        case 'G':
+            multiplier *= 1024;
+            /* fall through */
+        case 'M':
+            multiplier *= 1024;
+            /* fall through */
+        case 'K':
+            multiplier *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+
+    if(*end != '\0' || val > LLONG_MAX / multiplier) {
+        return false;
+    }
+
+    *size = (int64_t)(val * multiplier);
+    return true;
+}
+
+/**
+ * Parse a time in seconds, or as [[hours:]minutes:]seconds like the walltime
+ * of a batch job.
+ *
+ * @return true if the string was a valid time, false otherwise.
+ */
+static bool DCOPY_parse_time(const char* str, int64_t* seconds)
+{
+    int64_t val = 0;
+    int fields = 0;
+
+    while(fields < 3) {
+        char* end = NULL;
+        long long field = strtoll(str, &end, 10);
+
+        /* only the first field may be larger than a minute or an hour */
+        if(end == str || field < 0 || (fields > 0 && field >= 60)) {
+            return false;
+        }
+
+        val = val * 60 + (int64_t) field;
+        fields++;
+
+        if(*end == '\0') {
+            *seconds = val;
+            return true;
+        }
+
+        if(*end != ':') {
+            return false;
+        }
+
+        str = end + 1;
+    }
+
+    return false;
+}
+
 /**
  * Print out information on the results of the file copy.
  */
@@ -98,6 +166,33 @@ void DCOPY_epilogue(void)
                       DCOPY_statistics.wtime_started;
     int64_t agg_copied = DCOPY_sum_int64(DCOPY_statistics.total_bytes_copied);
     double agg_rate = (double)agg_copied / rel_time;
+    int64_t agg_cloned = DCOPY_sum_int64(DCOPY_statistics.total_bytes_cloned);
+    int64_t skipped_files = DCOPY_sum_int64(DCOPY_statistics.total_files_skipped);
+    int64_t skipped_bytes = DCOPY_sum_int64(DCOPY_statistics.total_bytes_skipped);
+    int64_t examined_bytes = DCOPY_sum_int64(DCOPY_statistics.total_bytes_examined);
+    int64_t rewritten_bytes = DCOPY_sum_int64(DCOPY_statistics.total_bytes_rewritten);
+    int64_t resumed_chunks = DCOPY_sum_int64(DCOPY_statistics.total_chunks_resumed);
+    int64_t resumed_bytes = DCOPY_sum_int64(DCOPY_statistics.total_bytes_resumed);
+    int64_t agg_files = DCOPY_sum_int64(DCOPY_statistics.total_files_copied);
+    double agg_file_rate = (double)agg_files / rel_time;
+    int64_t fd_hits = DCOPY_sum_int64(DCOPY_statistics.fd_cache_hits);
+    int64_t fd_lookups = fd_hits + DCOPY_sum_int64(DCOPY_statistics.fd_cache_misses);
+    int64_t file_hits = DCOPY_sum_int64(DCOPY_statistics.file_table_hits);
+    int64_t file_lookups = file_hits + DCOPY_sum_int64(DCOPY_statistics.file_table_misses);
+    int64_t dirs_early = DCOPY_sum_int64(DCOPY_statistics.dirs_finished_early);
+    int64_t files_early = DCOPY_sum_int64(DCOPY_statistics.files_finished_early);
+    int64_t stat_spilled = DCOPY_sum_int64(DCOPY_statistics.stat_bytes_spilled);
+    int64_t throttled_ns = DCOPY_sum_int64(DCOPY_statistics.throttled_ns);
+    int64_t verified_files = DCOPY_sum_int64(DCOPY_statistics.total_files_verified);
+    int64_t verified_bytes = DCOPY_sum_int64(DCOPY_statistics.total_bytes_verified);
+    int64_t verify_failures = DCOPY_sum_int64(DCOPY_statistics.verify_failures);
+    int64_t mtime_changes = DCOPY_sum_int64(DCOPY_statistics.verify_mtime_changes);
+    int64_t compared_files = DCOPY_sum_int64(DCOPY_statistics.total_files_compared);
+    int64_t compared_bytes = DCOPY_sum_int64(DCOPY_statistics.total_bytes_compared);
+    int64_t diff_missing = DCOPY_sum_int64(DCOPY_statistics.diff_missing);
+    int64_t diff_extra = DCOPY_sum_int64(DCOPY_statistics.diff_extra);
+    int64_t diff_changed = DCOPY_sum_int64(DCOPY_statistics.diff_changed);
+    int64_t diff_chunks = DCOPY_sum_int64(DCOPY_statistics.diff_chunks);
 
     if(CIRCLE_global_rank == 0) {
         char starttime_str[256];
@@ -114,8 +209,101 @@ void DCOPY_epilogue(void)
         LOG(DCOPY_LOG_INFO, "Aggregate transfer rate is `%.0lf' bytes per second " \
             "(`%.3" PRId64 "' bytes in `%.3lf' seconds).", \
             agg_rate, agg_copied, rel_time);
+
+        if(agg_cloned > 0) {
+            LOG(DCOPY_LOG_INFO, "Cloned `%" PRId64 "' bytes instead of copying them.", \
+                agg_cloned);
+        }
+
+        if(DCOPY_user_opts.update) {
+            LOG(DCOPY_LOG_INFO, "Copied `%" PRId64 "' bytes and skipped `%" PRId64 \
+                "' bytes in `%" PRId64 "' files which were up to date.", \
+                agg_copied, skipped_bytes, skipped_files);
+        }
+
+        if(DCOPY_user_opts.delta) {
+            LOG(DCOPY_LOG_INFO, "Rewrote `%" PRId64 "' of `%" PRId64 "' bytes " \
+                "compared with existing destinations.", rewritten_bytes, examined_bytes);
+        }
+
+        if(DCOPY_user_opts.resume) {
+            LOG(DCOPY_LOG_INFO, "Skipped `%" PRId64 "' chunks (`%" PRId64 "' bytes) " \
+                "which an earlier run finished.", resumed_chunks, resumed_bytes);
+        }
+
+        if(DCOPY_statistics.unfinished > 0) {
+            LOG(DCOPY_LOG_WARN, "Stopped at the walltime with `%" PRId64 "' operations " \
+                "left. Run again with --resume to finish the copy.", \
+                DCOPY_statistics.unfinished);
+        }
+
+        LOG(DCOPY_LOG_INFO, "Aggregate file rate is `%.0lf' files per second " \
+            "(`%" PRId64 "' files).", agg_file_rate, agg_files);
+
+        LOG(DCOPY_LOG_INFO, "Descriptor cache hit rate is `%.1lf%%' " \
+            "(`%" PRId64 "' hits, `%" PRId64 "' misses).", \
+            fd_lookups > 0 ? 100.0 * (double) fd_hits / (double) fd_lookups : 0.0, \
+            fd_hits, fd_lookups - fd_hits);
+
+        if(file_lookups > 0) {
+            LOG(DCOPY_LOG_INFO, "Looked up `%" PRId64 "' files registered by other " \
+                "ranks, `%.1lf%%' from the cache.", file_lookups, \
+                100.0 * (double) file_hits / (double) file_lookups);
+        }
+
+        if(files_early > 0) {
+            LOG(DCOPY_LOG_INFO, "Finished `%" PRId64 "' files as soon as " \
+                "their last chunk was done.", files_early);
+        }
+
+        if(dirs_early > 0) {
+            LOG(DCOPY_LOG_INFO, "Finished `%" PRId64 "' directories as soon as " \
+                "their contents were done.", dirs_early);
+        }
+
+        if(stat_spilled > 0) {
+            LOG(DCOPY_LOG_INFO, "Spilled `%" PRId64 "' bytes of metadata records " \
+                "to local disk.", stat_spilled);
+        }
+
+        if(DCOPY_throttle_enabled()) {
+            LOG(DCOPY_LOG_INFO, "Bandwidth limits held ranks back for `%.3lf' " \
+                "seconds in total.", (double) throttled_ns / 1e9);
+        }
+
+        if(DCOPY_user_opts.verify_path != NULL) {
+            LOG(DCOPY_LOG_INFO, "Verified `%" PRId64 "' files and `%" PRId64 \
+                "' bytes against the manifest.", verified_files, verified_bytes);
+
+            if(mtime_changes > 0) {
+                LOG(DCOPY_LOG_INFO, "`%" PRId64 "' files have a different " \
+                    "modification time than the manifest.", mtime_changes);
+            }
+
+            if(verify_failures > 0) {
+                LOG(DCOPY_LOG_ERR, "`%" PRId64 "' manifest records failed to verify.", \
+                    verify_failures);
+            }
+        }
+
+        if(DCOPY_user_opts.compare_only) {
+            LOG(DCOPY_LOG_INFO, "Compared `%" PRId64 "' files and `%" PRId64 \
+                "' bytes with the destination.", compared_files, compared_bytes);
+            LOG(DCOPY_LOG_INFO, "Found `%" PRId64 "' missing and `%" PRId64 \
+                "' extra objects, `%" PRId64 "' which differ in type, size, or " \
+                "link target, and `%" PRId64 "' chunks whose contents differ.", \
+                diff_missing, diff_extra, diff_changed, diff_chunks);
+        }
     }
 
+    /* every rank exits with a failure if any record failed to verify, or
+     * if the trees differ */
+    if(verify_failures > 0) {
+        DCOPY_statistics.verify_failures = verify_failures;
+    }
+
+    DCOPY_statistics.differences = diff_missing + diff_extra + diff_changed + diff_chunks;
+
     /* free each source path and array of source path pointers */
     if(DCOPY_user_opts.src_path != NULL) {
         int i;
@@ -150,17 +338,22 @@ void DCOPY_print_version()
  */
 void DCOPY_print_usage(char** argv)
 {
-    printf("usage: %s [cCdfhpRrv] [--] source_file target_file\n" \
-           "       %s [cCdfhpRrv] [--] source_file ... target_directory\n", \
-           argv[0], argv[0]);
+    printf("usage: %s [bBcCdDefFhjJkLmMpPQRrTuUvwWx] [--] source_file target_file\n" \
+           "       %s [bBcCdDefFhjJkLmMpPQRrTuUvwWx] [--] source_file ... target_directory\n" \
+           "       %s -n [bBdDkLoRrW] [--] source ... target\n" \
+           "       %s -V manifest [BdLW] [--] target\n", \
+           argv[0], argv[0], argv[0], argv[0]);
     fflush(stdout);
 }
 
 int main(int argc, \
          char** argv)
 {
+    static const char optstring[] = "b:B:cCd:De:fFhj:Jk:L:m:M:no:pPQ:RrT:uUvV:w:Wx";
     int c;
     int option_index = 0;
+    long queue_depth;
+    char* end = NULL;
 
     MPI_Init(&argc, &argv);
 
@@ -172,15 +365,64 @@ int main(int argc, \
     CIRCLE_global_rank = CIRCLE_init(argc, argv, CIRCLE_DEFAULT_FLAGS);
     CIRCLE_cb_create(&DCOPY_add_objects);
     CIRCLE_cb_process(&DCOPY_process_objects);
+    MPI_Comm_size(MPI_COMM_WORLD, &DCOPY_global_size);
 
     DCOPY_debug_stream = stdout;
 
     /* By default, don't perform a conditional copy. */
     DCOPY_user_opts.conditional = false;
 
+    /* By default, go through the page cache. */
+    DCOPY_user_opts.direct = false;
+
     /* By default, don't skip the compare option. */
     DCOPY_user_opts.skip_compare = false;
 
+    /* By default, pick chunk sizes for each file as we go. */
+    DCOPY_user_opts.chunk_size = 0;
+
+    /* By default, copy small files in batches. */
+    DCOPY_user_opts.batch_threshold = DCOPY_BATCH_THRESHOLD;
+
+    /* By default, move file data inside the kernel where possible. */
+    DCOPY_user_opts.copy_engine = DCOPY_ENGINE_KERNEL;
+
+    /* By default, keep a few blocks in flight with the io_uring engine. */
+    DCOPY_user_opts.queue_depth = DCOPY_QUEUE_DEPTH;
+
+    /* By default, leave the page cache to the kernel. */
+    DCOPY_user_opts.drop_behind = false;
+
+    /* By default, leave writing copied files to disk to the kernel. */
+    DCOPY_user_opts.fsync = false;
+
+    /* By default, move data as fast as the filesystems allow. */
+    DCOPY_user_opts.max_bandwidth = 0;
+    DCOPY_user_opts.max_rank_bandwidth = 0;
+
+    /* By default, write no manifest and copy rather than verify. */
+    DCOPY_user_opts.manifest_path = NULL;
+    DCOPY_user_opts.verify_path = NULL;
+
+    /* By default, copy rather than only compare with an existing copy. */
+    DCOPY_user_opts.compare_only = false;
+    DCOPY_user_opts.diff_path = NULL;
+
+    /* By default, copy every file, even if its copy is up to date. */
+    DCOPY_user_opts.update = false;
+
+    /* By default, rewrite all of a file that is copied. */
+    DCOPY_user_opts.delta = false;
+
+    /* By default, keep no journal and run until everything is copied. */
+    DCOPY_user_opts.journal_path = NULL;
+    DCOPY_user_opts.resume = false;
+    DCOPY_user_opts.walltime = 0;
+
+    /* By default, spill records for the metadata pass to TMPDIR past 1GB. */
+    DCOPY_user_opts.stat_memory = DCOPY_STAT_MEMORY;
+    DCOPY_user_opts.spill_dir = NULL;
+
     /* By default, show info log messages. */
     CIRCLE_loglevel CIRCLE_debug = CIRCLE_LOG_INFO;
     DCOPY_debug_level = DCOPY_LOG_INFO;
@@ -191,6 +433,9 @@ int main(int argc, \
     /* By default, don't bother to preserve all attributes. */
     DCOPY_user_opts.preserve = false;
 
+    /* By default, let destination files grow as chunks are written. */
+    DCOPY_user_opts.preallocate = false;
+
     /* By default, don't attempt any type of recursion. */
     DCOPY_user_opts.recursive = false;
     DCOPY_user_opts.recursive_unspecified = false;
@@ -199,24 +444,89 @@ int main(int argc, \
     DCOPY_user_opts.reliable_filesystem = true;
 
     static struct option long_options[] = {
+        {"batch-threshold"      , required_argument, 0, 'b'},
+        {"max-bandwidth"        , required_argument, 0, 'B'},
         {"conditional"          , no_argument      , 0, 'c'},
         {"skip-compare"         , no_argument      , 0, 'C'},
         {"debug"                , required_argument, 0, 'd'},
+        {"direct"               , no_argument      , 0, 'D'},
+        {"copy-engine"          , required_argument, 0, 'e'},
         {"force"                , no_argument      , 0, 'f'},
+        {"fsync"                , no_argument      , 0, 'F'},
         {"help"                 , no_argument      , 0, 'h'},
+        {"journal"              , required_argument, 0, 'j'},
+        {"resume"               , no_argument      , 0, 'J'},
+        {"chunk-size"           , required_argument, 0, 'k'},
+        {"max-rank-bandwidth"   , required_argument, 0, 'L'},
+        {"metadata-memory"      , required_argument, 0, 'm'},
+        {"manifest"             , required_argument, 0, 'M'},
+        {"compare-only"         , no_argument      , 0, 'n'},
+        {"diff-list"            , required_argument, 0, 'o'},
         {"preserve"             , no_argument      , 0, 'p'},
+        {"preallocate"          , no_argument      , 0, 'P'},
+        {"queue-depth"          , required_argument, 0, 'Q'},
         {"recursive"            , no_argument      , 0, 'R'},
         {"recursive-unspecified", no_argument      , 0, 'r'},
+        {"spill-dir"            , required_argument, 0, 'T'},
+        {"update"               , no_argument      , 0, 'u'},
         {"unreliable-filesystem", no_argument      , 0, 'U'},
         {"version"              , no_argument      , 0, 'v'},
+        {"verify"               , required_argument, 0, 'V'},
+        {"walltime"             , required_argument, 0, 'w'},
+        {"drop-behind"          , no_argument      , 0, 'W'},
+        {"delta"                , no_argument      , 0, 'x'},
         {0                      , 0                , 0, 0  }
     };
 
     /* Parse options */
-    while((c = getopt_long(argc, argv, "cCd:fhpRrUv", \
+    while((c = getopt_long(argc, argv, optstring, \
                            long_options, &option_index)) != -1) {
         switch(c) {
 
+            case 'b':
+
+                if(!DCOPY_parse_size(optarg, &DCOPY_user_opts.batch_threshold)) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Batch threshold `%s' is not a valid size.", optarg);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(DCOPY_user_opts.batch_threshold > DCOPY_BATCH_THRESHOLD_MAX) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_WARN, "Batch threshold `%s' is too large, using `%d' bytes.", \
+                            optarg, DCOPY_BATCH_THRESHOLD_MAX);
+                    }
+
+                    DCOPY_user_opts.batch_threshold = DCOPY_BATCH_THRESHOLD_MAX;
+                }
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Copying files of up to `%" PRId64 \
+                        "' bytes in batches.", DCOPY_user_opts.batch_threshold);
+                }
+
+                break;
+
+            case 'B':
+
+                if(!DCOPY_parse_size(optarg, &DCOPY_user_opts.max_bandwidth) || \
+                        DCOPY_user_opts.max_bandwidth <= 0) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Bandwidth `%s' is not a valid rate.", optarg);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Limiting the job to `%" PRId64 \
+                        "' bytes per second.", DCOPY_user_opts.max_bandwidth);
+                }
+
+                break;
+
             case 'c':
                 DCOPY_user_opts.conditional = true;
 
@@ -292,6 +602,41 @@ int main(int argc, \
 
                 break;
 
+            case 'D':
+                DCOPY_user_opts.direct = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Using direct I/O (bypassing the page cache).");
+                }
+
+                break;
+
+            case 'e':
+
+                if(strcmp(optarg, "rw") == 0) {
+                    DCOPY_user_opts.copy_engine = DCOPY_ENGINE_RW;
+                }
+                else if(strcmp(optarg, "kernel") == 0) {
+                    DCOPY_user_opts.copy_engine = DCOPY_ENGINE_KERNEL;
+                }
+                else if(strcmp(optarg, "uring") == 0) {
+                    DCOPY_user_opts.copy_engine = DCOPY_ENGINE_URING;
+                }
+                else {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Copy engine `%s' not recognized. " \
+                            "Use `rw', `kernel', or `uring'.", optarg);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Using the `%s' copy engine.", optarg);
+                }
+
+                break;
+
             case 'f':
                 DCOPY_user_opts.force = true;
 
@@ -301,6 +646,15 @@ int main(int argc, \
 
                 break;
 
+            case 'F':
+                DCOPY_user_opts.fsync = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Flushing each copied file to disk.");
+                }
+
+                break;
+
             case 'h':
 
                 if(CIRCLE_global_rank == 0) {
@@ -310,6 +664,111 @@ int main(int argc, \
                 DCOPY_exit(EXIT_SUCCESS);
                 break;
 
+            case 'j':
+                DCOPY_user_opts.journal_path = optarg;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Keeping a journal of finished chunks in `%s'.", optarg);
+                }
+
+                break;
+
+            case 'J':
+                DCOPY_user_opts.resume = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Resuming from the journal of an earlier run.");
+                }
+
+                break;
+
+            case 'k':
+
+                if(!DCOPY_parse_size(optarg, &DCOPY_user_opts.chunk_size) || \
+                        DCOPY_user_opts.chunk_size % FD_BLOCK_SIZE != 0) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Chunk size `%s' must be a " \
+                            "multiple of %d bytes.", optarg, FD_BLOCK_SIZE);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(CIRCLE_global_rank == 0 && DCOPY_user_opts.chunk_size > 0) {
+                    LOG(DCOPY_LOG_INFO, "Using a fixed chunk size of `%" PRId64 \
+                        "' bytes.", DCOPY_user_opts.chunk_size);
+                }
+
+                break;
+
+            case 'L':
+
+                if(!DCOPY_parse_size(optarg, &DCOPY_user_opts.max_rank_bandwidth) || \
+                        DCOPY_user_opts.max_rank_bandwidth <= 0) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Bandwidth `%s' is not a valid rate.", optarg);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Limiting each rank to `%" PRId64 \
+                        "' bytes per second.", DCOPY_user_opts.max_rank_bandwidth);
+                }
+
+                break;
+
+            case 'm':
+
+                if(!DCOPY_parse_size(optarg, &DCOPY_user_opts.stat_memory)) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Metadata memory `%s' is not a valid size.", optarg);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(CIRCLE_global_rank == 0) {
+                    if(DCOPY_user_opts.stat_memory > 0) {
+                        LOG(DCOPY_LOG_INFO, "Keeping up to `%" PRId64 "' bytes of " \
+                            "metadata records in memory on each rank.", \
+                            DCOPY_user_opts.stat_memory);
+                    }
+                    else {
+                        LOG(DCOPY_LOG_INFO, "Keeping all metadata records in memory.");
+                    }
+                }
+
+                break;
+
+            case 'M':
+                DCOPY_user_opts.manifest_path = optarg;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Writing a manifest to `%s'.", optarg);
+                }
+
+                break;
+
+            case 'n':
+                DCOPY_user_opts.compare_only = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Comparing with an existing copy instead of copying.");
+                }
+
+                break;
+
+            case 'o':
+                DCOPY_user_opts.diff_path = optarg;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Writing the list of differences to `%s'.", optarg);
+                }
+
+                break;
+
             case 'p':
                 DCOPY_user_opts.preserve = true;
 
@@ -319,6 +778,38 @@ int main(int argc, \
 
                 break;
 
+            case 'P':
+                DCOPY_user_opts.preallocate = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Preallocating destination files.");
+                }
+
+                break;
+
+            case 'Q':
+                errno = 0;
+                queue_depth = strtol(optarg, &end, 10);
+
+                if(end == optarg || *end != '\0' || errno == ERANGE || \
+                        queue_depth < 1 || queue_depth > DCOPY_QUEUE_DEPTH_MAX) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Queue depth `%s' must be between 1 and %d.", \
+                            optarg, DCOPY_QUEUE_DEPTH_MAX);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                DCOPY_user_opts.queue_depth = (int) queue_depth;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Keeping up to `%d' blocks in flight per rank.", \
+                        DCOPY_user_opts.queue_depth);
+                }
+
+                break;
+
             case 'R':
                 DCOPY_user_opts.recursive = true;
 
@@ -339,6 +830,24 @@ int main(int argc, \
 
                 break;
 
+            case 'T':
+                DCOPY_user_opts.spill_dir = optarg;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Spilling metadata records to `%s'.", optarg);
+                }
+
+                break;
+
+            case 'u':
+                DCOPY_user_opts.update = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Skipping files which are already up to date.");
+                }
+
+                break;
+
             case 'U':
                 DCOPY_user_opts.reliable_filesystem = false;
 
@@ -358,11 +867,60 @@ int main(int argc, \
                 DCOPY_exit(EXIT_SUCCESS);
                 break;
 
+            case 'V':
+                DCOPY_user_opts.verify_path = optarg;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Verifying against the manifest `%s'.", optarg);
+                }
+
+                break;
+
+            case 'w':
+
+                if(!DCOPY_parse_time(optarg, &DCOPY_user_opts.walltime) || \
+                        DCOPY_user_opts.walltime == 0) {
+                    if(CIRCLE_global_rank == 0) {
+                        LOG(DCOPY_LOG_ERR, "Walltime `%s' is not a valid time.", optarg);
+                    }
+
+                    DCOPY_exit(EXIT_FAILURE);
+                }
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Taking no new work after `%" PRId64 "' seconds.", \
+                        DCOPY_user_opts.walltime);
+                }
+
+                break;
+
+            case 'W':
+                DCOPY_user_opts.drop_behind = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Dropping copied data from the page cache.");
+                }
+
+                break;
+
+            case 'x':
+                DCOPY_user_opts.delta = true;
+
+                if(CIRCLE_global_rank == 0) {
+                    LOG(DCOPY_LOG_INFO, "Rewriting only the blocks of existing files which changed.");
+                }
+
+                break;
+
             case '?':
             default:
 
                 if(CIRCLE_global_rank == 0) {
-                    if(optopt == 'd') {
+                    /* options followed by a colon take an argument */
+                    const char* opt = optopt != 0 && optopt != ':' ? \
+                                      strchr(optstring, optopt) : NULL;
+
+                    if(opt != NULL && opt[1] == ':') {
                         DCOPY_print_usage(argv);
                         fprintf(stderr, "Option -%c requires an argument.\n", \
                                 optopt);
@@ -384,22 +942,45 @@ int main(int argc, \
         }
     }
 
+    /* Only -p gives copies the times the next update compares. */
+    if(DCOPY_user_opts.update && !DCOPY_user_opts.preserve && CIRCLE_global_rank == 0) {
+        LOG(DCOPY_LOG_WARN, "Without -p, files copied now will not look up to " \
+            "date to the next update.");
+    }
+
     /** Parse the source and destination paths. */
     DCOPY_parse_path_args(argv, optind, argc);
 
-    /* initialize linked list of stat objects */
-    DCOPY_list_head  = NULL;
-    DCOPY_list_tail  = NULL;
+    /* initialize the records of stat objects */
+    DCOPY_stat_store_init();
 
     /* Initialize our jump table for core operations. */
     DCOPY_jump_table[TREEWALK] = DCOPY_do_treewalk;
     DCOPY_jump_table[COPY]     = DCOPY_do_copy;
     DCOPY_jump_table[CLEANUP]  = DCOPY_do_cleanup;
     DCOPY_jump_table[COMPARE]  = DCOPY_do_compare;
+    DCOPY_jump_table[BATCH]    = DCOPY_do_batch;
+    DCOPY_jump_table[VERIFY]   = DCOPY_do_verify;
 
     /* Set the log level for the processing library. */
     CIRCLE_enable_logging(CIRCLE_debug);
 
+    /* Set up the bandwidth limits, if any. */
+    DCOPY_throttle_init();
+
+    /* Set up the table of files that chunks refer to. */
+    DCOPY_file_table_init();
+
+    /* Set up the table of directories to finish as their work is done. */
+    DCOPY_dir_table_init();
+
+    /* Start this rank's shard of the manifest, if any. */
+    DCOPY_manifest_init();
+    DCOPY_diff_init();
+
+    /* Read the journal to resume from and start this run's part of it. */
+    DCOPY_journal_init();
+
     /* Grab a relative and actual start time for the epilogue. */
     time(&(DCOPY_statistics.time_started));
     DCOPY_statistics.wtime_started = CIRCLE_wtime();
@@ -414,23 +995,43 @@ int main(int argc, \
     /* Let the processing library cleanup. */
     CIRCLE_finalize();
 
-    /* set permissions, ownership, and timestamps if needed */
-    DCOPY_set_metadata();
-
-    /* free list of stat objects */
-    DCOPY_stat_elem_t* current = DCOPY_list_head;
-    while (current != NULL) {
-        DCOPY_stat_elem_t* next = current->next;
-        free(current->file);
-        free(current->sb);
-        free(current);
-        current = next;
+    /* Close the descriptors kept open across chunks. */
+    DCOPY_fd_cache_flush();
+
+    /* Release resources held by the copy engines. */
+    DCOPY_copy_finalize();
+    DCOPY_throttle_finalize();
+    DCOPY_file_table_finalize();
+
+    /* Finish the directories whose counts were still in flight. */
+    DCOPY_dir_table_finalize();
+
+    /* Merge the shards of the manifest and the list of differences. */
+    DCOPY_manifest_finalize();
+    DCOPY_diff_finalize();
+
+    /* Keep the journal only if work was left at the walltime. */
+    DCOPY_statistics.unfinished = DCOPY_sum_int64(DCOPY_statistics.operations_deferred);
+    DCOPY_journal_finalize(DCOPY_statistics.unfinished == 0);
+
+    DCOPY_buffer_pool_free();
+
+    /* set permissions, ownership, and timestamps if needed, unless nothing
+     * was copied or a resume still has to write into the tree */
+    if(DCOPY_user_opts.verify_path == NULL && !DCOPY_user_opts.compare_only && \
+            DCOPY_statistics.unfinished == 0) {
+        DCOPY_set_metadata();
     }
 
+    /* free the records of stat objects */
+    DCOPY_stat_store_finalize();
+    DCOPY_dir_table_release();
+
     /* Print the results to the user. */
     DCOPY_epilogue();
 
-    DCOPY_exit(EXIT_SUCCESS);
+    DCOPY_exit((DCOPY_statistics.verify_failures > 0 || DCOPY_statistics.differences > 0 || \
+                DCOPY_statistics.unfinished > 0) ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 /* EOF */
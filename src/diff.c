@@ -0,0 +1,226 @@
+/*
+ * This file contains the compare-only mode, which checks an existing copy
+ * against its source without writing anything. The treewalk stage still
+ * walks the source, but instead of creating each object it checks the
+ * destination with DCOPY_diff_check(), and sends the chunks of regular files
+ * that match in type and size straight to the compare stage. Directories are
+ * also read on the destination side to find what the source does not have.
+ *
+ * Every difference is logged, counted, and, if a list was asked for,
+ * written as one line of a text file, with the path relative to the
+ * destination last:
+ *
+ *     M <path>                     missing from the destination
+ *     X <path>                     extra in the destination
+ *     T <path>                     not the same type of object
+ *     S <path>                     not the same size
+ *     L <path>                     link with a different target
+ *     D <offset> <length> <path>   contents differ in this range
+ *
+ * A missing or extra directory is listed once, without what is inside it.
+ * Like the manifest, each rank writes to a shard of the list (shard.c).
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "diff.h"
+#include "shard.h"
+#include "dcp.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/* The shard of the list of differences this rank writes to. */
+static FILE* DCOPY_diff_shard = NULL;
+
+/* The first line of every list of differences. */
+static const char* DCOPY_diff_header = "# dcp diff 1\n";
+
+/* Open the shard of this rank, if a list of differences was asked for. */
+void DCOPY_diff_init(void)
+{
+    if(DCOPY_user_opts.diff_path == NULL) {
+        return;
+    }
+
+    DCOPY_diff_shard = DCOPY_shard_open(DCOPY_user_opts.diff_path);
+}
+
+/* Log, count, and list a difference in a whole object. */
+static void DCOPY_diff_record(char kind, \
+                              const char* dest_path)
+{
+    switch(kind) {
+        case 'M':
+            LOG(DCOPY_LOG_INFO, "Missing from the destination: `%s'.", dest_path);
+            DCOPY_statistics.diff_missing++;
+            break;
+
+        case 'X':
+            LOG(DCOPY_LOG_INFO, "Extra in the destination: `%s'.", dest_path);
+            DCOPY_statistics.diff_extra++;
+            break;
+
+        case 'T':
+            LOG(DCOPY_LOG_INFO, "Type differs: `%s'.", dest_path);
+            DCOPY_statistics.diff_changed++;
+            break;
+
+        case 'S':
+            LOG(DCOPY_LOG_INFO, "Size differs: `%s'.", dest_path);
+            DCOPY_statistics.diff_changed++;
+            break;
+
+        case 'L':
+            LOG(DCOPY_LOG_INFO, "Link target differs: `%s'.", dest_path);
+            DCOPY_statistics.diff_changed++;
+            break;
+
+        default:
+            break;
+    }
+
+    if(DCOPY_diff_shard != NULL) {
+        fprintf(DCOPY_diff_shard, "%c ", kind);
+        DCOPY_shard_write_path(DCOPY_diff_shard, dest_path);
+    }
+}
+
+/* Log, count, and list a range of a file whose contents differ. */
+void DCOPY_diff_chunk(const char* dest_path, \
+                      off64_t offset, \
+                      off64_t len)
+{
+    LOG(DCOPY_LOG_INFO, "Contents differ: `%s' at offset `%" PRId64 \
+        "' for `%" PRId64 "' bytes.", dest_path, (int64_t) offset, (int64_t) len);
+    DCOPY_statistics.diff_chunks++;
+
+    if(DCOPY_diff_shard != NULL) {
+        fprintf(DCOPY_diff_shard, "D %" PRId64 " %" PRId64 " ", \
+                (int64_t) offset, (int64_t) len);
+        DCOPY_shard_write_path(DCOPY_diff_shard, dest_path);
+    }
+}
+
+/*
+ * Check the destination of a source object with the given stat. Returns
+ * true if it matches so far and its contents still have to be compared,
+ * i.e. it is a directory to walk or a regular file with data to compare.
+ */
+bool DCOPY_diff_check(DCOPY_operation_t* op, \
+                      const struct stat64* statbuf)
+{
+    const char* dest_path = op->dest_full_path;
+    struct stat64 dest_sb;
+
+    if(lstat64(dest_path, &dest_sb) < 0) {
+        if(errno != ENOENT && errno != ENOTDIR) {
+            LOG(DCOPY_LOG_ERR, "Could not get info for `%s'. errno=%d %s", \
+                dest_path, errno, strerror(errno));
+        }
+
+        DCOPY_diff_record('M', dest_path);
+        return false;
+    }
+
+    if((statbuf->st_mode & S_IFMT) != (dest_sb.st_mode & S_IFMT)) {
+        DCOPY_diff_record('T', dest_path);
+        return false;
+    }
+
+    if(S_ISDIR(statbuf->st_mode)) {
+        return true;
+    }
+
+    DCOPY_statistics.total_files_compared++;
+
+    if(S_ISLNK(statbuf->st_mode)) {
+        if(!DCOPY_same_link(op->operand, dest_path)) {
+            DCOPY_diff_record('L', dest_path);
+        }
+
+        return false;
+    }
+
+    if(statbuf->st_size != dest_sb.st_size) {
+        DCOPY_diff_record('S', dest_path);
+        return false;
+    }
+
+    return statbuf->st_size > 0;
+}
+
+/*
+ * Read the destination directory of op and record everything in it that
+ * the source directory does not have.
+ */
+void DCOPY_diff_extras(DCOPY_operation_t* op)
+{
+    char src_path[PATH_MAX];
+    char dest_path[PATH_MAX];
+    struct dirent* curr_ent;
+    struct stat64 statbuf;
+
+    DIR* dest_dir = opendir(op->dest_full_path);
+
+    if(dest_dir == NULL) {
+        LOG(DCOPY_LOG_ERR, "Unable to open dir `%s'. errno=%d %s", \
+            op->dest_full_path, errno, strerror(errno));
+        return;
+    }
+
+    while((curr_ent = readdir(dest_dir)) != NULL) {
+        const char* name = curr_ent->d_name;
+
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        int src_written = snprintf(src_path, sizeof(src_path), "%s/%s", op->operand, name);
+        int dest_written = snprintf(dest_path, sizeof(dest_path), "%s/%s", op->dest_full_path, name);
+
+        if(src_written >= (int) sizeof(src_path) || dest_written >= (int) sizeof(dest_path)) {
+            LOG(DCOPY_LOG_ERR, "Path too long for `%s' in `%s'.", name, op->dest_full_path);
+            continue;
+        }
+
+        if(lstat64(src_path, &statbuf) < 0 && errno == ENOENT) {
+            DCOPY_diff_record('X', dest_path);
+        }
+    }
+
+    closedir(dest_dir);
+}
+
+/*
+ * Close the shards and have rank 0 merge them into the list of differences.
+ * This must be called by all ranks.
+ */
+void DCOPY_diff_finalize(void)
+{
+    if(DCOPY_user_opts.diff_path == NULL) {
+        return;
+    }
+
+    DCOPY_shard_merge(&DCOPY_diff_shard, DCOPY_user_opts.diff_path, DCOPY_diff_header);
+
+    if(CIRCLE_global_rank == 0) {
+        LOG(DCOPY_LOG_INFO, "Wrote the list of differences `%s'.", \
+            DCOPY_user_opts.diff_path);
+    }
+}
+
+/* EOF */
@@ -0,0 +1,21 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_DIFF_H
+#define __DCP_DIFF_H
+
+#include "common.h"
+
+void DCOPY_diff_init(void);
+
+void DCOPY_diff_chunk(const char* dest_path, \
+                      off64_t offset, \
+                      off64_t len);
+
+bool DCOPY_diff_check(DCOPY_operation_t* op, \
+                      const struct stat64* statbuf);
+
+void DCOPY_diff_extras(DCOPY_operation_t* op);
+
+void DCOPY_diff_finalize(void);
+
+#endif /* __DCP_DIFF_H */
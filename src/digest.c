@@ -0,0 +1,277 @@
+/*
+ * This file contains the digests the copy stage computes over the data it
+ * moves through userspace, so the compare stage only has to read the
+ * destination back. Data is digested one block at a time with CRC32C, and
+ * the CRC of each block is mixed with its file offset into 64 bits. The
+ * digest of a chunk is the XOR of the digests of its blocks, which lets the
+ * io_uring engine add blocks in whatever order its reads complete. CRC32C is
+ * linear, so without the mix, blocks that trade places or the same
+ * corruption in two blocks would cancel out in the XOR.
+ *
+ * Manifests hold the plain CRC32C of each chunk instead, with holes counted
+ * as the zeros they read as, so any copy of the data can be checked.
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction when the CPU has it, and a
+ * table-driven version otherwise.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "digest.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DCOPY_DIGEST_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+/* The Castagnoli polynomial, bit reversed. */
+#define DCOPY_CRC32C_POLY 0x82F63B78
+
+/* Tables for processing 8 bytes at a time, built on first use. */
+static uint32_t DCOPY_crc32c_table[8][256];
+
+static uint32_t (*DCOPY_crc32c_update)(uint32_t crc, \
+                                       const unsigned char* buf, \
+                                       size_t len) = NULL;
+
+/* CRC32C of buf, one table lookup per byte of each 8-byte word. */
+static uint32_t DCOPY_crc32c_sw(uint32_t crc, \
+                                const unsigned char* buf, \
+                                size_t len)
+{
+    while(len > 0 && ((uintptr_t) buf & 7) != 0) {
+        crc = DCOPY_crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while(len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof(word));
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+
+        word ^= crc;
+
+        crc = DCOPY_crc32c_table[7][word & 0xff] ^ \
+              DCOPY_crc32c_table[6][(word >> 8) & 0xff] ^ \
+              DCOPY_crc32c_table[5][(word >> 16) & 0xff] ^ \
+              DCOPY_crc32c_table[4][(word >> 24) & 0xff] ^ \
+              DCOPY_crc32c_table[3][(word >> 32) & 0xff] ^ \
+              DCOPY_crc32c_table[2][(word >> 40) & 0xff] ^ \
+              DCOPY_crc32c_table[1][(word >> 48) & 0xff] ^ \
+              DCOPY_crc32c_table[0][word >> 56];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while(len > 0) {
+        crc = DCOPY_crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    return crc;
+}
+
+#ifdef DCOPY_DIGEST_SSE42
+/* CRC32C of buf with the crc32 instruction. */
+__attribute__((target("sse4.2")))
+static uint32_t DCOPY_crc32c_hw(uint32_t crc, \
+                                const unsigned char* buf, \
+                                size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while(len > 0 && ((uintptr_t) buf & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *buf++);
+        len--;
+    }
+
+    while(len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while(len > 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *buf++);
+        len--;
+    }
+
+    return (uint32_t) crc64;
+}
+#endif /* DCOPY_DIGEST_SSE42 */
+
+/* Pick an implementation and build the tables it needs. */
+static void DCOPY_crc32c_init(void)
+{
+#ifdef DCOPY_DIGEST_SSE42
+
+    if(__builtin_cpu_supports("sse4.2")) {
+        DCOPY_crc32c_update = DCOPY_crc32c_hw;
+        return;
+    }
+
+#endif
+
+    uint32_t i;
+    int j;
+
+    for(i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for(j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ DCOPY_CRC32C_POLY : crc >> 1;
+        }
+
+        DCOPY_crc32c_table[0][i] = crc;
+    }
+
+    for(i = 0; i < 256; i++) {
+        for(j = 1; j < 8; j++) {
+            uint32_t prev = DCOPY_crc32c_table[j - 1][i];
+            DCOPY_crc32c_table[j][i] = DCOPY_crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+    DCOPY_crc32c_update = DCOPY_crc32c_sw;
+}
+
+/* Extend a CRC32C, starting from 0 for a new one. */
+uint32_t DCOPY_crc32c(uint32_t crc, \
+                      const void* buf, \
+                      size_t len)
+{
+    if(DCOPY_crc32c_update == NULL) {
+        DCOPY_crc32c_init();
+    }
+
+    return ~DCOPY_crc32c_update(~crc, (const unsigned char*) buf, len);
+}
+
+/* Apply a GF(2) matrix, one row per bit, to a vector. */
+static uint32_t DCOPY_gf2_times(const uint32_t* mat, \
+                                uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while(vec) {
+        if(vec & 1) {
+            sum ^= *mat;
+        }
+
+        vec >>= 1;
+        mat++;
+    }
+
+    return sum;
+}
+
+/* Square a GF(2) matrix. */
+static void DCOPY_gf2_square(uint32_t* square, \
+                             const uint32_t* mat)
+{
+    int n;
+
+    for(n = 0; n < 32; n++) {
+        square[n] = DCOPY_gf2_times(mat, mat[n]);
+    }
+}
+
+/*
+ * Extend a CRC32C by len zero bytes, e.g. for a hole, without touching
+ * any data. Appending zeros is a linear map of the CRC register, so it is
+ * applied by repeated squaring, in O(log len) steps.
+ */
+uint32_t DCOPY_crc32c_zeros(uint32_t crc, \
+                            off64_t len)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+    uint32_t row = 1;
+    uint32_t reg = ~crc;
+    int n;
+
+    if(len <= 0) {
+        return crc;
+    }
+
+    /* the map for a single zero bit */
+    odd[0] = DCOPY_CRC32C_POLY;
+
+    for(n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    /* two and four zero bits */
+    DCOPY_gf2_square(even, odd);
+    DCOPY_gf2_square(odd, even);
+
+    /* apply the map for each set bit of len, in bytes */
+    do {
+        DCOPY_gf2_square(even, odd);
+
+        if(len & 1) {
+            reg = DCOPY_gf2_times(even, reg);
+        }
+
+        len >>= 1;
+
+        if(len == 0) {
+            break;
+        }
+
+        DCOPY_gf2_square(odd, even);
+
+        if(len & 1) {
+            reg = DCOPY_gf2_times(odd, reg);
+        }
+
+        len >>= 1;
+    } while(len != 0);
+
+    return ~reg;
+}
+
+/*
+ * The finalizer of MurmurHash3: a bijective mix of 64 bits, in which every
+ * input bit flips each output bit with probability close to one half.
+ */
+static uint64_t DCOPY_digest_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/*
+ * Digest one block of data that belongs at offset in the file. The CRC32C of
+ * the block goes through a non-linear mix with its offset, so the XOR of
+ * these over a chunk depends on where each block is.
+ */
+uint64_t DCOPY_digest_block(off64_t offset, \
+                            const void* buf, \
+                            size_t len)
+{
+    uint64_t crc = DCOPY_crc32c(0, buf, len);
+
+    return DCOPY_digest_mix(DCOPY_digest_mix((uint64_t) offset) ^ \
+                            (crc | ((uint64_t) len << 32)));
+}
+
+/* EOF */
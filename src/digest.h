@@ -0,0 +1,19 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_DIGEST_H
+#define __DCP_DIGEST_H
+
+#include "common.h"
+
+uint32_t DCOPY_crc32c(uint32_t crc, \
+                      const void* buf, \
+                      size_t len);
+
+uint32_t DCOPY_crc32c_zeros(uint32_t crc, \
+                            off64_t len);
+
+uint64_t DCOPY_digest_block(off64_t offset, \
+                            const void* buf, \
+                            size_t len);
+
+#endif /* __DCP_DIGEST_H */
@@ -0,0 +1,110 @@
+/*
+ * A check of the chunk digests (digest.c). It digests a chunk of random
+ * blocks and makes sure the digest doesn't depend on the order the blocks
+ * are added in, but changes when two blocks trade places, when one block is
+ * corrupted, and when the same corruption hits two blocks. It also checks
+ * CRC32C against its standard check value and against its extension by
+ * zeros. It is not built by default:
+ *
+ *     make -C src digest_check
+ *     ./src/digest_check
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "digest.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DCOPY_CHECK_BLOCKS     (16)
+#define DCOPY_CHECK_BLOCK_SIZE (4096)
+
+static unsigned char DCOPY_check_data[DCOPY_CHECK_BLOCKS][DCOPY_CHECK_BLOCK_SIZE];
+
+static int DCOPY_check_failed = 0;
+
+static void DCOPY_check(int ok, \
+                        const char* what)
+{
+    printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+
+    if(!ok) {
+        DCOPY_check_failed = 1;
+    }
+}
+
+/* Digest the chunk, with block i of the data placed at block order[i]. */
+static uint64_t DCOPY_check_digest(const int* order)
+{
+    uint64_t digest = 0;
+    int i;
+
+    for(i = 0; i < DCOPY_CHECK_BLOCKS; i++) {
+        off64_t offset = (off64_t) order[i] * DCOPY_CHECK_BLOCK_SIZE;
+        digest ^= DCOPY_digest_block(offset, DCOPY_check_data[i], DCOPY_CHECK_BLOCK_SIZE);
+    }
+
+    return digest;
+}
+
+int main(void)
+{
+    static unsigned char zeros[DCOPY_CHECK_BLOCK_SIZE];
+    int order[DCOPY_CHECK_BLOCKS];
+    uint64_t digest;
+    uint32_t crc;
+    int i, j;
+
+    srand(42);
+
+    for(i = 0; i < DCOPY_CHECK_BLOCKS; i++) {
+        order[i] = i;
+
+        for(j = 0; j < DCOPY_CHECK_BLOCK_SIZE; j++) {
+            DCOPY_check_data[i][j] = (unsigned char) rand();
+        }
+    }
+
+    DCOPY_check(DCOPY_crc32c(0, "123456789", 9) == 0xe3069283, \
+                "CRC32C check value");
+
+    crc = DCOPY_crc32c(0, DCOPY_check_data[0], 100);
+    DCOPY_check(DCOPY_crc32c_zeros(crc, sizeof(zeros)) == \
+                DCOPY_crc32c(crc, zeros, sizeof(zeros)), "CRC32C extended by zeros");
+
+    digest = DCOPY_check_digest(order);
+    printf("digest %016" PRIx64 "\n", digest);
+
+    /* the same blocks at the same offsets, added backwards */
+    uint64_t backwards = 0;
+
+    for(i = DCOPY_CHECK_BLOCKS - 1; i >= 0; i--) {
+        backwards ^= DCOPY_digest_block((off64_t) i * DCOPY_CHECK_BLOCK_SIZE, \
+                                        DCOPY_check_data[i], DCOPY_CHECK_BLOCK_SIZE);
+    }
+
+    DCOPY_check(backwards == digest, "blocks added in any order");
+
+    order[3] = 7;
+    order[7] = 3;
+    DCOPY_check(DCOPY_check_digest(order) != digest, "two blocks swapped");
+    order[3] = 3;
+    order[7] = 7;
+
+    DCOPY_check_data[5][100] ^= 0x20;
+    DCOPY_check(DCOPY_check_digest(order) != digest, "one block corrupted");
+
+    DCOPY_check_data[9][100] ^= 0x20;
+    DCOPY_check(DCOPY_check_digest(order) != digest, "two blocks corrupted the same way");
+
+    DCOPY_check_data[5][100] ^= 0x20;
+    DCOPY_check_data[9][100] ^= 0x20;
+    DCOPY_check(DCOPY_check_digest(order) == digest, "blocks restored");
+
+    return DCOPY_check_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* EOF */
@@ -0,0 +1,584 @@
+/*
+ * This file contains the directory table, which sets the ownership,
+ * permissions, and timestamps of each directory as soon as the work below it
+ * is done, rather than in a pass over the whole tree after libcircle finishes.
+ *
+ * The rank which walks a directory adds an entry for it here, and counts each
+ * walk and batch it enqueues for the objects inside as pending work of the
+ * entry. Those operations carry the ID of the entry (DCOPY_dir_id_t) as their
+ * parent, and the rank which finishes one takes it off the count. When the
+ * count reaches zero, the rank which keeps the entry finishes the directory,
+ * which in turn takes it off the count of its own parent. A batch hands its
+ * place in its directory to a group entry, which has no path, so the files it
+ * has to walk again on their own are counted on the rank which has them.
+ *
+ * Counts only ever grow on the rank which keeps the entry, before the work
+ * they stand for is enqueued, so they can't reach zero early. Finished work
+ * on entries of other ranks is collected per rank and sent in batches with
+ * MPI_Isend, and received whenever libcircle hands this rank work. Whatever
+ * is still in flight when libcircle finishes is drained by
+ * DCOPY_dir_table_finalize.
+ *
+ * Only the entries of a directory change it, so an object counts as done once
+ * it exists, while its data may still be copied. A directory which its owner
+ * can't search is therefore left for the metadata pass at the end, as are
+ * directories work was dropped under at the walltime. Those are kept in a
+ * list of their own, so that pass goes through them level by level without
+ * reading the records of every file again.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "dirtable.h"
+#include "treewalk.h"
+#include "dcp.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/* The tag of messages with finished work. */
+#define DCOPY_DIR_TABLE_TAG (1)
+
+/* A directory, or a group which takes the place of a batch. */
+typedef struct {
+    int64_t pending;        /* work left below it, or -1 if the entry is free */
+    int64_t next_free;
+    DCOPY_dir_id_t parent;
+    char* path;             /* NULL for a group */
+    struct stat64* sb;
+} DCOPY_dir_entry_t;
+
+/* A directory left for the metadata pass. */
+typedef struct {
+    char* path;
+    struct stat64* sb;
+    int depth;
+} DCOPY_dir_left_t;
+
+/* Finished work collected for the entries of another rank. */
+typedef struct {
+    int64_t* pairs;         /* the index of each entry and its finished work */
+    size_t len;             /* number of pairs */
+    size_t cap;
+    int64_t* sending;       /* the pairs of the message in flight */
+    size_t sending_cap;
+    MPI_Request request;
+} DCOPY_dir_outbox_t;
+
+static bool DCOPY_dir_table_enabled = false;
+static MPI_Comm DCOPY_dir_table_comm = MPI_COMM_NULL;
+
+static DCOPY_dir_entry_t* DCOPY_dir_entries = NULL;
+static int64_t DCOPY_dir_num_entries = 0;
+static int64_t DCOPY_dir_cap = 0;
+static int64_t DCOPY_dir_free = -1;
+
+/* One outbox per rank, allocated once there is something to send there. */
+static DCOPY_dir_outbox_t** DCOPY_dir_outboxes = NULL;
+
+static int64_t* DCOPY_dir_inbox = NULL;
+static int DCOPY_dir_inbox_cap = 0;
+
+static DCOPY_dir_left_t* DCOPY_dir_left = NULL;
+static size_t DCOPY_dir_num_left = 0;
+static size_t DCOPY_dir_left_cap = 0;
+
+static int64_t DCOPY_dir_sent = 0;
+static int64_t DCOPY_dir_received = 0;
+static double DCOPY_dir_last_flush = 0.0;
+
+/*
+ * Set up the directory table. This must be called by every rank before
+ * libcircle starts.
+ */
+void DCOPY_dir_table_init(void)
+{
+    /* nothing gets its metadata without a copy */
+    if(DCOPY_user_opts.compare_only || DCOPY_user_opts.verify_path != NULL) {
+        return;
+    }
+
+    if(MPI_Comm_dup(MPI_COMM_WORLD, &DCOPY_dir_table_comm) != MPI_SUCCESS) {
+        LOG(DCOPY_LOG_ERR, "Failed to set up the directory table.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    DCOPY_dir_outboxes = (DCOPY_dir_outbox_t**) calloc((size_t) DCOPY_global_size, \
+                         sizeof(DCOPY_dir_outbox_t*));
+
+    if(DCOPY_dir_outboxes == NULL) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    DCOPY_dir_table_enabled = true;
+}
+
+/*
+ * Leave the directory of entry for the metadata pass. The list takes over
+ * its path and stat info.
+ */
+static void DCOPY_dir_table_leave(DCOPY_dir_entry_t* entry)
+{
+    if(DCOPY_dir_num_left == DCOPY_dir_left_cap) {
+        DCOPY_dir_left_cap = DCOPY_dir_left_cap > 0 ? DCOPY_dir_left_cap * 2 : 64;
+        DCOPY_dir_left = (DCOPY_dir_left_t*) realloc(DCOPY_dir_left, \
+                         DCOPY_dir_left_cap * sizeof(DCOPY_dir_left_t));
+
+        if(DCOPY_dir_left == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+
+    DCOPY_dir_left[DCOPY_dir_num_left].path = entry->path;
+    DCOPY_dir_left[DCOPY_dir_num_left].sb = entry->sb;
+    DCOPY_dir_left[DCOPY_dir_num_left].depth = DCOPY_compute_depth(entry->path);
+    DCOPY_dir_num_left++;
+
+    entry->path = NULL;
+    entry->sb = NULL;
+}
+
+/* Send the work collected in box, unless the last message is still in flight. */
+static void DCOPY_dir_table_send(int rank, \
+                                 DCOPY_dir_outbox_t* box)
+{
+    int done;
+
+    if(box->len == 0) {
+        return;
+    }
+
+    MPI_Test(&box->request, &done, MPI_STATUS_IGNORE);
+
+    if(!done) {
+        return;
+    }
+
+    int64_t* pairs = box->sending;
+    size_t cap = box->sending_cap;
+
+    box->sending = box->pairs;
+    box->sending_cap = box->cap;
+    box->pairs = pairs;
+    box->cap = cap;
+
+    if(MPI_Isend(box->sending, (int)(2 * box->len), MPI_INT64_T, rank, \
+                 DCOPY_DIR_TABLE_TAG, DCOPY_dir_table_comm, &box->request) != MPI_SUCCESS) {
+        LOG(DCOPY_LOG_ERR, "Failed to send finished work to rank `%d'.", rank);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    DCOPY_dir_sent++;
+    box->len = 0;
+}
+
+/* Collect done pieces of finished work for the entry index of rank. */
+static void DCOPY_dir_table_collect(int rank, \
+                                    int64_t index, \
+                                    int64_t done)
+{
+    DCOPY_dir_outbox_t* box = DCOPY_dir_outboxes[rank];
+
+    if(box == NULL) {
+        box = (DCOPY_dir_outbox_t*) calloc(1, sizeof(DCOPY_dir_outbox_t));
+
+        if(box == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        box->request = MPI_REQUEST_NULL;
+        DCOPY_dir_outboxes[rank] = box;
+    }
+
+    /* the objects of a directory tend to be finished together */
+    if(box->len > 0 && box->pairs[2 * (box->len - 1)] == index) {
+        box->pairs[2 * box->len - 1] += done;
+        return;
+    }
+
+    if(box->len == box->cap) {
+        size_t cap = box->cap > 0 ? box->cap * 2 : DCOPY_DIR_TABLE_BATCH;
+        int64_t* pairs = (int64_t*) realloc(box->pairs, 2 * cap * sizeof(int64_t));
+
+        if(pairs == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        box->pairs = pairs;
+        box->cap = cap;
+    }
+
+    box->pairs[2 * box->len] = index;
+    box->pairs[2 * box->len + 1] = done;
+    box->len++;
+
+    if(box->len >= DCOPY_DIR_TABLE_BATCH) {
+        DCOPY_dir_table_send(rank, box);
+    }
+}
+
+/*
+ * Finish the entry index, which has no pending work left, and take it off
+ * the pending work of its parent. Parents kept by this rank are finished in
+ * turn.
+ */
+static void DCOPY_dir_table_finish(int64_t index)
+{
+    while(index >= 0) {
+        DCOPY_dir_entry_t* entry = &DCOPY_dir_entries[index];
+        DCOPY_dir_id_t parent = entry->parent;
+
+        if(entry->path != NULL) {
+            if(entry->sb->st_mode & S_IXUSR) {
+                DCOPY_copy_metadata(entry->sb, entry->path);
+                DCOPY_statistics.dirs_finished_early++;
+            }
+            else {
+                /* data may still be written below it */
+                DCOPY_dir_table_leave(entry);
+            }
+
+            free(entry->path);
+            free(entry->sb);
+        }
+
+        entry->pending = -1;
+        entry->next_free = DCOPY_dir_free;
+        DCOPY_dir_free = index;
+
+        index = -1;
+
+        if(parent.rank == CIRCLE_global_rank) {
+            if(--DCOPY_dir_entries[parent.index].pending == 0) {
+                index = parent.index;
+            }
+        }
+        else if(parent.rank >= 0) {
+            DCOPY_dir_table_collect(parent.rank, parent.index, 1);
+        }
+    }
+}
+
+/* Take the finished work other ranks sent off the entries of this rank. */
+static void DCOPY_dir_table_receive(void)
+{
+    MPI_Status status;
+    int flag;
+    int count;
+    int i;
+
+    for(;;) {
+        MPI_Iprobe(MPI_ANY_SOURCE, DCOPY_DIR_TABLE_TAG, DCOPY_dir_table_comm, &flag, &status);
+
+        if(!flag) {
+            return;
+        }
+
+        MPI_Get_count(&status, MPI_INT64_T, &count);
+
+        if(count > DCOPY_dir_inbox_cap) {
+            int64_t* inbox = (int64_t*) realloc(DCOPY_dir_inbox, (size_t) count * sizeof(int64_t));
+
+            if(inbox == NULL) {
+                LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+                DCOPY_abort(EXIT_FAILURE);
+            }
+
+            DCOPY_dir_inbox = inbox;
+            DCOPY_dir_inbox_cap = count;
+        }
+
+        MPI_Recv(DCOPY_dir_inbox, count, MPI_INT64_T, status.MPI_SOURCE, \
+                 DCOPY_DIR_TABLE_TAG, DCOPY_dir_table_comm, MPI_STATUS_IGNORE);
+        DCOPY_dir_received++;
+
+        for(i = 0; i + 1 < count; i += 2) {
+            int64_t index = DCOPY_dir_inbox[i];
+            int64_t done = DCOPY_dir_inbox[i + 1];
+
+            if(index < 0 || index >= DCOPY_dir_num_entries || \
+                    DCOPY_dir_entries[index].pending < done) {
+                LOG(DCOPY_LOG_ERR, "Rank `%d' finished work of an unknown directory.", \
+                    status.MPI_SOURCE);
+                DCOPY_abort(EXIT_FAILURE);
+            }
+
+            DCOPY_dir_entries[index].pending -= done;
+
+            if(DCOPY_dir_entries[index].pending == 0) {
+                DCOPY_dir_table_finish(index);
+            }
+        }
+    }
+}
+
+/*
+ * Add an entry for the directory dest_path, or a group if it is NULL, which
+ * is counted as pending work of parent. The entry starts with one piece of
+ * pending work, which the caller finishes once it has counted everything it
+ * enqueued.
+ */
+DCOPY_dir_id_t DCOPY_dir_table_add(const char* dest_path, \
+                                   const struct stat64* statbuf, \
+                                   const DCOPY_dir_id_t* parent)
+{
+    DCOPY_dir_id_t id = { -1, 0 };
+
+    if(!DCOPY_dir_table_enabled) {
+        return id;
+    }
+
+    if(DCOPY_dir_free >= 0) {
+        id.index = DCOPY_dir_free;
+        DCOPY_dir_free = DCOPY_dir_entries[id.index].next_free;
+    }
+    else {
+        if(DCOPY_dir_num_entries == DCOPY_dir_cap) {
+            int64_t cap = DCOPY_dir_cap > 0 ? DCOPY_dir_cap * 2 : 1024;
+            DCOPY_dir_entry_t* entries = (DCOPY_dir_entry_t*) realloc(DCOPY_dir_entries, \
+                                         (size_t) cap * sizeof(DCOPY_dir_entry_t));
+
+            if(entries == NULL) {
+                LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+                DCOPY_abort(EXIT_FAILURE);
+            }
+
+            DCOPY_dir_entries = entries;
+            DCOPY_dir_cap = cap;
+        }
+
+        id.index = DCOPY_dir_num_entries++;
+    }
+
+    DCOPY_dir_entry_t* entry = &DCOPY_dir_entries[id.index];
+
+    entry->pending = 1;
+    entry->parent = *parent;
+    entry->path = NULL;
+    entry->sb = NULL;
+
+    if(dest_path != NULL) {
+        entry->path = strdup(dest_path);
+        entry->sb = (struct stat64*) malloc(sizeof(struct stat64));
+
+        if(entry->path == NULL || entry->sb == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the directory table.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        memcpy(entry->sb, statbuf, sizeof(struct stat64));
+    }
+
+    id.rank = CIRCLE_global_rank;
+
+    return id;
+}
+
+/*
+ * Add delta to the pending work of the entry id. Only the rank which keeps an
+ * entry may add to it; other ranks may only take finished work off it.
+ */
+void DCOPY_dir_table_update(const DCOPY_dir_id_t* id, \
+                            int64_t delta)
+{
+    if(!DCOPY_dir_table_enabled || id->rank < 0) {
+        return;
+    }
+
+    if(id->rank != CIRCLE_global_rank) {
+        if(delta > 0) {
+            LOG(DCOPY_LOG_ERR, "Added work to a directory kept by rank `%d'.", id->rank);
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        DCOPY_dir_table_collect(id->rank, id->index, -delta);
+        return;
+    }
+
+    DCOPY_dir_entries[id->index].pending += delta;
+
+    if(DCOPY_dir_entries[id->index].pending == 0) {
+        DCOPY_dir_table_finish(id->index);
+    }
+}
+
+/*
+ * Receive finished work from other ranks, and send what was collected for
+ * them every DCOPY_DIR_TABLE_DELAY seconds.
+ */
+void DCOPY_dir_table_poll(void)
+{
+    int rank;
+
+    if(!DCOPY_dir_table_enabled) {
+        return;
+    }
+
+    DCOPY_dir_table_receive();
+
+    double now = MPI_Wtime();
+
+    if(now - DCOPY_dir_last_flush < DCOPY_DIR_TABLE_DELAY) {
+        return;
+    }
+
+    DCOPY_dir_last_flush = now;
+
+    for(rank = 0; rank < DCOPY_global_size; rank++) {
+        if(DCOPY_dir_outboxes[rank] != NULL) {
+            DCOPY_dir_table_send(rank, DCOPY_dir_outboxes[rank]);
+        }
+    }
+}
+
+/*
+ * Exchange the finished work which is still in flight once libcircle has
+ * finished, and release the table. Directories which are left go to the
+ * metadata pass. This must be called by every rank.
+ */
+void DCOPY_dir_table_finalize(void)
+{
+    int64_t counts[3];
+    int64_t totals[3];
+    int64_t left = 0;
+    int64_t i;
+    int rank;
+
+    if(!DCOPY_dir_table_enabled) {
+        return;
+    }
+
+    /* until every message sent was received and nothing waits to be sent */
+    do {
+        DCOPY_dir_table_receive();
+
+        counts[2] = 0;
+
+        for(rank = 0; rank < DCOPY_global_size; rank++) {
+            DCOPY_dir_outbox_t* box = DCOPY_dir_outboxes[rank];
+
+            if(box != NULL) {
+                DCOPY_dir_table_send(rank, box);
+                counts[2] += (int64_t) box->len;
+            }
+        }
+
+        counts[0] = DCOPY_dir_sent;
+        counts[1] = DCOPY_dir_received;
+
+        MPI_Allreduce(counts, totals, 3, MPI_INT64_T, MPI_SUM, DCOPY_dir_table_comm);
+    } while(totals[0] != totals[1] || totals[2] > 0);
+
+    for(rank = 0; rank < DCOPY_global_size; rank++) {
+        DCOPY_dir_outbox_t* box = DCOPY_dir_outboxes[rank];
+
+        if(box != NULL) {
+            MPI_Wait(&box->request, MPI_STATUS_IGNORE);
+            free(box->pairs);
+            free(box->sending);
+            free(box);
+        }
+    }
+
+    /* only work dropped at the walltime leaves directories unfinished */
+    for(i = 0; i < DCOPY_dir_num_entries; i++) {
+        DCOPY_dir_entry_t* entry = &DCOPY_dir_entries[i];
+
+        if(entry->pending > 0 && entry->path != NULL) {
+            DCOPY_dir_table_leave(entry);
+            left++;
+        }
+    }
+
+    if(left > 0) {
+        LOG(DCOPY_LOG_DBG, "Left `%" PRId64 "' unfinished directories for the " \
+            "metadata pass.", left);
+    }
+
+    free(DCOPY_dir_outboxes);
+    free(DCOPY_dir_entries);
+    free(DCOPY_dir_inbox);
+
+    DCOPY_dir_outboxes = NULL;
+    DCOPY_dir_entries = NULL;
+    DCOPY_dir_inbox = NULL;
+    DCOPY_dir_num_entries = 0;
+    DCOPY_dir_cap = 0;
+    DCOPY_dir_free = -1;
+
+    MPI_Comm_free(&DCOPY_dir_table_comm);
+    DCOPY_dir_table_enabled = false;
+}
+
+/* Order directories left for the metadata pass deepest first. */
+static int DCOPY_dir_left_cmp(const void* a, \
+                              const void* b)
+{
+    int da = ((const DCOPY_dir_left_t*) a)->depth;
+    int db = ((const DCOPY_dir_left_t*) b)->depth;
+
+    return (db > da) - (db < da);
+}
+
+/*
+ * Set the ownership, permissions, and timestamps of the directories left for
+ * the metadata pass, starting from the deepest level and working backwards,
+ * once the files have theirs. This must be called by all ranks.
+ */
+void DCOPY_dir_table_set_metadata(void)
+{
+    int depth = -1;
+    int max_depth;
+    size_t i = 0;
+
+    qsort(DCOPY_dir_left, DCOPY_dir_num_left, sizeof(DCOPY_dir_left_t), \
+          DCOPY_dir_left_cmp);
+
+    if(DCOPY_dir_num_left > 0) {
+        depth = DCOPY_dir_left[0].depth;
+    }
+
+    /* directories may hold files of other procs, which are all done once
+     * every proc has come this far */
+    MPI_Allreduce(&depth, &max_depth, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+    for(depth = max_depth; depth > 0; depth--) {
+        for(; i < DCOPY_dir_num_left && DCOPY_dir_left[i].depth == depth; i++) {
+            DCOPY_copy_metadata(DCOPY_dir_left[i].sb, DCOPY_dir_left[i].path);
+        }
+
+        /* wait for all procs to finish before we start
+         * with directories at next level */
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+}
+
+/* Free the directories left for the metadata pass. */
+void DCOPY_dir_table_release(void)
+{
+    size_t i;
+
+    for(i = 0; i < DCOPY_dir_num_left; i++) {
+        free(DCOPY_dir_left[i].path);
+        free(DCOPY_dir_left[i].sb);
+    }
+
+    free(DCOPY_dir_left);
+
+    DCOPY_dir_left = NULL;
+    DCOPY_dir_num_left = 0;
+    DCOPY_dir_left_cap = 0;
+}
+
+/* EOF */
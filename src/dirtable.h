@@ -0,0 +1,25 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_DIRTABLE_H
+#define __DCP_DIRTABLE_H
+
+#include "common.h"
+
+void DCOPY_dir_table_init(void);
+
+DCOPY_dir_id_t DCOPY_dir_table_add(const char* dest_path, \
+                                   const struct stat64* statbuf, \
+                                   const DCOPY_dir_id_t* parent);
+
+void DCOPY_dir_table_update(const DCOPY_dir_id_t* id, \
+                            int64_t delta);
+
+void DCOPY_dir_table_poll(void);
+
+void DCOPY_dir_table_finalize(void);
+
+void DCOPY_dir_table_set_metadata(void);
+
+void DCOPY_dir_table_release(void);
+
+#endif /* __DCP_DIRTABLE_H */
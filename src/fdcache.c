@@ -0,0 +1,232 @@
+/*
+ * This file contains a small cache of open file descriptors. The copy,
+ * cleanup, and compare stages of a large file touch it once per chunk, so
+ * each rank keeps the descriptors it opened around instead of going back to
+ * the metadata server every time. Source descriptors are keyed by the
+ * operand, destination descriptors by the destination path. Destination
+ * directories are cached as well, so files are opened with openat() instead
+ * of resolving the whole path again. When the cache is full, the least
+ * recently used descriptor is closed.
+ *
+ * Callers must not close descriptors they get from here.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "fdcache.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+typedef enum {
+    DCOPY_FD_SOURCE, DCOPY_FD_DEST, DCOPY_FD_DIR
+} DCOPY_fd_kind_t;
+
+typedef struct {
+    char* path;             /* NULL if the entry is free */
+    DCOPY_fd_kind_t kind;
+    int fd;
+    uint64_t last_used;
+} DCOPY_fd_entry_t;
+
+static DCOPY_fd_entry_t DCOPY_fd_cache[DCOPY_FD_CACHE_SIZE];
+
+/* Ticks on every lookup, so larger last_used means more recent. */
+static uint64_t DCOPY_fd_clock = 0;
+
+/* Close the descriptor of an entry and free it. */
+static void DCOPY_fd_cache_close(DCOPY_fd_entry_t* entry)
+{
+    /* Write errors may only show up when the last descriptor is closed. */
+    if(close(entry->fd) < 0) {
+        LOG(DCOPY_LOG_ERR, "Close on `%s' failed. errno=%d %s", \
+            entry->path, errno, strerror(errno));
+    }
+
+    free(entry->path);
+    entry->path = NULL;
+    entry->fd = -1;
+}
+
+/* Find an open descriptor, or return -1. */
+static int DCOPY_fd_cache_find(DCOPY_fd_kind_t kind, \
+                               const char* path)
+{
+    int i;
+
+    for(i = 0; i < DCOPY_FD_CACHE_SIZE; i++) {
+        DCOPY_fd_entry_t* entry = &DCOPY_fd_cache[i];
+
+        if(entry->path != NULL && entry->kind == kind && \
+                strcmp(entry->path, path) == 0) {
+            entry->last_used = ++DCOPY_fd_clock;
+            return entry->fd;
+        }
+    }
+
+    return -1;
+}
+
+/* Remember a descriptor, closing the least recently used one if needed. */
+static void DCOPY_fd_cache_insert(DCOPY_fd_kind_t kind, \
+                                  const char* path, \
+                                  int fd)
+{
+    DCOPY_fd_entry_t* victim = &DCOPY_fd_cache[0];
+    int i;
+
+    for(i = 0; i < DCOPY_FD_CACHE_SIZE; i++) {
+        DCOPY_fd_entry_t* entry = &DCOPY_fd_cache[i];
+
+        if(entry->path == NULL) {
+            victim = entry;
+            break;
+        }
+
+        if(entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    if(victim->path != NULL) {
+        DCOPY_fd_cache_close(victim);
+    }
+
+    victim->path = strdup(path);
+
+    if(victim->path == NULL) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate descriptor cache entry.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    victim->kind = kind;
+    victim->fd = fd;
+    victim->last_used = ++DCOPY_fd_clock;
+}
+
+/* Get a read-only descriptor for the source of op, or -1 on error. */
+int DCOPY_fd_cache_source(DCOPY_operation_t* op)
+{
+    int fd = DCOPY_fd_cache_find(DCOPY_FD_SOURCE, op->operand);
+
+    if(fd >= 0) {
+        DCOPY_statistics.fd_cache_hits++;
+        return fd;
+    }
+
+    DCOPY_statistics.fd_cache_misses++;
+
+    fd = DCOPY_open_input_fd(op, 0, 0);
+
+    if(fd >= 0) {
+        DCOPY_fd_cache_insert(DCOPY_FD_SOURCE, op->operand, fd);
+    }
+
+    return fd;
+}
+
+/*
+ * Get a descriptor for the destination of op, or -1 on error. It is opened
+ * for reading and writing so the copy, cleanup, and compare stages can all
+ * share it.
+ */
+int DCOPY_fd_cache_dest(DCOPY_operation_t* op)
+{
+    int fd = DCOPY_fd_cache_find(DCOPY_FD_DEST, op->dest_full_path);
+
+    if(fd >= 0) {
+        DCOPY_statistics.fd_cache_hits++;
+        return fd;
+    }
+
+    DCOPY_statistics.fd_cache_misses++;
+
+    /* an existing copy that is only compared is never written to */
+    if(DCOPY_user_opts.compare_only) {
+        fd = DCOPY_open_dest_fd(op, O_RDONLY | O_NOATIME);
+    }
+    else {
+        fd = DCOPY_open_dest_fd(op, O_RDWR | O_CREAT | O_NOATIME);
+    }
+
+    if(fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to open destination path `%s' when copying " \
+            "from source `%s'. %s", op->dest_full_path, op->operand, strerror(errno));
+        return -1;
+    }
+
+    DCOPY_fd_cache_insert(DCOPY_FD_DEST, op->dest_full_path, fd);
+
+    return fd;
+}
+
+/*
+ * Get a descriptor for a destination directory to use with the *at() calls,
+ * or -1 on error.
+ */
+int DCOPY_fd_cache_dir(const char* path)
+{
+    int fd = DCOPY_fd_cache_find(DCOPY_FD_DIR, path);
+
+    if(fd >= 0) {
+        return fd;
+    }
+
+    fd = open64(path, O_PATH | O_DIRECTORY);
+
+    if(fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to open destination directory `%s'. %s", \
+            path, strerror(errno));
+        return -1;
+    }
+
+    DCOPY_fd_cache_insert(DCOPY_FD_DIR, path, fd);
+
+    return fd;
+}
+
+/*
+ * Close any descriptors for the source and destination of op, e.g. after an
+ * error or before the destination is unlinked.
+ */
+void DCOPY_fd_cache_evict(DCOPY_operation_t* op)
+{
+    int i;
+
+    for(i = 0; i < DCOPY_FD_CACHE_SIZE; i++) {
+        DCOPY_fd_entry_t* entry = &DCOPY_fd_cache[i];
+
+        if(entry->path == NULL) {
+            continue;
+        }
+
+        if((entry->kind == DCOPY_FD_SOURCE && strcmp(entry->path, op->operand) == 0) || \
+                (entry->kind == DCOPY_FD_DEST && strcmp(entry->path, op->dest_full_path) == 0)) {
+            DCOPY_fd_cache_close(entry);
+        }
+    }
+}
+
+/* Close every cached descriptor. */
+void DCOPY_fd_cache_flush(void)
+{
+    int i;
+
+    for(i = 0; i < DCOPY_FD_CACHE_SIZE; i++) {
+        if(DCOPY_fd_cache[i].path != NULL) {
+            DCOPY_fd_cache_close(&DCOPY_fd_cache[i]);
+        }
+    }
+}
+
+/* EOF */
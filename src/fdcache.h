@@ -0,0 +1,18 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_FDCACHE_H
+#define __DCP_FDCACHE_H
+
+#include "common.h"
+
+int DCOPY_fd_cache_source(DCOPY_operation_t* op);
+
+int DCOPY_fd_cache_dest(DCOPY_operation_t* op);
+
+int DCOPY_fd_cache_dir(const char* path);
+
+void DCOPY_fd_cache_evict(DCOPY_operation_t* op);
+
+void DCOPY_fd_cache_flush(void);
+
+#endif /* __DCP_FDCACHE_H */
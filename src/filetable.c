@@ -0,0 +1,410 @@
+/*
+ * This file contains the file table. When the treewalk stage splits a file
+ * into chunks, it registers the paths and sizes of the file here once, and
+ * the chunks only carry its ID (DCOPY_file_id_t) through the copy, cleanup,
+ * and compare stages instead of repeating the paths in every message.
+ *
+ * Each rank keeps the records it registered in slabs of DCOPY_FILE_TABLE_SLAB
+ * bytes, which are attached to an MPI window, and a record is never moved or
+ * freed before libcircle finishes. The ID of a record is the rank which owns
+ * it and its address and length there, so a rank which got a chunk from
+ * another one reads the record with a single MPI_Get under a shared lock. It
+ * keeps what it read in a small direct-mapped cache, since the chunks of a
+ * file tend to be stolen together. A single rank only reads its own records,
+ * so it keeps them without a window. If the MPI library can't create one,
+ * nothing is registered, and chunks carry the paths of their files again.
+ *
+ * A record also counts the chunks of its file which are not finished yet,
+ * and holds the stat info and parent directory the file gets once they are.
+ * Every rank takes its finished chunks off the count with MPI_Fetch_and_op,
+ * so the one that finishes the last chunk knows it without asking anyone.
+ * The count starts at DCOPY_FILE_PENDING_HOLD, which the rank that splits
+ * the file takes off with the number of chunks it enqueued, so it can't
+ * reach zero while chunks are still being enqueued.
+ *
+ *     DCOPY_file_record_t, operand, '\0', destination path, '\0'
+ *
+ * All ranks run the same binary, so records are kept in host byte order.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "filetable.h"
+#include "dcp.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/* The fixed part of a record, which the two paths follow. */
+typedef struct {
+    int64_t pending;        /* chunks left, only changed atomically */
+    int64_t file_size;
+    int64_t chunk_size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t parent_index;
+    int32_t parent_rank;
+    uint32_t atime_nsec;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint16_t source_base_offset;
+} DCOPY_file_record_t;
+
+/* The longest record there can be. */
+#define DCOPY_FILE_RECORD_MAX (sizeof(DCOPY_file_record_t) + 2 * PATH_MAX)
+
+/* A record read from another rank. */
+typedef struct {
+    int rank;               /* -1 if the entry is free */
+    uint64_t disp;
+    char* record;
+} DCOPY_file_cache_entry_t;
+
+/* The window all slabs of this rank are attached to, if there are others. */
+static MPI_Win DCOPY_file_table_win = MPI_WIN_NULL;
+
+/* Whether files are registered at all. */
+static int DCOPY_file_table_enabled = 0;
+
+/* The slabs of this rank, and how much of the last one is used. */
+static char** DCOPY_file_table_slabs = NULL;
+static size_t DCOPY_file_table_num_slabs = 0;
+static size_t DCOPY_file_table_used = DCOPY_FILE_TABLE_SLAB;
+
+static DCOPY_file_cache_entry_t DCOPY_file_table_cache[DCOPY_FILE_TABLE_CACHE_SIZE];
+
+/*
+ * Set up the window for the file table. This must be called by every rank
+ * before libcircle starts.
+ */
+void DCOPY_file_table_init(void)
+{
+    MPI_Errhandler errhandler;
+    int size;
+    int created;
+    int i;
+
+    for(i = 0; i < DCOPY_FILE_TABLE_CACHE_SIZE; i++) {
+        DCOPY_file_table_cache[i].rank = -1;
+        DCOPY_file_table_cache[i].record = NULL;
+    }
+
+    DCOPY_file_table_enabled = 1;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    if(size == 1) {
+        return;
+    }
+
+    /* some MPI libraries don't support dynamic windows on every transport */
+    MPI_Comm_get_errhandler(MPI_COMM_WORLD, &errhandler);
+    MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+
+    i = MPI_Win_create_dynamic(MPI_INFO_NULL, MPI_COMM_WORLD, &DCOPY_file_table_win);
+
+    MPI_Comm_set_errhandler(MPI_COMM_WORLD, errhandler);
+    MPI_Errhandler_free(&errhandler);
+
+    /* every rank must be able to read the records of every other one */
+    created = (i == MPI_SUCCESS);
+    MPI_Allreduce(MPI_IN_PLACE, &created, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+
+    if(!created) {
+        if(i == MPI_SUCCESS) {
+            MPI_Win_free(&DCOPY_file_table_win);
+        }
+
+        DCOPY_file_table_win = MPI_WIN_NULL;
+        DCOPY_file_table_enabled = 0;
+
+        LOG(DCOPY_LOG_WARN, "Failed to set up the file table, " \
+            "so chunks will carry the paths of their files.");
+    }
+}
+
+/* Attach a new slab to the window, to register records in. */
+static void DCOPY_file_table_grow(void)
+{
+    char** slabs = (char**) realloc(DCOPY_file_table_slabs, \
+                                    sizeof(char*) * (DCOPY_file_table_num_slabs + 1));
+    char* slab = (char*) malloc(DCOPY_FILE_TABLE_SLAB);
+
+    if(slabs == NULL || slab == NULL) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate the file table.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    if(DCOPY_file_table_win != MPI_WIN_NULL && \
+            MPI_Win_attach(DCOPY_file_table_win, slab, DCOPY_FILE_TABLE_SLAB) != MPI_SUCCESS) {
+        LOG(DCOPY_LOG_ERR, "Failed to extend the file table.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    slabs[DCOPY_file_table_num_slabs++] = slab;
+    DCOPY_file_table_slabs = slabs;
+    DCOPY_file_table_used = 0;
+}
+
+/*
+ * Record the paths of the file op names, the sizes of its chunks, its stat
+ * info, and the directory it is counted in, and set the ID of op to the
+ * record, so it is sent with the chunks of the file. The sizes are also set
+ * in op, for when the file table is disabled. Returns true if the chunks of
+ * the file are counted in the record.
+ */
+bool DCOPY_file_table_register(DCOPY_operation_t* op, \
+                               const struct stat64* statbuf, \
+                               int64_t chunk_size)
+{
+    DCOPY_file_record_t header;
+    int64_t file_size = statbuf->st_size;
+    size_t operand_len = strlen(op->operand) + 1;
+    size_t dest_len = strlen(op->dest_full_path) + 1;
+    size_t len = sizeof(header) + operand_len + dest_len;
+
+    /* keep every record aligned for the fixed part */
+    size_t padded = (len + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1);
+
+    op->file_size = file_size;
+    op->chunk_size = chunk_size;
+
+    if(!DCOPY_file_table_enabled) {
+        return false;
+    }
+
+    if(DCOPY_file_table_used + padded > DCOPY_FILE_TABLE_SLAB) {
+        DCOPY_file_table_grow();
+    }
+
+    char* record = DCOPY_file_table_slabs[DCOPY_file_table_num_slabs - 1] + \
+                   DCOPY_file_table_used;
+    MPI_Aint disp;
+
+    memset(&header, 0, sizeof(header));
+    header.pending = DCOPY_FILE_PENDING_HOLD;
+    header.file_size = file_size;
+    header.chunk_size = chunk_size;
+    header.atime = (int64_t) statbuf->st_atim.tv_sec;
+    header.mtime = (int64_t) statbuf->st_mtim.tv_sec;
+    header.parent_index = op->parent.index;
+    header.parent_rank = op->parent.rank;
+    header.atime_nsec = (uint32_t) statbuf->st_atim.tv_nsec;
+    header.mtime_nsec = (uint32_t) statbuf->st_mtim.tv_nsec;
+    header.mode = (uint32_t) statbuf->st_mode;
+    header.uid = (uint32_t) statbuf->st_uid;
+    header.gid = (uint32_t) statbuf->st_gid;
+    header.source_base_offset = op->source_base_offset;
+
+    /* other ranks may be reading earlier records of the same slab */
+    if(DCOPY_file_table_win != MPI_WIN_NULL) {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, CIRCLE_global_rank, 0, DCOPY_file_table_win);
+    }
+
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), op->operand, operand_len);
+    memcpy(record + sizeof(header) + operand_len, op->dest_full_path, dest_len);
+
+    if(DCOPY_file_table_win != MPI_WIN_NULL) {
+        MPI_Win_unlock(CIRCLE_global_rank, DCOPY_file_table_win);
+    }
+
+    MPI_Get_address(record, &disp);
+
+    DCOPY_file_table_used += padded;
+
+    op->file_id.rank = CIRCLE_global_rank;
+    op->file_id.len = (uint32_t) len;
+    op->file_id.disp = (uint64_t) disp;
+
+    return true;
+}
+
+/* Read a record registered by another rank, through the cache. */
+static char* DCOPY_file_table_fetch(const DCOPY_file_id_t* id)
+{
+    size_t slot = (size_t)((id->disp / sizeof(int64_t)) ^ (uint64_t) id->rank * 0x9e3779b9) % \
+                  DCOPY_FILE_TABLE_CACHE_SIZE;
+    DCOPY_file_cache_entry_t* entry = &DCOPY_file_table_cache[slot];
+
+    if(entry->rank == id->rank && entry->disp == id->disp) {
+        DCOPY_statistics.file_table_hits++;
+        return entry->record;
+    }
+
+    DCOPY_statistics.file_table_misses++;
+
+    if(id->len > DCOPY_FILE_RECORD_MAX) {
+        LOG(DCOPY_LOG_ERR, "Could not look up a file record of `%" PRIu32 "' bytes.", \
+            id->len);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    if(entry->record == NULL) {
+        entry->record = (char*) malloc(DCOPY_FILE_RECORD_MAX);
+
+        if(entry->record == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the file table cache.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+
+    /* the entry is only valid again once the record is in it */
+    entry->rank = -1;
+
+    if(MPI_Win_lock(MPI_LOCK_SHARED, id->rank, 0, DCOPY_file_table_win) != MPI_SUCCESS || \
+            MPI_Get(entry->record, (int) id->len, MPI_BYTE, id->rank, (MPI_Aint) id->disp, \
+                    (int) id->len, MPI_BYTE, DCOPY_file_table_win) != MPI_SUCCESS || \
+            MPI_Win_unlock(id->rank, DCOPY_file_table_win) != MPI_SUCCESS) {
+        LOG(DCOPY_LOG_ERR, "Failed to look up a file registered by rank `%d'.", id->rank);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    entry->rank = id->rank;
+    entry->disp = id->disp;
+
+    return entry->record;
+}
+
+/*
+ * Fill in the paths and sizes of op from the record its ID names. The paths
+ * point into the table or its cache, and stay valid until the next lookup.
+ */
+void DCOPY_file_table_lookup(DCOPY_operation_t* op)
+{
+    char* record;
+    DCOPY_file_record_t header;
+
+    if(op->file_id.rank == CIRCLE_global_rank) {
+        record = (char*)(uintptr_t) op->file_id.disp;
+    }
+    else {
+        record = DCOPY_file_table_fetch(&op->file_id);
+    }
+
+    memcpy(&header, record, sizeof(header));
+
+    op->file_size = header.file_size;
+    op->chunk_size = header.chunk_size;
+    op->source_base_offset = header.source_base_offset;
+    op->operand = record + sizeof(header);
+    op->dest_full_path = op->operand + strlen(op->operand) + 1;
+    op->dest_base_appendix = NULL;
+}
+
+/*
+ * Take done chunks off the count of the file op names. If none are left, the
+ * stat info of the file and the directory it is counted in are set in statbuf
+ * and parent, and true is returned; this happens on exactly one rank.
+ */
+bool DCOPY_file_table_finish(DCOPY_operation_t* op, \
+                             int64_t done, \
+                             struct stat64* statbuf, \
+                             DCOPY_dir_id_t* parent)
+{
+    DCOPY_file_record_t header;
+    char* record;
+    int64_t left;
+
+    if(op->file_id.rank < 0) {
+        return false;
+    }
+
+    if(DCOPY_file_table_win == MPI_WIN_NULL) {
+        record = (char*)(uintptr_t) op->file_id.disp;
+        memcpy(&left, record, sizeof(left));
+        left -= done;
+        memcpy(record, &left, sizeof(left));
+    }
+    else {
+        int64_t delta = -done;
+        int64_t old;
+
+        /* the count comes first in the record */
+        if(MPI_Win_lock(MPI_LOCK_SHARED, op->file_id.rank, 0, DCOPY_file_table_win) != MPI_SUCCESS || \
+                MPI_Fetch_and_op(&delta, &old, MPI_INT64_T, op->file_id.rank, \
+                                 (MPI_Aint) op->file_id.disp, MPI_SUM, \
+                                 DCOPY_file_table_win) != MPI_SUCCESS || \
+                MPI_Win_unlock(op->file_id.rank, DCOPY_file_table_win) != MPI_SUCCESS) {
+            LOG(DCOPY_LOG_ERR, "Failed to count a chunk of a file registered by " \
+                "rank `%d'.", op->file_id.rank);
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        left = old - done;
+    }
+
+    if(left > 0) {
+        return false;
+    }
+
+    if(left < 0) {
+        LOG(DCOPY_LOG_ERR, "Finished more chunks than `%s' has.", op->dest_full_path);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    if(op->file_id.rank == CIRCLE_global_rank) {
+        record = (char*)(uintptr_t) op->file_id.disp;
+    }
+    else {
+        record = DCOPY_file_table_fetch(&op->file_id);
+    }
+
+    memcpy(&header, record, sizeof(header));
+
+    memset(statbuf, 0, sizeof(struct stat64));
+    statbuf->st_size = (off64_t) header.file_size;
+    statbuf->st_atim.tv_sec = (time_t) header.atime;
+    statbuf->st_atim.tv_nsec = (long) header.atime_nsec;
+    statbuf->st_mtim.tv_sec = (time_t) header.mtime;
+    statbuf->st_mtim.tv_nsec = (long) header.mtime_nsec;
+    statbuf->st_mode = (mode_t) header.mode;
+    statbuf->st_uid = (uid_t) header.uid;
+    statbuf->st_gid = (gid_t) header.gid;
+
+    parent->rank = (int) header.parent_rank;
+    parent->index = header.parent_index;
+
+    return true;
+}
+
+/*
+ * Release the file table once libcircle has finished. This must be called by
+ * every rank.
+ */
+void DCOPY_file_table_finalize(void)
+{
+    size_t i;
+
+    for(i = 0; i < DCOPY_file_table_num_slabs; i++) {
+        if(DCOPY_file_table_win != MPI_WIN_NULL) {
+            MPI_Win_detach(DCOPY_file_table_win, DCOPY_file_table_slabs[i]);
+        }
+
+        free(DCOPY_file_table_slabs[i]);
+    }
+
+    if(DCOPY_file_table_win != MPI_WIN_NULL) {
+        MPI_Win_free(&DCOPY_file_table_win);
+    }
+
+    DCOPY_file_table_enabled = 0;
+
+    free(DCOPY_file_table_slabs);
+    DCOPY_file_table_slabs = NULL;
+    DCOPY_file_table_num_slabs = 0;
+    DCOPY_file_table_used = DCOPY_FILE_TABLE_SLAB;
+
+    for(i = 0; i < DCOPY_FILE_TABLE_CACHE_SIZE; i++) {
+        free(DCOPY_file_table_cache[i].record);
+        DCOPY_file_table_cache[i].record = NULL;
+        DCOPY_file_table_cache[i].rank = -1;
+    }
+}
+
+/* EOF */
@@ -0,0 +1,23 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_FILETABLE_H
+#define __DCP_FILETABLE_H
+
+#include "common.h"
+
+void DCOPY_file_table_init(void);
+
+bool DCOPY_file_table_register(DCOPY_operation_t* op, \
+                               const struct stat64* statbuf, \
+                               int64_t chunk_size);
+
+void DCOPY_file_table_lookup(DCOPY_operation_t* op);
+
+bool DCOPY_file_table_finish(DCOPY_operation_t* op, \
+                             int64_t done, \
+                             struct stat64* statbuf, \
+                             DCOPY_dir_id_t* parent);
+
+void DCOPY_file_table_finalize(void);
+
+#endif /* __DCP_FILETABLE_H */
@@ -175,9 +175,6 @@ void DCOPY_enqueue_work_objects(CIRCLE_handle* handle)
     bool dest_is_dir = DCOPY_dest_is_dir();
     bool dest_is_file  = !dest_is_dir;
 
-    char* opts_dest_path_dirname;
-    char* src_path_dirname;
-
     uint32_t number_of_source_files = DCOPY_source_file_count();
 
     if(number_of_source_files < 1) {
@@ -185,6 +182,26 @@ void DCOPY_enqueue_work_objects(CIRCLE_handle* handle)
         DCOPY_abort(EXIT_FAILURE);
     }
 
+    /* A compare needs a copy to compare with. */
+    if(DCOPY_user_opts.compare_only && access(DCOPY_user_opts.dest_path, F_OK) < 0) {
+        LOG(DCOPY_LOG_ERR, "Could not access the destination to compare with at `%s'. %s", \
+            DCOPY_user_opts.dest_path, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    /*
+     * A compare, an update, or a delta works on an earlier copy, and so does
+     * a copy with a journal once it is resumed. A lone source directory is
+     * matched with the destination itself, since that is where a copy of it
+     * went when the destination did not exist yet.
+     */
+    if((DCOPY_user_opts.compare_only || DCOPY_user_opts.update || DCOPY_user_opts.delta || \
+            DCOPY_user_opts.journal_path != NULL) && \
+            DCOPY_user_opts.num_src_paths == 1 && \
+            DCOPY_is_directory(DCOPY_user_opts.src_path[0])) {
+        DCOPY_user_opts.conditional = true;
+    }
+
     if(dest_is_file) {
         LOG(DCOPY_LOG_DBG, "Infered that the destination is a file.");
 
@@ -193,51 +210,17 @@ void DCOPY_enqueue_work_objects(CIRCLE_handle* handle)
          * must be a file.
          */
         if(number_of_source_files == 1 && DCOPY_is_regular_file(DCOPY_user_opts.src_path[0])) {
-            /* Make a copy of the dest path so we can run dirname on it. */
-            size_t dest_size = sizeof(char) * PATH_MAX;
-            opts_dest_path_dirname = (char*) malloc(dest_size);
-
-            if(opts_dest_path_dirname == NULL) {
-                LOG(DCOPY_LOG_DBG, "Failed to allocate %llu bytes for dest path.", (long long unsigned) dest_size);
-                DCOPY_abort(EXIT_FAILURE);
-            }
-
-            int dest_written = snprintf(opts_dest_path_dirname, dest_size, "%s", DCOPY_user_opts.dest_path);
-
-            if(dest_written < 0 || (size_t)(dest_written) > dest_size - 1) {
-                LOG(DCOPY_LOG_DBG, "Destination path too long.");
-                DCOPY_abort(EXIT_FAILURE);
-            }
-
-            opts_dest_path_dirname = dirname(opts_dest_path_dirname);
-
-            /* Make a copy of the src path so we can run dirname on it. */
-            size_t src_size = sizeof(char) * PATH_MAX;
-            src_path_dirname = (char*) malloc(sizeof(char) * PATH_MAX);
-
-            if(src_path_dirname == NULL) {
-                LOG(DCOPY_LOG_DBG, "Failed to allocate %llu bytes for dest path.", (long long unsigned) src_size);
-                DCOPY_abort(EXIT_FAILURE);
-            }
-
-            int src_written = snprintf(src_path_dirname, src_size, "%s", DCOPY_user_opts.src_path[0]);
-
-            if(src_written < 0 || (size_t)(src_written) > src_size - 1) {
-                LOG(DCOPY_LOG_DBG, "Source path too long.");
-                DCOPY_abort(EXIT_FAILURE);
-            }
-
-            src_path_dirname = dirname(src_path_dirname);
-
+            /*
+             * The source base offset covers the whole source path, so the
+             * destination path is used as is rather than as a directory.
+             */
             /* LOG(DCOPY_LOG_DBG, "Enqueueing only a single source path `%s'.", DCOPY_user_opts.src_path[0]); */
             char* op = DCOPY_encode_operation(TREEWALK, 0, DCOPY_user_opts.src_path[0], \
-                                              (uint16_t)strlen(src_path_dirname), NULL, 0);
+                                              (uint16_t)strlen(DCOPY_user_opts.src_path[0]), NULL, 0, 0, NULL, 0, 0, \
+                                              NULL);
 
             handle->enqueue(op);
             free(op);
-
-            free(opts_dest_path_dirname);
-            free(src_path_dirname);
         }
         else {
             /*
@@ -296,7 +279,7 @@ void DCOPY_enqueue_work_objects(CIRCLE_handle* handle)
 
             char* op = DCOPY_encode_operation(TREEWALK, 0, src_path, \
                                               (uint16_t)(src_len - 1), \
-                                              src_path_basename, 0);
+                                              src_path_basename, 0, 0, NULL, 0, 0, NULL);
             handle->enqueue(op);
             free(src_path_basename_tmp);
         }
@@ -486,6 +469,62 @@ void DCOPY_parse_path_args(char** argv, \
     int num_args = argc - optind_local;
     int last_arg_index = num_args + optind_local - 1;
 
+    /* A compare-only run neither copies nor reads a manifest. */
+    if((DCOPY_user_opts.diff_path != NULL && !DCOPY_user_opts.compare_only) || \
+            (DCOPY_user_opts.compare_only && \
+             (DCOPY_user_opts.manifest_path != NULL || DCOPY_user_opts.verify_path != NULL || \
+              DCOPY_user_opts.update || DCOPY_user_opts.delta))) {
+        if(CIRCLE_global_rank == 0) {
+            DCOPY_print_usage(argv);
+            LOG(DCOPY_LOG_ERR, "A list of differences needs --compare-only, " \
+                "which can't be combined with --manifest, --verify, --update, or --delta.");
+        }
+
+        DCOPY_exit(EXIT_FAILURE);
+    }
+
+    /* A journal belongs to a copy, and a resume or a walltime needs one. */
+    if(((DCOPY_user_opts.resume || DCOPY_user_opts.walltime > 0) && \
+            DCOPY_user_opts.journal_path == NULL) || \
+            (DCOPY_user_opts.journal_path != NULL && \
+             (DCOPY_user_opts.compare_only || DCOPY_user_opts.verify_path != NULL || \
+              DCOPY_user_opts.manifest_path != NULL))) {
+        if(CIRCLE_global_rank == 0) {
+            DCOPY_print_usage(argv);
+            LOG(DCOPY_LOG_ERR, "--resume and --walltime need a --journal, which " \
+                "can't be combined with --compare-only, --verify, or --manifest.");
+        }
+
+        DCOPY_exit(EXIT_FAILURE);
+    }
+
+    /* A manifest lists every file, so none may be skipped as up to date. */
+    if(DCOPY_user_opts.manifest_path != NULL && DCOPY_user_opts.update) {
+        if(CIRCLE_global_rank == 0) {
+            DCOPY_print_usage(argv);
+            LOG(DCOPY_LOG_ERR, "--manifest can't be combined with --update.");
+        }
+
+        DCOPY_exit(EXIT_FAILURE);
+    }
+
+    /* A verify only names the tree to check, which takes the destination's place. */
+    if(DCOPY_user_opts.verify_path != NULL) {
+        if(argv == NULL || num_args != 1) {
+            if(CIRCLE_global_rank == 0) {
+                DCOPY_print_usage(argv);
+                LOG(DCOPY_LOG_ERR, "You must specify exactly one path to verify.");
+            }
+
+            DCOPY_exit(EXIT_FAILURE);
+        }
+
+        DCOPY_parse_dest_path(argv[last_arg_index]);
+        DCOPY_user_opts.num_src_paths = 0;
+        DCOPY_user_opts.src_path = NULL;
+        return;
+    }
+
     if(argv == NULL || num_args < 2) {
         if(CIRCLE_global_rank == 0) {
             DCOPY_print_usage(argv);
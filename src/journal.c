@@ -0,0 +1,597 @@
+/*
+ * This file contains the journal, which lets a copy that was cut short by a
+ * walltime or a failure be resumed without redoing the chunks it finished.
+ *
+ * Each rank keeps a record for every chunk that has made it through its last
+ * stage in memory, and appends them to its own shard of the journal (shard.c)
+ * every DCOPY_JOURNAL_INTERVAL seconds and before an abort. The destination
+ * is written to disk before the records are, so a crash of the node can't
+ * leave a chunk recorded whose data was still in the page cache. Shards are
+ * only ever appended to, and each run starts its part with the time it
+ * started:
+ *
+ *     # dcp journal 1 <start time>
+ *     C <file size> <chunk size> <chunk> <path>
+ *
+ * To resume, every rank reads all the shards into a hash table with one
+ * entry per file, which holds its path and size, the chunk size, and a bitmap
+ * of the finished chunks, and the treewalk stage and batches leave out what is in it. A
+ * chunk only counts if its source was last modified before the earliest run
+ * that recorded a chunk of the file started. Chunk sizes are picked as the
+ * tree is walked, so a file is cut into chunks of the size the journal has
+ * for it; records of a file cut another way by a later run are dropped.
+ *
+ * Past the walltime, ranks take work off the queue without doing it, so
+ * libcircle winds down on its own and the job still ends cleanly. What was
+ * left is found again by walking the tree, which is why the queue itself is
+ * not saved. Once a run finishes the copy, the journal is removed.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "journal.h"
+#include "shard.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/* The chunks of a file that earlier runs finished, and how it was cut. */
+typedef struct {
+    uint64_t key;
+    char*    path;
+    int64_t  file_size;
+    int64_t  chunk_size;
+    int64_t  started;
+    int64_t  num_chunks;
+    union {
+        uint64_t  word;  /* up to 64 chunks */
+        uint64_t* words; /* more than that */
+    } done;
+} DCOPY_journal_entry_t;
+
+/* The entries of all shards, hashed by key, with 0 marking a free slot. */
+static DCOPY_journal_entry_t* DCOPY_journal_table = NULL;
+static size_t DCOPY_journal_table_cap = 0;
+static size_t DCOPY_journal_table_len = 0;
+
+/* The shard of the journal this rank appends to. */
+static FILE* DCOPY_journal_shard = NULL;
+
+/* Records of chunks whose destination may not be on disk yet. */
+static FILE* DCOPY_journal_pending = NULL;
+static char* DCOPY_journal_pending_buf = NULL;
+static size_t DCOPY_journal_pending_len = 0;
+
+/* When the shard was last written to disk. */
+static double DCOPY_journal_synced = 0;
+
+/* Set once the walltime has passed. */
+static bool DCOPY_journal_stopping = false;
+
+/* FNV-1a of the destination path and the size of the file. */
+static uint64_t DCOPY_journal_hash(const char* dest_path, \
+                                   int64_t file_size)
+{
+    const unsigned char* c = (const unsigned char*) dest_path;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for(; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+
+    for(i = 0; i < sizeof(file_size); i++) {
+        hash = (hash ^ ((const unsigned char*) &file_size)[i]) * 1099511628211ULL;
+    }
+
+    /* 0 marks a free slot */
+    return hash != 0 ? hash : 1;
+}
+
+/*
+ * The slot of the table which holds the entry of a file, or the free slot it
+ * would go in. The hash only narrows it down, since two files may share one.
+ */
+static DCOPY_journal_entry_t* DCOPY_journal_slot(uint64_t key, \
+                                                 const char* dest_path, \
+                                                 int64_t file_size)
+{
+    size_t mask = DCOPY_journal_table_cap - 1;
+    size_t i = (size_t) key & mask;
+
+    while(DCOPY_journal_table[i].key != 0 && \
+            (DCOPY_journal_table[i].key != key || \
+             DCOPY_journal_table[i].file_size != file_size || \
+             strcmp(DCOPY_journal_table[i].path, dest_path) != 0)) {
+        i = (i + 1) & mask;
+    }
+
+    return &DCOPY_journal_table[i];
+}
+
+/* Find the entry for a file, or NULL. */
+static const DCOPY_journal_entry_t* DCOPY_journal_find(const char* dest_path, \
+                                                       const struct stat64* statbuf)
+{
+    if(DCOPY_journal_table_len == 0) {
+        return NULL;
+    }
+
+    DCOPY_journal_entry_t* entry = DCOPY_journal_slot( \
+                                   DCOPY_journal_hash(dest_path, statbuf->st_size), \
+                                   dest_path, statbuf->st_size);
+
+    return entry->key != 0 ? entry : NULL;
+}
+
+/* The bitmap of finished chunks of an entry. */
+static uint64_t* DCOPY_journal_bits(DCOPY_journal_entry_t* entry)
+{
+    return entry->num_chunks <= 64 ? &entry->done.word : entry->done.words;
+}
+
+/* The bitmap of finished chunks of an entry, to read. */
+static const uint64_t* DCOPY_journal_bits_const(const DCOPY_journal_entry_t* entry)
+{
+    return entry->num_chunks <= 64 ? &entry->done.word : entry->done.words;
+}
+
+/* Check whether the bitmap of an entry has a chunk. */
+static bool DCOPY_journal_has_chunk(const DCOPY_journal_entry_t* entry, \
+                                    int64_t chunk)
+{
+    const uint64_t* bits = DCOPY_journal_bits_const(entry);
+
+    return chunk >= 0 && chunk < entry->num_chunks && \
+           (bits[chunk / 64] >> (chunk % 64) & 1) != 0;
+}
+
+/* Double the size of the table, or create it. */
+static void DCOPY_journal_grow(void)
+{
+    DCOPY_journal_entry_t* old = DCOPY_journal_table;
+    size_t old_cap = DCOPY_journal_table_cap;
+    size_t i;
+
+    DCOPY_journal_table_cap = old_cap ? 2 * old_cap : 1024;
+    DCOPY_journal_table = (DCOPY_journal_entry_t*) calloc(DCOPY_journal_table_cap, \
+                          sizeof(DCOPY_journal_entry_t));
+
+    if(DCOPY_journal_table == NULL) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate memory for the journal.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < old_cap; i++) {
+        if(old[i].key != 0) {
+            *DCOPY_journal_slot(old[i].key, old[i].path, old[i].file_size) = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/*
+ * Start the entry of a file over for the chunk size a run cut it into. The
+ * bitmap of a large file is only allocated here.
+ */
+static void DCOPY_journal_reset(DCOPY_journal_entry_t* entry, \
+                                int64_t file_size, \
+                                int64_t chunk_size, \
+                                int64_t started)
+{
+    if(entry->num_chunks > 64) {
+        free(entry->done.words);
+    }
+
+    entry->chunk_size = chunk_size;
+    entry->started = started;
+    entry->num_chunks = file_size > 0 ? (file_size - 1) / chunk_size + 1 : 1;
+    entry->done.word = 0;
+
+    if(entry->num_chunks > 64) {
+        entry->done.words = (uint64_t*) calloc((size_t)(entry->num_chunks + 63) / 64, \
+                                               sizeof(uint64_t));
+
+        if(entry->done.words == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate memory for the journal.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Add a finished chunk to the entry of its file. A record of a file cut into
+ * chunks of another size wins if its run started later, since that run must
+ * have copied the file afresh.
+ */
+static void DCOPY_journal_add(const char* dest_path, \
+                              int64_t file_size, \
+                              int64_t chunk_size, \
+                              int64_t chunk, \
+                              int64_t started)
+{
+    uint64_t key = DCOPY_journal_hash(dest_path, file_size);
+
+    if(2 * (DCOPY_journal_table_len + 1) > DCOPY_journal_table_cap) {
+        DCOPY_journal_grow();
+    }
+
+    DCOPY_journal_entry_t* entry = DCOPY_journal_slot(key, dest_path, file_size);
+
+    if(entry->key == 0) {
+        entry->path = strdup(dest_path);
+
+        if(entry->path == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate memory for the journal.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        entry->key = key;
+        entry->file_size = file_size;
+        entry->num_chunks = 0;
+        DCOPY_journal_reset(entry, file_size, chunk_size, started);
+        DCOPY_journal_table_len++;
+    }
+    else if(entry->chunk_size != chunk_size) {
+        if(started <= entry->started) {
+            return;
+        }
+
+        DCOPY_journal_reset(entry, file_size, chunk_size, started);
+    }
+    else if(started < entry->started) {
+        entry->started = started;
+    }
+
+    if(chunk >= 0 && chunk < entry->num_chunks) {
+        DCOPY_journal_bits(entry)[chunk / 64] |= (uint64_t) 1 << (chunk % 64);
+    }
+}
+
+/* Read one shard of the journal. Returns false if it does not exist. */
+static bool DCOPY_journal_load_shard(int rank)
+{
+    char shard_path[PATH_MAX];
+    char path[PATH_MAX];
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int64_t started = 0;
+
+    DCOPY_shard_path(shard_path, sizeof(shard_path), DCOPY_user_opts.journal_path, rank);
+
+    FILE* shard = fopen(shard_path, "r");
+
+    if(shard == NULL) {
+        if(errno == ENOENT) {
+            return false;
+        }
+
+        LOG(DCOPY_LOG_ERR, "Could not open journal `%s'. errno=%d %s", \
+            shard_path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    while((len = getline(&line, &size, shard)) >= 0) {
+        int64_t file_size;
+        int64_t chunk_size;
+        int64_t chunk;
+        int n = 0;
+
+        if(len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if(sscanf(line, "# dcp journal 1 %" SCNd64, &started) == 1) {
+            continue;
+        }
+
+        /* a record cut off by a failure is just left out */
+        if(sscanf(line, "C %" SCNd64 " %" SCNd64 " %" SCNd64 "%n", \
+                  &file_size, &chunk_size, &chunk, &n) != 3 || line[n] != ' ' || \
+                chunk_size <= 0 || \
+                !DCOPY_shard_read_path(line + n + 1, path, sizeof(path))) {
+            continue;
+        }
+
+        DCOPY_journal_add(path, file_size, chunk_size, chunk, started);
+    }
+
+    free(line);
+    fclose(shard);
+
+    return true;
+}
+
+/* Read every shard of the journal, however many ranks wrote them. */
+static void DCOPY_journal_load(void)
+{
+    int rank = 0;
+
+    while(DCOPY_journal_load_shard(rank)) {
+        rank++;
+    }
+
+    if(CIRCLE_global_rank == 0) {
+        LOG(DCOPY_LOG_INFO, "Read `%d' shards of the journal `%s'.", \
+            rank, DCOPY_user_opts.journal_path);
+    }
+}
+
+/* Remove every shard of the journal, of however many ranks wrote them. */
+static void DCOPY_journal_remove(void)
+{
+    char shard_path[PATH_MAX];
+    int rank;
+
+    for(rank = 0; ; rank++) {
+        DCOPY_shard_path(shard_path, sizeof(shard_path), DCOPY_user_opts.journal_path, rank);
+
+        if(unlink(shard_path) < 0) {
+            break;
+        }
+    }
+}
+
+/*
+ * Read the journal of earlier runs if resuming, or else remove it, since a
+ * new copy makes it stale. Then start this rank's part of it. This must be
+ * called by all ranks.
+ */
+void DCOPY_journal_init(void)
+{
+    char shard_path[PATH_MAX];
+
+    if(DCOPY_user_opts.journal_path == NULL) {
+        return;
+    }
+
+    if(DCOPY_user_opts.resume) {
+        DCOPY_journal_load();
+    }
+    else if(CIRCLE_global_rank == 0) {
+        DCOPY_journal_remove();
+    }
+
+    /* nobody writes until everybody has read */
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    DCOPY_shard_path(shard_path, sizeof(shard_path), DCOPY_user_opts.journal_path, \
+                     CIRCLE_global_rank);
+
+    DCOPY_journal_shard = fopen(shard_path, "a");
+
+    if(DCOPY_journal_shard == NULL) {
+        LOG(DCOPY_LOG_ERR, "Could not open journal `%s'. errno=%d %s", \
+            shard_path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    fprintf(DCOPY_journal_shard, "# dcp journal 1 %" PRId64 "\n", (int64_t) time(NULL));
+    DCOPY_journal_sync();
+}
+
+/* Record that a chunk has been copied, and compared unless that is skipped. */
+void DCOPY_journal_chunk(const char* dest_path, \
+                         int64_t file_size, \
+                         int64_t chunk_size, \
+                         int64_t chunk)
+{
+    if(DCOPY_journal_shard == NULL) {
+        return;
+    }
+
+    if(DCOPY_journal_pending == NULL) {
+        DCOPY_journal_pending = open_memstream(&DCOPY_journal_pending_buf, \
+                                               &DCOPY_journal_pending_len);
+
+        if(DCOPY_journal_pending == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate memory for the journal.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(DCOPY_journal_pending, "C %" PRId64 " %" PRId64 " %" PRId64 " ", \
+            file_size, chunk_size, chunk);
+    DCOPY_shard_write_path(DCOPY_journal_pending, dest_path);
+
+    if(CIRCLE_wtime() - DCOPY_journal_synced >= DCOPY_JOURNAL_INTERVAL) {
+        DCOPY_journal_sync();
+    }
+}
+
+/*
+ * Look up the chunk size an earlier run cut a file into. Returns 0 if the
+ * journal has nothing for the file which can still be trusted.
+ */
+int64_t DCOPY_journal_lookup(const char* dest_path, \
+                             const struct stat64* statbuf)
+{
+    const DCOPY_journal_entry_t* entry = DCOPY_journal_find(dest_path, statbuf);
+
+    if(entry == NULL || (int64_t) statbuf->st_mtime >= entry->started) {
+        return 0;
+    }
+
+    return entry->chunk_size;
+}
+
+/* Check whether an earlier run finished a chunk of a file. */
+bool DCOPY_journal_done(const char* dest_path, \
+                        const struct stat64* statbuf, \
+                        int64_t chunk_size, \
+                        int64_t chunk)
+{
+    const DCOPY_journal_entry_t* entry = DCOPY_journal_find(dest_path, statbuf);
+
+    return entry != NULL && entry->chunk_size == chunk_size && \
+           (int64_t) statbuf->st_mtime < entry->started && \
+           DCOPY_journal_has_chunk(entry, chunk);
+}
+
+/* Check whether an earlier run finished every chunk of a file. */
+bool DCOPY_journal_file_done(const char* dest_path, \
+                             const struct stat64* statbuf)
+{
+    const DCOPY_journal_entry_t* entry = DCOPY_journal_find(dest_path, statbuf);
+    int64_t chunk;
+
+    if(entry == NULL || (int64_t) statbuf->st_mtime >= entry->started) {
+        return false;
+    }
+
+    for(chunk = 0; chunk < entry->num_chunks; chunk++) {
+        if(!DCOPY_journal_has_chunk(entry, chunk)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Check whether the walltime has passed, so no new work should be started. */
+bool DCOPY_journal_expired(void)
+{
+    if(DCOPY_user_opts.walltime <= 0 || DCOPY_journal_stopping) {
+        return DCOPY_journal_stopping;
+    }
+
+    if(CIRCLE_wtime() - DCOPY_statistics.wtime_started >= (double) DCOPY_user_opts.walltime) {
+        LOG(DCOPY_LOG_DBG, "Reached the walltime, leaving the rest of the work.");
+        DCOPY_journal_stopping = true;
+        DCOPY_journal_sync();
+    }
+
+    return DCOPY_journal_stopping;
+}
+
+/*
+ * Write what was copied to the destination to disk. The destination may not
+ * exist yet, in which case the directory it goes into is on the same
+ * filesystem.
+ */
+static void DCOPY_journal_sync_dest(void)
+{
+#ifdef HAVE_SYNCFS
+    char dir_path[PATH_MAX];
+    int fd = open(DCOPY_user_opts.dest_path, O_RDONLY | O_NONBLOCK);
+
+    if(fd < 0) {
+        snprintf(dir_path, sizeof(dir_path), "%s", DCOPY_user_opts.dest_path);
+        fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    }
+
+    if(fd >= 0) {
+        int rc = syncfs(fd);
+
+        close(fd);
+
+        if(rc == 0) {
+            return;
+        }
+    }
+
+#endif
+
+    sync();
+}
+
+/*
+ * Write the destination and then the records of the chunks copied to it
+ * since the last time to disk.
+ */
+void DCOPY_journal_sync(void)
+{
+    if(DCOPY_journal_shard == NULL) {
+        return;
+    }
+
+    if(DCOPY_journal_pending != NULL) {
+        /* closing the stream leaves the records in the buffer */
+        fclose(DCOPY_journal_pending);
+        DCOPY_journal_pending = NULL;
+
+        if(DCOPY_journal_pending_len > 0) {
+            DCOPY_journal_sync_dest();
+            fwrite(DCOPY_journal_pending_buf, 1, DCOPY_journal_pending_len, \
+                   DCOPY_journal_shard);
+        }
+
+        free(DCOPY_journal_pending_buf);
+        DCOPY_journal_pending_buf = NULL;
+        DCOPY_journal_pending_len = 0;
+    }
+
+    if(fflush(DCOPY_journal_shard) != 0 || fsync(fileno(DCOPY_journal_shard)) < 0) {
+        LOG(DCOPY_LOG_WARN, "Could not write the journal. errno=%d %s", \
+            errno, strerror(errno));
+    }
+
+    DCOPY_journal_synced = CIRCLE_wtime();
+}
+
+/*
+ * Close the shard of this rank. If the copy is finished, rank 0 removes the
+ * whole journal, otherwise it is kept for a resume. This must be called by
+ * all ranks.
+ */
+void DCOPY_journal_finalize(bool finished)
+{
+    size_t i;
+
+    if(DCOPY_journal_shard == NULL) {
+        return;
+    }
+
+    DCOPY_journal_sync();
+    fclose(DCOPY_journal_shard);
+    DCOPY_journal_shard = NULL;
+
+    for(i = 0; i < DCOPY_journal_table_cap; i++) {
+        if(DCOPY_journal_table[i].key == 0) {
+            continue;
+        }
+
+        free(DCOPY_journal_table[i].path);
+
+        if(DCOPY_journal_table[i].num_chunks > 64) {
+            free(DCOPY_journal_table[i].done.words);
+        }
+    }
+
+    free(DCOPY_journal_table);
+    DCOPY_journal_table = NULL;
+    DCOPY_journal_table_cap = 0;
+    DCOPY_journal_table_len = 0;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if(CIRCLE_global_rank != 0) {
+        return;
+    }
+
+    if(finished) {
+        DCOPY_journal_remove();
+    }
+    else {
+        LOG(DCOPY_LOG_INFO, "Kept the journal `%s' to resume from.", \
+            DCOPY_user_opts.journal_path);
+    }
+}
+
+/* EOF */
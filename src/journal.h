@@ -0,0 +1,32 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_JOURNAL_H
+#define __DCP_JOURNAL_H
+
+#include "common.h"
+
+void DCOPY_journal_init(void);
+
+void DCOPY_journal_chunk(const char* dest_path, \
+                         int64_t file_size, \
+                         int64_t chunk_size, \
+                         int64_t chunk);
+
+int64_t DCOPY_journal_lookup(const char* dest_path, \
+                             const struct stat64* statbuf);
+
+bool DCOPY_journal_done(const char* dest_path, \
+                        const struct stat64* statbuf, \
+                        int64_t chunk_size, \
+                        int64_t chunk);
+
+bool DCOPY_journal_file_done(const char* dest_path, \
+                             const struct stat64* statbuf);
+
+bool DCOPY_journal_expired(void);
+
+void DCOPY_journal_sync(void);
+
+void DCOPY_journal_finalize(bool finished);
+
+#endif /* __DCP_JOURNAL_H */
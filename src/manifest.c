@@ -0,0 +1,321 @@
+/*
+ * This file contains the manifest of a copy, and the mode which verifies a
+ * tree against one later on without the original source.
+ *
+ * A manifest is a text file with one record per line. Paths are relative to
+ * the destination given on the command line ("." for a file-to-file copy)
+ * and come last, with backslashes and newlines escaped.
+ *
+ *     F <size> <mtime seconds> <path>
+ *     F <size> - <path>
+ *     C <offset> <length> <crc32c> <path>
+ *
+ * The treewalk stage writes an F record for each regular file from the stat
+ * of its source. The modification time is only recorded with -p, since
+ * otherwise the copy does not keep it, and in whole seconds, which is all
+ * the copy keeps. The compare stage writes a C record for each chunk with the
+ * CRC32C of what it read back from the destination, and the treewalk stage
+ * writes C records for chunks it skipped as holes. Each rank writes its
+ * records to a shard next to the manifest (shard.c), and rank 0 merges the
+ * shards when the copy is done.
+ *
+ * To verify, rank 0 reads the manifest and enqueues one VERIFY operation for
+ * each record, which carries the record itself as its operand, so the work is
+ * spread across ranks like the compare stage.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "manifest.h"
+#include "digest.h"
+#include "shard.h"
+#include "throttle.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/* The shard of the manifest this rank writes to. */
+static FILE* DCOPY_manifest_shard = NULL;
+
+/* The first line of every manifest. */
+static const char* DCOPY_manifest_header = "# dcp manifest 1\n";
+
+/* Open the shard of this rank, if a manifest was asked for. */
+void DCOPY_manifest_init(void)
+{
+    if(DCOPY_user_opts.manifest_path == NULL) {
+        return;
+    }
+
+    DCOPY_manifest_shard = DCOPY_shard_open(DCOPY_user_opts.manifest_path);
+}
+
+/* Record the size and modification time of a regular file. */
+void DCOPY_manifest_file(const char* dest_path, \
+                         const struct stat64* statbuf)
+{
+    if(DCOPY_manifest_shard == NULL) {
+        return;
+    }
+
+    if(DCOPY_user_opts.preserve) {
+        fprintf(DCOPY_manifest_shard, "F %" PRId64 " %" PRId64 " ", \
+                (int64_t) statbuf->st_size, (int64_t) statbuf->st_mtime);
+    }
+    else {
+        fprintf(DCOPY_manifest_shard, "F %" PRId64 " - ", \
+                (int64_t) statbuf->st_size);
+    }
+
+    DCOPY_shard_write_path(DCOPY_manifest_shard, dest_path);
+}
+
+/* Record the CRC32C of [offset, offset + len) of a file. */
+void DCOPY_manifest_chunk(const char* dest_path, \
+                          off64_t offset, \
+                          off64_t len, \
+                          uint32_t crc)
+{
+    if(DCOPY_manifest_shard == NULL) {
+        return;
+    }
+
+    fprintf(DCOPY_manifest_shard, "C %" PRId64 " %" PRId64 " %08" PRIx32 " ", \
+            (int64_t) offset, (int64_t) len, crc);
+    DCOPY_shard_write_path(DCOPY_manifest_shard, dest_path);
+}
+
+/* Check whether the compare stage has to produce chunk records. */
+bool DCOPY_manifest_enabled(void)
+{
+    return DCOPY_manifest_shard != NULL;
+}
+
+/*
+ * Close the shards and have rank 0 merge them into the manifest. This must be
+ * called by all ranks.
+ */
+void DCOPY_manifest_finalize(void)
+{
+    if(DCOPY_user_opts.manifest_path == NULL) {
+        return;
+    }
+
+    DCOPY_shard_merge(&DCOPY_manifest_shard, DCOPY_user_opts.manifest_path, \
+                      DCOPY_manifest_header);
+
+    if(CIRCLE_global_rank == 0) {
+        LOG(DCOPY_LOG_INFO, "Wrote manifest `%s'.", DCOPY_user_opts.manifest_path);
+    }
+}
+
+/*
+ * Read the manifest to verify against and enqueue each of its records. Only
+ * rank 0 is called here, from the libcircle create callback.
+ */
+void DCOPY_manifest_enqueue(CIRCLE_handle* handle)
+{
+    FILE* manifest = fopen(DCOPY_user_opts.verify_path, "r");
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    if(manifest == NULL) {
+        LOG(DCOPY_LOG_ERR, "Could not open manifest `%s'. errno=%d %s", \
+            DCOPY_user_opts.verify_path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    while((len = getline(&line, &size, manifest)) >= 0) {
+        if(len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if(len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        /* the whole record is the operand, with nothing appended to it */
+        char* newop = DCOPY_encode_operation(VERIFY, 0, line, (uint16_t) len, \
+                                             NULL, 0, 0, NULL, 0, 0, NULL);
+        handle->enqueue(newop);
+        free(newop);
+    }
+
+    free(line);
+    fclose(manifest);
+}
+
+/*
+ * Check a file record: the file must exist with the recorded size. The
+ * modification time is only compared when the record has one.
+ */
+static bool DCOPY_verify_file(const char* path, \
+                              int64_t size, \
+                              bool has_mtime, \
+                              int64_t mtime)
+{
+    struct stat64 statbuf;
+
+    if(lstat64(path, &statbuf) < 0) {
+        LOG(DCOPY_LOG_ERR, "Verify failed: `%s' is missing. errno=%d %s", \
+            path, errno, strerror(errno));
+        return false;
+    }
+
+    if(!S_ISREG(statbuf.st_mode)) {
+        LOG(DCOPY_LOG_ERR, "Verify failed: `%s' is not a regular file.", path);
+        return false;
+    }
+
+    if((int64_t) statbuf.st_size != size) {
+        LOG(DCOPY_LOG_ERR, "Verify failed: `%s' has `%" PRId64 "' bytes " \
+            "instead of `%" PRId64 "'.", path, (int64_t) statbuf.st_size, size);
+        return false;
+    }
+
+    /* times may be changed without touching the data, so this is not a failure */
+    if(has_mtime && (int64_t) statbuf.st_mtime != mtime) {
+        LOG(DCOPY_LOG_DBG, "Modification time of `%s' differs from the manifest.", path);
+        DCOPY_statistics.verify_mtime_changes++;
+    }
+
+    DCOPY_statistics.total_files_verified++;
+
+    return true;
+}
+
+/*
+ * Check a chunk record: the CRC32C of [offset, offset + len) must match,
+ * with holes read as zeros.
+ */
+static bool DCOPY_verify_chunk(const char* path, \
+                               off64_t offset, \
+                               off64_t len, \
+                               uint32_t crc)
+{
+    off64_t end = offset + len;
+    off64_t pos = offset;
+    uint32_t actual = 0;
+    void* buf = NULL;
+    bool ok = true;
+
+    int fd = open64(path, O_RDONLY | O_NOATIME);
+
+    if(fd < 0) {
+        LOG(DCOPY_LOG_ERR, "Verify failed: could not open `%s'. errno=%d %s", \
+            path, errno, strerror(errno));
+        return false;
+    }
+
+    while(pos < end && ok) {
+        off64_t data_end;
+        off64_t data = DCOPY_seek_data(fd, pos, end, &data_end);
+
+        actual = DCOPY_crc32c_zeros(actual, data - pos);
+        pos = data;
+
+        if(buf == NULL && pos < end) {
+            buf = DCOPY_buffer_get();
+        }
+
+        while(pos < data_end) {
+            size_t n = FD_BLOCK_SIZE;
+
+            if((off64_t) n > data_end - pos) {
+                n = (size_t)(data_end - pos);
+            }
+
+            DCOPY_throttle(n);
+
+            ssize_t num_of_bytes_read = DCOPY_read_fully(fd, buf, n, pos);
+
+            if(num_of_bytes_read < (ssize_t) n) {
+                LOG(DCOPY_LOG_ERR, "Verify failed: could not read `%s' at " \
+                    "offset `%" PRId64 "'. errno=%d %s", path, (int64_t) pos, \
+                    errno, num_of_bytes_read < 0 ? strerror(errno) : "short read");
+                ok = false;
+                break;
+            }
+
+            actual = DCOPY_crc32c(actual, buf, n);
+            pos += (off64_t) n;
+        }
+    }
+
+    DCOPY_drop_behind(fd, -1, offset, pos);
+
+    if(buf != NULL) {
+        DCOPY_buffer_put(buf);
+    }
+
+    close(fd);
+
+    if(ok && actual != crc) {
+        LOG(DCOPY_LOG_ERR, "Verify failed: `%s' does not match the manifest " \
+            "at offset `%" PRId64 "'.", path, (int64_t) offset);
+        ok = false;
+    }
+
+    if(ok) {
+        DCOPY_statistics.total_bytes_verified += len;
+    }
+
+    return ok;
+}
+
+/* The entrance point to the verify operation. */
+void DCOPY_do_verify(DCOPY_operation_t* op, \
+                     CIRCLE_handle* handle)
+{
+    char path[PATH_MAX];
+    const char* record = op->operand;
+    int64_t a;
+    int64_t b;
+    uint32_t crc;
+    int n = 0;
+    bool ok;
+
+    /* a record never leads to more work */
+    (void) handle;
+
+    if(sscanf(record, "F %" SCNd64 " -%n", &a, &n) == 1 && n > 0 && \
+            record[n] == ' ') {
+        ok = DCOPY_shard_read_path(record + n + 1, path, sizeof(path)) && \
+             DCOPY_verify_file(path, a, false, 0);
+    }
+    else if(sscanf(record, "F %" SCNd64 " %" SCNd64 "%n", &a, &b, &n) == 2 && \
+            record[n] == ' ') {
+        ok = DCOPY_shard_read_path(record + n + 1, path, sizeof(path)) && \
+             DCOPY_verify_file(path, a, true, b);
+    }
+    else if(sscanf(record, "C %" SCNd64 " %" SCNd64 " %" SCNx32 "%n", &a, &b, &crc, &n) == 3 && \
+            record[n] == ' ') {
+        ok = DCOPY_shard_read_path(record + n + 1, path, sizeof(path)) && \
+             DCOPY_verify_chunk(path, (off64_t) a, (off64_t) b, crc);
+    }
+    else {
+        LOG(DCOPY_LOG_ERR, "Could not parse manifest record `%s'.", record);
+        ok = false;
+    }
+
+    if(!ok) {
+        DCOPY_statistics.verify_failures++;
+    }
+}
+
+/* EOF */
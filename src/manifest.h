@@ -0,0 +1,27 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_MANIFEST_H
+#define __DCP_MANIFEST_H
+
+#include "common.h"
+
+void DCOPY_manifest_init(void);
+
+void DCOPY_manifest_file(const char* dest_path, \
+                         const struct stat64* statbuf);
+
+void DCOPY_manifest_chunk(const char* dest_path, \
+                          off64_t offset, \
+                          off64_t len, \
+                          uint32_t crc);
+
+bool DCOPY_manifest_enabled(void);
+
+void DCOPY_manifest_finalize(void);
+
+void DCOPY_manifest_enqueue(CIRCLE_handle* handle);
+
+void DCOPY_do_verify(DCOPY_operation_t* op, \
+                     CIRCLE_handle* handle);
+
+#endif /* __DCP_MANIFEST_H */
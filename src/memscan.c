@@ -0,0 +1,263 @@
+/*
+ * This file contains the kernels the compare stages use to check buffers:
+ * whether two buffers hold the same bytes, and whether a buffer is all zeros.
+ * Unlike memcmp(), they don't have to find out which buffer is greater, so
+ * they can test whole vectors at once and only stop at the end of the
+ * vector with the first difference.
+ *
+ * The AVX2 or SSE2 versions are picked at run time, depending on the CPU.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "memscan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DCOPY_MEMSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static bool (*DCOPY_mem_equal_impl)(const void* a, \
+                                    const void* b, \
+                                    size_t len) = NULL;
+
+static bool (*DCOPY_mem_zero_impl)(const void* buf, \
+                                   size_t len) = NULL;
+
+/* Compare whatever is too short for a vector, one word at a time. */
+static bool DCOPY_mem_equal_tail(const unsigned char* a, \
+                                 const unsigned char* b, \
+                                 size_t len)
+{
+    while(len >= sizeof(uint64_t)) {
+        uint64_t x;
+        uint64_t y;
+
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+
+        if(x != y) {
+            return false;
+        }
+
+        a += sizeof(uint64_t);
+        b += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    while(len > 0) {
+        if(*a++ != *b++) {
+            return false;
+        }
+
+        len--;
+    }
+
+    return true;
+}
+
+/* Check whatever is too short for a vector, one word at a time. */
+static bool DCOPY_mem_zero_tail(const unsigned char* buf, \
+                                size_t len)
+{
+    while(len >= sizeof(uint64_t)) {
+        uint64_t x;
+
+        memcpy(&x, buf, sizeof(x));
+
+        if(x != 0) {
+            return false;
+        }
+
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    while(len > 0) {
+        if(*buf++ != 0) {
+            return false;
+        }
+
+        len--;
+    }
+
+    return true;
+}
+
+#ifdef DCOPY_MEMSCAN_X86
+
+/* Test 128 bytes per iteration with four pairs of 32-byte loads. */
+__attribute__((target("avx2")))
+static bool DCOPY_mem_equal_avx2(const void* a, \
+                                 const void* b, \
+                                 size_t len)
+{
+    const unsigned char* x = (const unsigned char*) a;
+    const unsigned char* y = (const unsigned char*) b;
+
+    while(len >= 128) {
+        __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) x), \
+                                      _mm256_loadu_si256((const __m256i*) y));
+        __m256i d1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + 32)), \
+                                      _mm256_loadu_si256((const __m256i*)(y + 32)));
+        __m256i d2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + 64)), \
+                                      _mm256_loadu_si256((const __m256i*)(y + 64)));
+        __m256i d3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(x + 96)), \
+                                      _mm256_loadu_si256((const __m256i*)(y + 96)));
+        __m256i d = _mm256_or_si256(_mm256_or_si256(d0, d1), _mm256_or_si256(d2, d3));
+
+        if(!_mm256_testz_si256(d, d)) {
+            return false;
+        }
+
+        x += 128;
+        y += 128;
+        len -= 128;
+    }
+
+    return DCOPY_mem_equal_tail(x, y, len);
+}
+
+__attribute__((target("avx2")))
+static bool DCOPY_mem_zero_avx2(const void* buf, \
+                                size_t len)
+{
+    const unsigned char* x = (const unsigned char*) buf;
+
+    while(len >= 128) {
+        __m256i d = _mm256_or_si256( \
+                        _mm256_or_si256(_mm256_loadu_si256((const __m256i*) x), \
+                                        _mm256_loadu_si256((const __m256i*)(x + 32))), \
+                        _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(x + 64)), \
+                                        _mm256_loadu_si256((const __m256i*)(x + 96))));
+
+        if(!_mm256_testz_si256(d, d)) {
+            return false;
+        }
+
+        x += 128;
+        len -= 128;
+    }
+
+    return DCOPY_mem_zero_tail(x, len);
+}
+
+/* Test 64 bytes per iteration with four pairs of 16-byte loads. */
+static bool DCOPY_mem_equal_sse2(const void* a, \
+                                 const void* b, \
+                                 size_t len)
+{
+    const unsigned char* x = (const unsigned char*) a;
+    const unsigned char* y = (const unsigned char*) b;
+
+    while(len >= 64) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) x), \
+                                    _mm_loadu_si128((const __m128i*) y));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(x + 16)), \
+                                    _mm_loadu_si128((const __m128i*)(y + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(x + 32)), \
+                                    _mm_loadu_si128((const __m128i*)(y + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(x + 48)), \
+                                    _mm_loadu_si128((const __m128i*)(y + 48)));
+        __m128i e = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+
+        if(_mm_movemask_epi8(e) != 0xffff) {
+            return false;
+        }
+
+        x += 64;
+        y += 64;
+        len -= 64;
+    }
+
+    return DCOPY_mem_equal_tail(x, y, len);
+}
+
+static bool DCOPY_mem_zero_sse2(const void* buf, \
+                                size_t len)
+{
+    const unsigned char* x = (const unsigned char*) buf;
+
+    while(len >= 64) {
+        __m128i d = _mm_or_si128( \
+                        _mm_or_si128(_mm_loadu_si128((const __m128i*) x), \
+                                     _mm_loadu_si128((const __m128i*)(x + 16))), \
+                        _mm_or_si128(_mm_loadu_si128((const __m128i*)(x + 32)), \
+                                     _mm_loadu_si128((const __m128i*)(x + 48))));
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())) != 0xffff) {
+            return false;
+        }
+
+        x += 64;
+        len -= 64;
+    }
+
+    return DCOPY_mem_zero_tail(x, len);
+}
+
+#else /* !DCOPY_MEMSCAN_X86 */
+
+static bool DCOPY_mem_equal_generic(const void* a, \
+                                    const void* b, \
+                                    size_t len)
+{
+    return memcmp(a, b, len) == 0;
+}
+
+static bool DCOPY_mem_zero_generic(const void* buf, \
+                                   size_t len)
+{
+    return DCOPY_mem_zero_tail((const unsigned char*) buf, len);
+}
+
+#endif /* DCOPY_MEMSCAN_X86 */
+
+/* Pick the kernels for this CPU. */
+static void DCOPY_memscan_init(void)
+{
+#ifdef DCOPY_MEMSCAN_X86
+
+    if(__builtin_cpu_supports("avx2")) {
+        DCOPY_mem_equal_impl = DCOPY_mem_equal_avx2;
+        DCOPY_mem_zero_impl = DCOPY_mem_zero_avx2;
+    }
+    else {
+        /* every x86_64 CPU has SSE2 */
+        DCOPY_mem_equal_impl = DCOPY_mem_equal_sse2;
+        DCOPY_mem_zero_impl = DCOPY_mem_zero_sse2;
+    }
+
+#else
+    DCOPY_mem_equal_impl = DCOPY_mem_equal_generic;
+    DCOPY_mem_zero_impl = DCOPY_mem_zero_generic;
+#endif
+}
+
+/* Check whether the first len bytes of a and b are the same. */
+bool DCOPY_mem_equal(const void* a, \
+                     const void* b, \
+                     size_t len)
+{
+    if(DCOPY_mem_equal_impl == NULL) {
+        DCOPY_memscan_init();
+    }
+
+    return DCOPY_mem_equal_impl(a, b, len);
+}
+
+/* Check whether the first len bytes of buf are all zeros. */
+bool DCOPY_mem_zero(const void* buf, \
+                    size_t len)
+{
+    if(DCOPY_mem_zero_impl == NULL) {
+        DCOPY_memscan_init();
+    }
+
+    return DCOPY_mem_zero_impl(buf, len);
+}
+
+/* EOF */
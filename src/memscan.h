@@ -0,0 +1,15 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_MEMSCAN_H
+#define __DCP_MEMSCAN_H
+
+#include "common.h"
+
+bool DCOPY_mem_equal(const void* a, \
+                     const void* b, \
+                     size_t len);
+
+bool DCOPY_mem_zero(const void* buf, \
+                    size_t len);
+
+#endif /* __DCP_MEMSCAN_H */
@@ -0,0 +1,211 @@
+/*
+ * This file contains the plumbing shared by the text files dcp writes while
+ * it works, such as the manifest and the list of differences. Each rank
+ * appends its records to a shard of its own next to the file, named
+ * "<file>.<rank>", so no locking is needed, and rank 0 concatenates the
+ * shards in rank order once libcircle is done.
+ *
+ * Records end with a path relative to the destination given on the command
+ * line ("." for the destination itself), with backslashes and newlines
+ * escaped so every record is one line.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "shard.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/* Build the name of the shard of a rank. */
+void DCOPY_shard_path(char* shard_path, \
+                      size_t size, \
+                      const char* path, \
+                      int rank)
+{
+    int written = snprintf(shard_path, size, "%s.%d", path, rank);
+
+    if(written >= (int) size) {
+        LOG(DCOPY_LOG_ERR, "Path `%s' is too long.", path);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+}
+
+/* Open the shard of this rank for the file at path. */
+FILE* DCOPY_shard_open(const char* path)
+{
+    char shard_path[PATH_MAX];
+
+    DCOPY_shard_path(shard_path, sizeof(shard_path), path, CIRCLE_global_rank);
+
+    FILE* shard = fopen(shard_path, "w");
+
+    if(shard == NULL) {
+        LOG(DCOPY_LOG_ERR, "Could not create shard `%s'. errno=%d %s", \
+            shard_path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    return shard;
+}
+
+/* Write the path of a record, relative to the destination and escaped. */
+void DCOPY_shard_write_path(FILE* shard, \
+                            const char* dest_path)
+{
+    size_t root_len = strlen(DCOPY_user_opts.dest_path);
+    const char* c;
+
+    if(strncmp(dest_path, DCOPY_user_opts.dest_path, root_len) == 0 && \
+            dest_path[root_len] == '/') {
+        dest_path += root_len + 1;
+    }
+    else if(strcmp(dest_path, DCOPY_user_opts.dest_path) == 0) {
+        dest_path = ".";
+    }
+
+    for(c = dest_path; *c != '\0'; c++) {
+        if(*c == '\\') {
+            fputs("\\\\", shard);
+        }
+        else if(*c == '\n') {
+            fputs("\\n", shard);
+        }
+        else {
+            fputc(*c, shard);
+        }
+    }
+
+    fputc('\n', shard);
+}
+
+/*
+ * Turn the path of a record back into a path inside the destination.
+ * Returns false if the path does not fit.
+ */
+bool DCOPY_shard_read_path(const char* escaped, \
+                           char* path, \
+                           size_t size)
+{
+    size_t i = 0;
+    int written;
+
+    if(strcmp(escaped, ".") == 0) {
+        written = snprintf(path, size, "%s", DCOPY_user_opts.dest_path);
+    }
+    else {
+        written = snprintf(path, size, "%s/", DCOPY_user_opts.dest_path);
+    }
+
+    if(written >= (int) size) {
+        return false;
+    }
+
+    if(strcmp(escaped, ".") == 0) {
+        return true;
+    }
+
+    i = (size_t) written;
+
+    for(; *escaped != '\0'; escaped++) {
+        char c = *escaped;
+
+        if(c == '\\' && escaped[1] != '\0') {
+            escaped++;
+            c = (*escaped == 'n') ? '\n' : *escaped;
+        }
+
+        if(i + 1 >= size) {
+            return false;
+        }
+
+        path[i++] = c;
+    }
+
+    path[i] = '\0';
+
+    return true;
+}
+
+/* Append the shard of a rank to the file and remove it. */
+static void DCOPY_shard_append(FILE* out, \
+                               const char* path, \
+                               int rank)
+{
+    char shard_path[PATH_MAX];
+    char* buf = (char*) DCOPY_buffer_get();
+    size_t n;
+
+    DCOPY_shard_path(shard_path, sizeof(shard_path), path, rank);
+
+    FILE* shard = fopen(shard_path, "r");
+
+    if(shard == NULL) {
+        LOG(DCOPY_LOG_ERR, "Could not open shard `%s'. errno=%d %s", \
+            shard_path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    while((n = fread(buf, 1, FD_BLOCK_SIZE, shard)) > 0) {
+        if(fwrite(buf, 1, n, out) != n) {
+            LOG(DCOPY_LOG_ERR, "Write error on `%s'. errno=%d %s", \
+                path, errno, strerror(errno));
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+
+    fclose(shard);
+    unlink(shard_path);
+    DCOPY_buffer_put(buf);
+}
+
+/*
+ * Close the shard of this rank and have rank 0 merge all of them into the
+ * file at path, after the header line. This must be called by all ranks.
+ */
+void DCOPY_shard_merge(FILE** shard, \
+                       const char* path, \
+                       const char* header)
+{
+    if(fclose(*shard) != 0) {
+        LOG(DCOPY_LOG_ERR, "Write error on the shard of `%s'. errno=%d %s", \
+            path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    *shard = NULL;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if(CIRCLE_global_rank == 0) {
+        FILE* out = fopen(path, "w");
+        int rank;
+
+        if(out == NULL) {
+            LOG(DCOPY_LOG_ERR, "Could not create `%s'. errno=%d %s", \
+                path, errno, strerror(errno));
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        fputs(header, out);
+
+        for(rank = 0; rank < DCOPY_global_size; rank++) {
+            DCOPY_shard_append(out, path, rank);
+        }
+
+        if(fclose(out) != 0) {
+            LOG(DCOPY_LOG_ERR, "Write error on `%s'. errno=%d %s", \
+                path, errno, strerror(errno));
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+}
+
+/* EOF */
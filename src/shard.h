@@ -0,0 +1,26 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_SHARD_H
+#define __DCP_SHARD_H
+
+#include "common.h"
+
+void DCOPY_shard_path(char* shard_path, \
+                      size_t size, \
+                      const char* path, \
+                      int rank);
+
+FILE* DCOPY_shard_open(const char* path);
+
+void DCOPY_shard_write_path(FILE* shard, \
+                            const char* dest_path);
+
+bool DCOPY_shard_read_path(const char* escaped, \
+                           char* path, \
+                           size_t size);
+
+void DCOPY_shard_merge(FILE** shard, \
+                       const char* path, \
+                       const char* header);
+
+#endif /* __DCP_SHARD_H */
@@ -0,0 +1,401 @@
+/*
+ * This file contains the stat store, which keeps what the metadata pass at
+ * the end of the copy needs to know about each object: its destination path,
+ * mode, owner, group, access and modification times, and depth.
+ *
+ * Records are packed one after another into segments of DCOPY_STAT_SEGMENT
+ * bytes. Each path is stored as the length of the prefix it shares with the
+ * path of the record before it in the same segment, followed by the rest, so
+ * the objects of a directory mostly cost their names. A segment never refers
+ * to another one, which lets it be read back on its own:
+ *
+ *     int64_t atime, int64_t mtime, uint32_t atime_nsec, uint32_t mtime_nsec,
+ *     uint32_t mode, uint32_t uid, uint32_t gid, uint16_t depth,
+ *     uint16_t prefix_len, uint16_t suffix_len, suffix
+ *
+ * Once the segments of a rank take up more than the --metadata-memory limit,
+ * the oldest full one is written to a spill file in the --spill-dir directory
+ * and its memory is reused. The spill file is unlinked as soon as it is
+ * created, so nothing is left behind if the job dies. Records are only read
+ * in the order they were added, so spilled segments are read back one at a
+ * time into a single buffer.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "statstore.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/* The fixed part of a record, which the rest of its path follows. */
+#define DCOPY_STAT_HEADER (2 * 8 + 5 * 4 + 3 * 2)
+
+typedef struct {
+    char* data;             /* NULL once the segment is spilled */
+    off_t offset;           /* where it is in the spill file, if it is */
+    size_t len;
+} DCOPY_stat_segment_t;
+
+static DCOPY_stat_segment_t* DCOPY_stat_segments = NULL;
+static size_t DCOPY_stat_num_segments = 0;
+static size_t DCOPY_stat_cap_segments = 0;
+
+/* Segments before this one are spilled. */
+static size_t DCOPY_stat_first_resident = 0;
+
+/* The path of the last record added, which the next one is compared with. */
+static char DCOPY_stat_last_path[PATH_MAX];
+static size_t DCOPY_stat_last_len = 0;
+
+static int DCOPY_stat_spill_fd = -1;
+static off_t DCOPY_stat_spill_end = 0;
+
+/* Where DCOPY_stat_store_next is, and the path of the last record it read. */
+static size_t DCOPY_stat_cursor_segment = 0;
+static size_t DCOPY_stat_cursor_pos = 0;
+static const char* DCOPY_stat_cursor_data = NULL;
+static char* DCOPY_stat_read_buf = NULL;
+static char DCOPY_stat_cursor_path[PATH_MAX];
+
+/* Set up the stat store of this rank. */
+void DCOPY_stat_store_init(void)
+{
+    DCOPY_stat_last_len = 0;
+    DCOPY_stat_first_resident = 0;
+    DCOPY_stat_store_rewind();
+}
+
+/* Open the spill file of this rank, and unlink it right away. */
+static void DCOPY_stat_store_open_spill(void)
+{
+    char path[PATH_MAX];
+    const char* dir = DCOPY_user_opts.spill_dir;
+
+    if(dir == NULL) {
+        dir = getenv("TMPDIR");
+    }
+
+    if(dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+
+    snprintf(path, sizeof(path), "%s/dcp.stat.%d.%d", dir, (int) getpid(), CIRCLE_global_rank);
+
+    DCOPY_stat_spill_fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if(DCOPY_stat_spill_fd < 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to create spill file `%s'. errno=%d %s", \
+            path, errno, strerror(errno));
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    unlink(path);
+    DCOPY_stat_spill_end = 0;
+}
+
+/* Write the full segment seg to the spill file. */
+static void DCOPY_stat_store_spill(DCOPY_stat_segment_t* seg)
+{
+    size_t done = 0;
+
+    if(DCOPY_stat_spill_fd < 0) {
+        DCOPY_stat_store_open_spill();
+    }
+
+    while(done < seg->len) {
+        ssize_t n = pwrite(DCOPY_stat_spill_fd, seg->data + done, seg->len - done, \
+                           DCOPY_stat_spill_end + (off_t) done);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) {
+            LOG(DCOPY_LOG_ERR, "Failed to spill metadata records to disk. errno=%d %s", \
+                errno, strerror(errno));
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        done += (size_t) n;
+    }
+
+    seg->offset = DCOPY_stat_spill_end;
+    DCOPY_stat_spill_end += (off_t) seg->len;
+    DCOPY_statistics.stat_bytes_spilled += (int64_t) seg->len;
+}
+
+/*
+ * Start a new segment. If the ones in memory would go over the limit, the
+ * oldest is spilled first and its memory reused.
+ */
+static DCOPY_stat_segment_t* DCOPY_stat_store_grow(void)
+{
+    size_t resident = DCOPY_stat_num_segments - DCOPY_stat_first_resident;
+    char* data = NULL;
+
+    if(DCOPY_user_opts.stat_memory > 0 && resident > 0 && \
+            (int64_t)((resident + 1) * DCOPY_STAT_SEGMENT) > DCOPY_user_opts.stat_memory) {
+        DCOPY_stat_segment_t* cold = &DCOPY_stat_segments[DCOPY_stat_first_resident++];
+
+        DCOPY_stat_store_spill(cold);
+        data = cold->data;
+        cold->data = NULL;
+    }
+
+    if(DCOPY_stat_num_segments == DCOPY_stat_cap_segments) {
+        size_t cap = DCOPY_stat_cap_segments > 0 ? DCOPY_stat_cap_segments * 2 : 16;
+        DCOPY_stat_segment_t* segments = (DCOPY_stat_segment_t*) realloc(DCOPY_stat_segments, \
+                                         cap * sizeof(DCOPY_stat_segment_t));
+
+        if(segments == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the stat store.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        DCOPY_stat_segments = segments;
+        DCOPY_stat_cap_segments = cap;
+    }
+
+    if(data == NULL) {
+        data = (char*) malloc(DCOPY_STAT_SEGMENT);
+
+        if(data == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the stat store.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+
+    DCOPY_stat_segment_t* seg = &DCOPY_stat_segments[DCOPY_stat_num_segments++];
+
+    seg->data = data;
+    seg->offset = 0;
+    seg->len = 0;
+
+    return seg;
+}
+
+/* Copy len bytes of val to ptr, and return the end of them. */
+static char* DCOPY_stat_put(char* ptr, \
+                            const void* val, \
+                            size_t len)
+{
+    memcpy(ptr, val, len);
+    return ptr + len;
+}
+
+/* Copy len bytes at ptr to val, and return the end of them. */
+static const char* DCOPY_stat_get(const char* ptr, \
+                                  void* val, \
+                                  size_t len)
+{
+    memcpy(val, ptr, len);
+    return ptr + len;
+}
+
+/* Add a record of the object at dest_path, with the stat info of its source. */
+void DCOPY_stat_store_add(const char* dest_path, \
+                          const struct stat64* statbuf, \
+                          int depth)
+{
+    size_t len = strlen(dest_path);
+    size_t prefix = 0;
+    DCOPY_stat_segment_t* seg = NULL;
+
+    if(len >= PATH_MAX) {
+        LOG(DCOPY_LOG_ERR, "Path too long to record `%s'.", dest_path);
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    if(DCOPY_stat_num_segments > 0) {
+        seg = &DCOPY_stat_segments[DCOPY_stat_num_segments - 1];
+
+        while(prefix < len && prefix < DCOPY_stat_last_len && \
+                dest_path[prefix] == DCOPY_stat_last_path[prefix]) {
+            prefix++;
+        }
+    }
+
+    if(seg == NULL || seg->len + DCOPY_STAT_HEADER + len - prefix > DCOPY_STAT_SEGMENT) {
+        seg = DCOPY_stat_store_grow();
+        prefix = 0;
+    }
+
+    int64_t atime = (int64_t) statbuf->st_atim.tv_sec;
+    int64_t mtime = (int64_t) statbuf->st_mtim.tv_sec;
+    uint32_t atime_nsec = (uint32_t) statbuf->st_atim.tv_nsec;
+    uint32_t mtime_nsec = (uint32_t) statbuf->st_mtim.tv_nsec;
+    uint32_t mode = (uint32_t) statbuf->st_mode;
+    uint32_t uid = (uint32_t) statbuf->st_uid;
+    uint32_t gid = (uint32_t) statbuf->st_gid;
+    uint16_t depth16 = (uint16_t) depth;
+    uint16_t prefix16 = (uint16_t) prefix;
+    uint16_t suffix16 = (uint16_t)(len - prefix);
+
+    char* ptr = seg->data + seg->len;
+
+    ptr = DCOPY_stat_put(ptr, &atime, sizeof(atime));
+    ptr = DCOPY_stat_put(ptr, &mtime, sizeof(mtime));
+    ptr = DCOPY_stat_put(ptr, &atime_nsec, sizeof(atime_nsec));
+    ptr = DCOPY_stat_put(ptr, &mtime_nsec, sizeof(mtime_nsec));
+    ptr = DCOPY_stat_put(ptr, &mode, sizeof(mode));
+    ptr = DCOPY_stat_put(ptr, &uid, sizeof(uid));
+    ptr = DCOPY_stat_put(ptr, &gid, sizeof(gid));
+    ptr = DCOPY_stat_put(ptr, &depth16, sizeof(depth16));
+    ptr = DCOPY_stat_put(ptr, &prefix16, sizeof(prefix16));
+    ptr = DCOPY_stat_put(ptr, &suffix16, sizeof(suffix16));
+    ptr = DCOPY_stat_put(ptr, dest_path + prefix, len - prefix);
+
+    seg->len = (size_t)(ptr - seg->data);
+
+    memcpy(DCOPY_stat_last_path + prefix, dest_path + prefix, len - prefix);
+    DCOPY_stat_last_len = len;
+}
+
+/* Go back to the first record, for DCOPY_stat_store_next. */
+void DCOPY_stat_store_rewind(void)
+{
+    DCOPY_stat_cursor_segment = 0;
+    DCOPY_stat_cursor_pos = 0;
+    DCOPY_stat_cursor_data = NULL;
+}
+
+/* Read the spilled segment seg back into the read buffer. */
+static const char* DCOPY_stat_store_load(const DCOPY_stat_segment_t* seg)
+{
+    size_t done = 0;
+
+    if(DCOPY_stat_read_buf == NULL) {
+        DCOPY_stat_read_buf = (char*) malloc(DCOPY_STAT_SEGMENT);
+
+        if(DCOPY_stat_read_buf == NULL) {
+            LOG(DCOPY_LOG_ERR, "Failed to allocate the stat store.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+    }
+
+    while(done < seg->len) {
+        ssize_t n = pread(DCOPY_stat_spill_fd, DCOPY_stat_read_buf + done, \
+                          seg->len - done, seg->offset + (off_t) done);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) {
+            LOG(DCOPY_LOG_ERR, "Failed to read spilled metadata records. errno=%d %s", \
+                errno, strerror(errno));
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        done += (size_t) n;
+    }
+
+    return DCOPY_stat_read_buf;
+}
+
+/*
+ * Read the next record, in the order they were added. The stat info of the
+ * record is set in statbuf, with only the fields the store keeps, and the
+ * path is returned, or NULL after the last record. The path stays valid until
+ * the next call.
+ */
+const char* DCOPY_stat_store_next(struct stat64* statbuf, \
+                                  int* depth)
+{
+    const DCOPY_stat_segment_t* seg;
+
+    for(;;) {
+        if(DCOPY_stat_cursor_segment >= DCOPY_stat_num_segments) {
+            return NULL;
+        }
+
+        seg = &DCOPY_stat_segments[DCOPY_stat_cursor_segment];
+
+        if(DCOPY_stat_cursor_data == NULL) {
+            DCOPY_stat_cursor_data = seg->data != NULL ? seg->data : DCOPY_stat_store_load(seg);
+            DCOPY_stat_cursor_pos = 0;
+        }
+
+        if(DCOPY_stat_cursor_pos < seg->len) {
+            break;
+        }
+
+        DCOPY_stat_cursor_segment++;
+        DCOPY_stat_cursor_data = NULL;
+    }
+
+    int64_t atime, mtime;
+    uint32_t atime_nsec, mtime_nsec, mode, uid, gid;
+    uint16_t depth16, prefix16, suffix16;
+
+    const char* ptr = DCOPY_stat_cursor_data + DCOPY_stat_cursor_pos;
+
+    ptr = DCOPY_stat_get(ptr, &atime, sizeof(atime));
+    ptr = DCOPY_stat_get(ptr, &mtime, sizeof(mtime));
+    ptr = DCOPY_stat_get(ptr, &atime_nsec, sizeof(atime_nsec));
+    ptr = DCOPY_stat_get(ptr, &mtime_nsec, sizeof(mtime_nsec));
+    ptr = DCOPY_stat_get(ptr, &mode, sizeof(mode));
+    ptr = DCOPY_stat_get(ptr, &uid, sizeof(uid));
+    ptr = DCOPY_stat_get(ptr, &gid, sizeof(gid));
+    ptr = DCOPY_stat_get(ptr, &depth16, sizeof(depth16));
+    ptr = DCOPY_stat_get(ptr, &prefix16, sizeof(prefix16));
+    ptr = DCOPY_stat_get(ptr, &suffix16, sizeof(suffix16));
+
+    memcpy(DCOPY_stat_cursor_path + prefix16, ptr, suffix16);
+    DCOPY_stat_cursor_path[prefix16 + suffix16] = '\0';
+
+    DCOPY_stat_cursor_pos = (size_t)(ptr + suffix16 - DCOPY_stat_cursor_data);
+
+    memset(statbuf, 0, sizeof(struct stat64));
+    statbuf->st_atim.tv_sec = (time_t) atime;
+    statbuf->st_atim.tv_nsec = (long) atime_nsec;
+    statbuf->st_mtim.tv_sec = (time_t) mtime;
+    statbuf->st_mtim.tv_nsec = (long) mtime_nsec;
+    statbuf->st_mode = (mode_t) mode;
+    statbuf->st_uid = (uid_t) uid;
+    statbuf->st_gid = (gid_t) gid;
+    *depth = (int) depth16;
+
+    return DCOPY_stat_cursor_path;
+}
+
+/* Release the stat store and close its spill file. */
+void DCOPY_stat_store_finalize(void)
+{
+    size_t i;
+
+    for(i = 0; i < DCOPY_stat_num_segments; i++) {
+        free(DCOPY_stat_segments[i].data);
+    }
+
+    free(DCOPY_stat_segments);
+    free(DCOPY_stat_read_buf);
+
+    DCOPY_stat_segments = NULL;
+    DCOPY_stat_num_segments = 0;
+    DCOPY_stat_cap_segments = 0;
+    DCOPY_stat_first_resident = 0;
+    DCOPY_stat_last_len = 0;
+    DCOPY_stat_read_buf = NULL;
+
+    if(DCOPY_stat_spill_fd >= 0) {
+        close(DCOPY_stat_spill_fd);
+        DCOPY_stat_spill_fd = -1;
+    }
+
+    DCOPY_stat_store_rewind();
+}
+
+/* EOF */
@@ -0,0 +1,21 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_STATSTORE_H
+#define __DCP_STATSTORE_H
+
+#include "common.h"
+
+void DCOPY_stat_store_init(void);
+
+void DCOPY_stat_store_add(const char* dest_path, \
+                          const struct stat64* statbuf, \
+                          int depth);
+
+void DCOPY_stat_store_rewind(void);
+
+const char* DCOPY_stat_store_next(struct stat64* statbuf, \
+                                  int* depth);
+
+void DCOPY_stat_store_finalize(void);
+
+#endif /* __DCP_STATSTORE_H */
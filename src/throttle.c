@@ -0,0 +1,223 @@
+/*
+ * This file contains the bandwidth limits for moving file data. Each limit is
+ * a token bucket kept as a virtual clock: the time by which everything granted
+ * so far will have moved at the allowed rate. Granting bytes pushes the clock
+ * forward, and the caller sleeps until it is no further ahead of now than
+ * DCOPY_THROTTLE_BURST_NS. A clock which has fallen behind is pulled up to now
+ * first, so idle time does not turn into a burst later.
+ *
+ * The per-rank limit keeps its clock in a local variable. The job-wide limit
+ * keeps one clock in an MPI window on rank 0. Ranks take bytes from it in
+ * batches of up to DCOPY_THROTTLE_JOB_BATCH and spend each batch locally, so
+ * the window is only touched every few slices. A batch is taken with two
+ * atomic operations under a shared lock all ranks hold for the whole run: an
+ * MPI_MAX which pulls the clock up to now, and an MPI_SUM which advances it,
+ * so no rank ever waits on another's lock. Ranks waiting for work in libcircle
+ * never touch it, so the whole budget goes to whichever ranks are busy.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "throttle.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/* Monotonic time (in nanoseconds) of the barrier all ranks start from. */
+static int64_t DCOPY_throttle_epoch = 0;
+
+/* Virtual clock of the per-rank limit. */
+static int64_t DCOPY_throttle_rank_clock = 0;
+
+/* Window holding the virtual clock of the job-wide limit on rank 0. */
+static MPI_Win DCOPY_throttle_win = MPI_WIN_NULL;
+static int64_t* DCOPY_throttle_job_clock = NULL;
+
+/*
+ * Bytes this rank was granted by the job-wide limit but has not moved yet,
+ * and where the job-wide clock stood after the last grant.
+ */
+static int64_t DCOPY_throttle_job_budget = 0;
+static int64_t DCOPY_throttle_job_until = 0;
+
+/* Nanoseconds since the epoch. */
+static int64_t DCOPY_throttle_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec - DCOPY_throttle_epoch;
+}
+
+/* Return where a virtual clock ends up after granting len bytes at rate. */
+static int64_t DCOPY_throttle_advance(int64_t clock, \
+                                      int64_t now, \
+                                      size_t len, \
+                                      int64_t rate)
+{
+    if(clock < now) {
+        clock = now;
+    }
+
+    return clock + (int64_t)((double) len * 1e9 / (double) rate);
+}
+
+/*
+ * Take len bytes from the job-wide limit, and return the time until which
+ * they are covered. Bytes are granted in batches, so most calls only spend
+ * what this rank was granted before.
+ */
+static int64_t DCOPY_throttle_job(int64_t now, \
+                                  size_t len)
+{
+    int64_t need = (int64_t) len - DCOPY_throttle_job_budget;
+    int64_t batch = (int64_t)((double) DCOPY_user_opts.max_bandwidth * \
+                              (double) DCOPY_THROTTLE_BURST_NS / 1e9);
+    int64_t grant;
+    int64_t clock;
+    int64_t next;
+
+    if(need <= 0) {
+        DCOPY_throttle_job_budget -= (int64_t) len;
+        return DCOPY_throttle_job_until;
+    }
+
+    /* enough for a fair share of the burst, but at least what is needed */
+    if(batch > DCOPY_THROTTLE_JOB_BATCH) {
+        batch = DCOPY_THROTTLE_JOB_BATCH;
+    }
+
+    if(batch < need) {
+        batch = need;
+    }
+
+    grant = DCOPY_throttle_advance(0, 0, (size_t) batch, DCOPY_user_opts.max_bandwidth);
+
+    /* pull the clock up to now, then take the batch from there; accumulates
+     * from one origin apply in order, so no other lock is needed */
+    if(MPI_Accumulate(&now, 1, MPI_INT64_T, 0, 0, 1, MPI_INT64_T, MPI_MAX, \
+                      DCOPY_throttle_win) != MPI_SUCCESS || \
+            MPI_Fetch_and_op(&grant, &clock, MPI_INT64_T, 0, 0, MPI_SUM, \
+                             DCOPY_throttle_win) != MPI_SUCCESS || \
+            MPI_Win_flush(0, DCOPY_throttle_win) != MPI_SUCCESS) {
+        LOG(DCOPY_LOG_ERR, "Failed to update the job-wide bandwidth limit.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    next = clock + grant;
+
+    DCOPY_throttle_job_budget += batch - (int64_t) len;
+    DCOPY_throttle_job_until = next;
+
+    return next;
+}
+
+/*
+ * Set up the bandwidth limits. This must be called by every rank before
+ * any data is moved.
+ */
+void DCOPY_throttle_init(void)
+{
+    if(DCOPY_user_opts.max_bandwidth > 0) {
+        MPI_Aint size = (CIRCLE_global_rank == 0) ? sizeof(int64_t) : 0;
+
+        if(MPI_Win_allocate(size, sizeof(int64_t), MPI_INFO_NULL, MPI_COMM_WORLD, \
+                            &DCOPY_throttle_job_clock, &DCOPY_throttle_win) != MPI_SUCCESS) {
+            LOG(DCOPY_LOG_ERR, "Failed to set up the job-wide bandwidth limit.");
+            DCOPY_abort(EXIT_FAILURE);
+        }
+
+        if(CIRCLE_global_rank == 0) {
+            MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, DCOPY_throttle_win);
+            *DCOPY_throttle_job_clock = 0;
+            MPI_Win_unlock(0, DCOPY_throttle_win);
+        }
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    /* every rank holds a shared lock until the limit is released */
+    if(DCOPY_throttle_win != MPI_WIN_NULL && \
+            MPI_Win_lock_all(MPI_MODE_NOCHECK, DCOPY_throttle_win) != MPI_SUCCESS) {
+        LOG(DCOPY_LOG_ERR, "Failed to set up the job-wide bandwidth limit.");
+        DCOPY_abort(EXIT_FAILURE);
+    }
+
+    DCOPY_throttle_epoch = DCOPY_throttle_now();
+}
+
+/* Check whether any bandwidth limit is in effect. */
+bool DCOPY_throttle_enabled(void)
+{
+    return DCOPY_user_opts.max_bandwidth > 0 || \
+           DCOPY_user_opts.max_rank_bandwidth > 0;
+}
+
+/*
+ * Wait until len more bytes may be moved without going over the bandwidth
+ * limits. Callers move data in pieces of at most DCOPY_SLICE_SIZE bytes,
+ * so the wait is spread evenly.
+ */
+void DCOPY_throttle(size_t len)
+{
+    if(!DCOPY_throttle_enabled()) {
+        return;
+    }
+
+    int64_t now = DCOPY_throttle_now();
+    int64_t until = now;
+
+    if(DCOPY_user_opts.max_rank_bandwidth > 0) {
+        DCOPY_throttle_rank_clock = DCOPY_throttle_advance(DCOPY_throttle_rank_clock, \
+                                    now, len, DCOPY_user_opts.max_rank_bandwidth);
+
+        if(DCOPY_throttle_rank_clock > until) {
+            until = DCOPY_throttle_rank_clock;
+        }
+    }
+
+    if(DCOPY_user_opts.max_bandwidth > 0) {
+        int64_t job_clock = DCOPY_throttle_job(now, len);
+
+        if(job_clock > until) {
+            until = job_clock;
+        }
+    }
+
+    /* sleep off whatever is beyond the allowed burst */
+    until -= DCOPY_THROTTLE_BURST_NS;
+
+    if(until <= now) {
+        return;
+    }
+
+    DCOPY_statistics.throttled_ns += until - now;
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)((until - now) / 1000000000);
+    ts.tv_nsec = (long)((until - now) % 1000000000);
+
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+/* Release the job-wide limit. This must be called by every rank. */
+void DCOPY_throttle_finalize(void)
+{
+    if(DCOPY_throttle_win != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(DCOPY_throttle_win);
+        MPI_Win_free(&DCOPY_throttle_win);
+        DCOPY_throttle_job_clock = NULL;
+    }
+}
+
+/* EOF */
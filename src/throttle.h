@@ -0,0 +1,16 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_THROTTLE_H
+#define __DCP_THROTTLE_H
+
+#include "common.h"
+
+void DCOPY_throttle_init(void);
+
+bool DCOPY_throttle_enabled(void);
+
+void DCOPY_throttle(size_t len);
+
+void DCOPY_throttle_finalize(void);
+
+#endif /* __DCP_THROTTLE_H */
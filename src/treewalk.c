@@ -11,10 +11,19 @@
  */
 
 #include "treewalk.h"
+#include "cleanup.h"
+#include "diff.h"
+#include "digest.h"
+#include "dirtable.h"
+#include "statstore.h"
+#include "filetable.h"
+#include "journal.h"
+#include "manifest.h"
 #include "dcp.h"
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,8 +37,19 @@
 /** Options specified by the user. */
 extern DCOPY_options_t DCOPY_user_opts;
 
+/** Statistics to gather for summary output. */
+extern DCOPY_statistics_t DCOPY_statistics;
+
+/*
+ * Histogram of regular file sizes this rank has walked so far, bucketed by
+ * floor(log2(size)). This is used to pick chunk sizes which are close to the
+ * typical unit of work in the tree.
+ */
+static int64_t DCOPY_size_histogram[64];
+static int64_t DCOPY_files_seen = 0;
+
 /* given path, return level within directory tree */
-static int compute_depth(const char* path)
+int DCOPY_compute_depth(const char* path)
 {
     /* TODO: ignore trailing '/' */
 
@@ -43,6 +63,172 @@ static int compute_depth(const char* path)
     return depth;
 }
 
+/* given a size in bytes, return its histogram bucket */
+static int DCOPY_size_bucket(int64_t size)
+{
+    int bucket = 0;
+
+    while(size > 1) {
+        size >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+/* return the upper edge of the histogram bucket holding the median file */
+static int64_t DCOPY_median_file_size(void)
+{
+    int64_t count = 0;
+    int bucket;
+
+    for(bucket = 0; bucket < 62; bucket++) {
+        count += DCOPY_size_histogram[bucket];
+
+        if(count * 2 >= DCOPY_files_seen) {
+            break;
+        }
+    }
+
+    return ((int64_t) 1) << (bucket + 1);
+}
+
+/* record the size of a regular file in the histogram */
+static void DCOPY_stat_count_size(int64_t file_size)
+{
+    DCOPY_size_histogram[DCOPY_size_bucket(file_size)]++;
+    DCOPY_files_seen++;
+}
+
+/*
+ * Pick the chunk size for a file. Unless the user forced a chunk size, we aim
+ * for chunks of equal size which are no larger than the typical file seen so
+ * far, spread a lone big file across all ranks, and bound the number of
+ * chunks a single file may put on the queue.
+ */
+static int64_t DCOPY_pick_chunk_size(int64_t file_size)
+{
+    if(DCOPY_user_opts.chunk_size > 0) {
+        return DCOPY_user_opts.chunk_size;
+    }
+
+    if(file_size <= DCOPY_CHUNK_SIZE_MIN) {
+        return DCOPY_CHUNK_SIZE_MIN;
+    }
+
+    int64_t ranks = (int64_t) DCOPY_global_size;
+    int64_t target = DCOPY_CHUNK_SIZE;
+
+    if(DCOPY_files_seen >= ranks) {
+        /* there is plenty of other work, so don't let this file produce
+         * units much bigger than the rest of the tree */
+        int64_t median = DCOPY_median_file_size();
+
+        if(median < target) {
+            target = median;
+        }
+    }
+    else if((file_size + target - 1) / target < ranks) {
+        /* this file may be most of the job, so make sure that every rank
+         * gets a piece of it */
+        target = (file_size + ranks - 1) / ranks;
+    }
+
+    if(target < DCOPY_CHUNK_SIZE_MIN) {
+        target = DCOPY_CHUNK_SIZE_MIN;
+    }
+
+    /* bound the number of queue entries for this file */
+    int64_t num_chunks = (file_size + target - 1) / target;
+    int64_t max_chunks = DCOPY_CHUNKS_PER_RANK * ranks;
+
+    if(num_chunks > max_chunks) {
+        num_chunks = max_chunks;
+    }
+
+    /* split evenly, rounded up to a whole number of blocks */
+    int64_t chunk_size = (file_size + num_chunks - 1) / num_chunks;
+    chunk_size = (chunk_size + FD_BLOCK_SIZE - 1) / FD_BLOCK_SIZE * FD_BLOCK_SIZE;
+
+    if(chunk_size > DCOPY_CHUNK_SIZE_MAX) {
+        chunk_size = DCOPY_CHUNK_SIZE_MAX;
+    }
+
+    return chunk_size;
+}
+
+/**
+ * Record the destination path and stat info of an object in the stat store
+ * used to set ownership, permissions, and timestamps at the end of the copy.
+ */
+void DCOPY_stat_record(const char* dest_path, \
+                       const struct stat64* statbuf)
+{
+    DCOPY_stat_store_add(dest_path, statbuf, DCOPY_compute_depth(dest_path));
+}
+
+/**
+ * In update mode, check whether the destination of a file or link already
+ * matches its source: a regular file of the same size and modification
+ * time, or a link to the same place. Times are compared in whole seconds,
+ * which is all a copy with -p keeps. Returns true if the object can be
+ * skipped. A destination of another type is unlinked, so it is replaced
+ * rather than written through.
+ */
+bool DCOPY_stat_unchanged(DCOPY_operation_t* op, \
+                          const struct stat64* statbuf)
+{
+    struct stat64 dest_sb;
+
+    if(lstat64(op->dest_full_path, &dest_sb) < 0) {
+        return false;
+    }
+
+    if((statbuf->st_mode & S_IFMT) != (dest_sb.st_mode & S_IFMT)) {
+        if(!S_ISDIR(dest_sb.st_mode)) {
+            DCOPY_unlink_destination(op);
+        }
+
+        return false;
+    }
+
+    if(S_ISLNK(statbuf->st_mode)) {
+        if(!DCOPY_same_link(op->operand, op->dest_full_path)) {
+            return false;
+        }
+    }
+    else if(statbuf->st_size != dest_sb.st_size || \
+            statbuf->st_mtime != dest_sb.st_mtime) {
+        return false;
+    }
+
+    DCOPY_statistics.total_files_skipped++;
+
+    if(S_ISREG(statbuf->st_mode)) {
+        DCOPY_statistics.total_bytes_skipped += statbuf->st_size;
+    }
+
+    return true;
+}
+
+/**
+ * Determine if an object should be copied as part of a batch rather than
+ * through the individual stages.
+ */
+bool DCOPY_stat_is_batchable(const struct stat64* statbuf)
+{
+    if(DCOPY_user_opts.batch_threshold <= 0) {
+        return false;
+    }
+
+    if(S_ISLNK(statbuf->st_mode)) {
+        return true;
+    }
+
+    return S_ISREG(statbuf->st_mode) && \
+           statbuf->st_size <= DCOPY_user_opts.batch_threshold;
+}
+
 /**
  * This is the entry point for the "file stat stage". This function is called
  * from the jump table required for the main libcircle callbacks.
@@ -77,22 +263,26 @@ void DCOPY_do_treewalk(DCOPY_operation_t* op, \
         return;
     }
 
-    /* create new element to record file path and stat info */
-    DCOPY_stat_elem_t* elem = (DCOPY_stat_elem_t*) malloc(sizeof(DCOPY_stat_elem_t));
-    elem->file = strdup(op->dest_full_path);
-    elem->sb = (struct stat64*) malloc(sizeof(struct stat64));
-    elem->depth = compute_depth(op->dest_full_path);
-    memcpy(elem->sb, &statbuf, sizeof(struct stat64));
-    elem->next = NULL;
-
-    /* append element to tail of linked list */
-    if (DCOPY_list_head == NULL) {
-        DCOPY_list_head = elem;
+    /*
+     * Only compare against what is already there, if asked to. Anything that
+     * doesn't match in type or size is not looked at any further.
+     */
+    if(DCOPY_user_opts.compare_only) {
+        if(!DCOPY_diff_check(op, &statbuf)) {
+            return;
+        }
+    }
+    else if(DCOPY_user_opts.update && !S_ISDIR(statbuf.st_mode) && \
+            DCOPY_stat_unchanged(op, &statbuf)) {
+        /* leave alone whatever is already up to date */
+        return;
     }
-    if (DCOPY_list_tail != NULL) {
-        DCOPY_list_tail->next = elem;
+    else if(S_ISLNK(statbuf.st_mode)) {
+        /* record file path and stat info for the metadata phase; directories
+         * are kept in the directory table until everything below is done,
+         * and files until their chunks are */
+        DCOPY_stat_record(op->dest_full_path, &statbuf);
     }
-    DCOPY_list_tail = elem;
 
     if(S_ISDIR(statbuf.st_mode)) {
         /* LOG(DCOPY_LOG_DBG, "Stat operation found a directory at `%s'.", op->operand); */
@@ -136,9 +326,14 @@ void DCOPY_stat_process_link(DCOPY_operation_t* op, \
 
     path[rc] = '\0';
 
-    /* create new link */
+    /* create new link, replacing an outdated one in update mode */
     int symrc = symlink(path, dest_path);
 
+    if(symrc < 0 && errno == EEXIST && DCOPY_user_opts.update) {
+        DCOPY_unlink_destination(op);
+        symrc = symlink(path, dest_path);
+    }
+
     if(symrc < 0) {
         LOG(DCOPY_LOG_ERR, "Failed to create link `%s' symlink() errno=%d %s",
             dest_path, errno, strerror(errno)
@@ -153,26 +348,18 @@ void DCOPY_stat_process_link(DCOPY_operation_t* op, \
         DCOPY_copy_permissions(statbuf, dest_path);
     }
 
+    DCOPY_statistics.total_files_copied++;
+
     return;
 }
 
 /**
- * This function inputs a file and creates chunk operations that get placed
- * onto the libcircle queue for future processing by the copy stage.
+ * Create the destination of a regular file and copy its extended attributes,
+ * so that data may be written into it by any rank.
  */
-void DCOPY_stat_process_file(DCOPY_operation_t* op, \
-                             const struct stat64* statbuf,
-                             CIRCLE_handle* handle)
+void DCOPY_stat_create_file(DCOPY_operation_t* op, \
+                            const struct stat64* statbuf)
 {
-    int64_t file_size = statbuf->st_size;
-    int64_t chunk_index;
-    int64_t num_chunks = file_size / DCOPY_CHUNK_SIZE;
-
-    LOG(DCOPY_LOG_DBG, "File `%s' size is `%" PRId64 \
-        "' with chunks `%" PRId64 "' (total `%" PRId64 "').", \
-        op->operand, file_size, num_chunks, \
-        num_chunks * DCOPY_CHUNK_SIZE);
-
     const char* dest_path = op->dest_full_path;
 
     /* since file systems like Lustre require xattrs to be set before file is opened,
@@ -185,11 +372,24 @@ void DCOPY_stat_process_file(DCOPY_operation_t* op, \
     memset(&dev, 0, sizeof(dev_t));
     int mknod_rc = mknod(dest_path, DCOPY_DEF_PERMS_FILE | S_IFREG, dev);
 
-    if(mknod_rc < 0) {
-        if(errno == EEXIST) {
-            /* TODO: should we unlink and mknod again in this case? */
+    /*
+     * With force, an existing destination which can't be written is replaced
+     * here, while its directory still waits for this file, rather than by
+     * the copy stage once the directory may have been given its attributes.
+     */
+    if(mknod_rc < 0 && errno == EEXIST && DCOPY_user_opts.force) {
+        int fd = open64(dest_path, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+
+        if(fd >= 0) {
+            close(fd);
         }
+        else {
+            DCOPY_unlink_destination(op);
+            mknod_rc = mknod(dest_path, DCOPY_DEF_PERMS_FILE | S_IFREG, dev);
+        }
+    }
 
+    if(mknod_rc < 0) {
         LOG(DCOPY_LOG_DBG, "File `%s' mknod() errno=%d %s",
             dest_path, errno, strerror(errno)
            );
@@ -201,30 +401,310 @@ void DCOPY_stat_process_file(DCOPY_operation_t* op, \
     if (DCOPY_user_opts.preserve) {
         DCOPY_copy_xattrs(op, statbuf, dest_path);
     }
+}
+
+/*
+ * Allocate the blocks of the destination of op up front, so a file written
+ * by many ranks at once is laid out in a few large extents, and set its
+ * final size. Returns false if the filesystem can't preallocate, in which
+ * case the destination is left to grow as chunks are written.
+ */
+static bool DCOPY_stat_preallocate(DCOPY_operation_t* op, \
+                                   int64_t file_size)
+{
+    bool preallocated = false;
+
+#ifdef HAVE_FALLOCATE
+    int out_fd = DCOPY_open_output_fd(op);
+
+    if(out_fd < 0) {
+        return false;
+    }
+
+    /* unlike posix_fallocate(), this never falls back to writing zeros */
+    if(fallocate64(out_fd, 0, 0, file_size) < 0) {
+        LOG(DCOPY_LOG_DBG, "Failed to preallocate `%s'. errno=%d %s", \
+            op->dest_full_path, errno, strerror(errno));
+    }
+    else if(ftruncate64(out_fd, file_size) < 0) {
+        /* an existing destination may still be longer */
+        LOG(DCOPY_LOG_DBG, "Failed to truncate `%s'. errno=%d %s", \
+            op->dest_full_path, errno, strerror(errno));
+    }
+    else {
+        preallocated = true;
+    }
+
+    close(out_fd);
+#endif /* HAVE_FALLOCATE */
+
+    return preallocated;
+}
+
+/*
+ * Encode and enqueue num_chunks chunks of a file from first on as a single
+ * range, which is split up as ranks work on it.
+ */
+static void DCOPY_stat_enqueue_range(DCOPY_operation_t* op, \
+                                     DCOPY_operation_code_t code, \
+                                     int64_t first, \
+                                     int64_t num_chunks, \
+                                     uint32_t flags, \
+                                     CIRCLE_handle* handle)
+{
+    if(num_chunks <= 0) {
+        return;
+    }
+
+    char* newop = DCOPY_encode_range(code, op, first, num_chunks, flags);
+    handle->enqueue(newop);
+    free(newop);
+}
+
+/*
+ * Enqueue the chunks in [first, last] of a file for the copy stage, leaving
+ * out those the run being resumed already finished. Returns the number of
+ * chunks enqueued.
+ */
+static int64_t DCOPY_stat_enqueue_chunks(DCOPY_operation_t* op, \
+                                      const struct stat64* statbuf, \
+                                      int64_t first, \
+                                      int64_t last, \
+                                      int64_t chunk_size, \
+                                      uint32_t flags, \
+                                      bool resumed, \
+                                      CIRCLE_handle* handle)
+{
+    int64_t file_size = statbuf->st_size;
+    int64_t chunk_index;
+
+    int64_t enqueued = 0;
+
+    if(!resumed) {
+        DCOPY_stat_enqueue_range(op, COPY, first, last - first + 1, flags, handle);
+        return last - first + 1;
+    }
+
+    for(chunk_index = first; chunk_index <= last; chunk_index++) {
+        if(!DCOPY_journal_done(op->dest_full_path, statbuf, chunk_size, chunk_index)) {
+            continue;
+        }
+
+        int64_t len = file_size - chunk_index * chunk_size;
+
+        DCOPY_statistics.total_chunks_resumed++;
+        DCOPY_statistics.total_bytes_resumed += len < chunk_size ? len : chunk_size;
+
+        /* send what comes before this chunk on its own */
+        DCOPY_stat_enqueue_range(op, COPY, first, chunk_index - first, flags, handle);
+        enqueued += chunk_index - first;
+        first = chunk_index + 1;
+    }
+
+    DCOPY_stat_enqueue_range(op, COPY, first, last - first + 1, flags, handle);
+
+    return enqueued + last - first + 1;
+}
+
+/*
+ * Record the chunks in [first, last) of a file, which are left out as
+ * holes, in the manifest. Nothing reads them back, so they are recorded
+ * here as zeros.
+ */
+static void DCOPY_stat_manifest_holes(DCOPY_operation_t* op, \
+                                      int64_t first, \
+                                      int64_t last, \
+                                      int64_t file_size, \
+                                      int64_t chunk_size)
+{
+    uint32_t full_crc = 0;
+    bool have_full_crc = false;
 
-    /* Encode and enqueue each chunk of the file for processing later. */
-    for(chunk_index = 0; chunk_index < num_chunks; chunk_index++) {
-        char* newop = DCOPY_encode_operation(COPY, chunk_index, op->operand, \
-                                             op->source_base_offset, \
-                                             op->dest_base_appendix, file_size);
-        handle->enqueue(newop);
-        free(newop);
+    if(!DCOPY_manifest_enabled()) {
+        return;
     }
 
-    /* Encode and enqueue the last partial chunk. */
-    if((num_chunks * DCOPY_CHUNK_SIZE) < file_size || num_chunks == 0) {
-        char* newop = DCOPY_encode_operation(COPY, chunk_index, op->operand, \
-                                             op->source_base_offset, \
-                                             op->dest_base_appendix, file_size);
-        handle->enqueue(newop);
-        free(newop);
+    for(; first < last; first++) {
+        off64_t offset = first * chunk_size;
+        off64_t len = file_size - offset < chunk_size ? file_size - offset : chunk_size;
+
+        if(len < chunk_size) {
+            DCOPY_manifest_chunk(op->dest_full_path, offset, len, DCOPY_crc32c_zeros(0, len));
+            continue;
+        }
+
+        if(!have_full_crc) {
+            full_crc = DCOPY_crc32c_zeros(0, chunk_size);
+            have_full_crc = true;
+        }
+
+        DCOPY_manifest_chunk(op->dest_full_path, offset, len, full_crc);
     }
 }
 
+/**
+ * This function inputs a file and creates chunk operations that get placed
+ * onto the libcircle queue for future processing by the copy stage. Each run
+ * of data is sent as one range of chunks, so a huge file does not flood the
+ * queue of this rank.
+ *
+ * Chunks that lie entirely inside holes of a sparse file are left out. The
+ * last chunk is always enqueued, since its cleanup truncates the destination
+ * to the full size, which recreates any trailing hole.
+ *
+ * The file is counted in its directory until the rank which finishes its last
+ * chunk has set its attributes, rather than until it has been walked.
+ */
+void DCOPY_stat_process_file(DCOPY_operation_t* op, \
+                             const struct stat64* statbuf,
+                             CIRCLE_handle* handle)
+{
+    int64_t file_size = statbuf->st_size;
+    int64_t chunk_index = 0;
+    int64_t resumed = DCOPY_journal_lookup(op->dest_full_path, statbuf);
+    int64_t chunk_size = resumed > 0 ? resumed : DCOPY_pick_chunk_size(file_size);
+    int64_t num_chunks = file_size / chunk_size;
+    int64_t last_chunk = file_size > 0 ? (file_size - 1) / chunk_size : 0;
+    int64_t enqueued = 0;
+    int in_fd = -1;
+    uint32_t flags = 0;
+
+    /* record this file for future chunk size decisions */
+    DCOPY_stat_count_size(file_size);
+
+    LOG(DCOPY_LOG_DBG, "File `%s' size is `%" PRId64 \
+        "' with chunks `%" PRId64 "' of `%" PRId64 "' (total `%" PRId64 "').", \
+        op->operand, file_size, num_chunks, chunk_size, \
+        num_chunks * chunk_size);
+
+    /* the chunks only carry the ID of the file */
+    bool counted = DCOPY_file_table_register(op, statbuf, chunk_size);
+
+    /* Without a copy, every chunk goes straight to the compare stage. */
+    if(DCOPY_user_opts.compare_only) {
+        DCOPY_stat_enqueue_range(op, COMPARE, 0, last_chunk + 1, 0, handle);
+        return;
+    }
+
+    if(counted) {
+        /* the file takes the place of this walk in its directory */
+        op->parent.rank = -1;
+    }
+    else {
+        DCOPY_stat_record(op->dest_full_path, statbuf);
+    }
+
+    /*
+     * A delta only writes what differs, so every chunk goes to the copy stage
+     * to be compared against what the destination already holds.
+     */
+    if(DCOPY_user_opts.delta) {
+        struct stat64 dest_sb;
+
+        if(lstat64(op->dest_full_path, &dest_sb) == 0 && S_ISREG(dest_sb.st_mode)) {
+            flags |= DCOPY_OP_DELTA;
+        }
+    }
+
+    DCOPY_stat_create_file(op, statbuf);
+    DCOPY_manifest_file(op->dest_full_path, statbuf);
+
+    /*
+     * Only look for holes if fewer blocks are allocated than the size needs.
+     * Chunks that are skipped never overwrite the destination, so empty out
+     * whatever an existing destination held there. A delta keeps it, and
+     * the copy stage punches the holes of the source instead.
+     */
+    if(flags & DCOPY_OP_DELTA) {
+        LOG(DCOPY_LOG_DBG, "Updating `%s' in place.", op->dest_full_path);
+    }
+    else if(statbuf->st_blocks * 512 < file_size) {
+        in_fd = open64(op->operand, O_RDONLY | O_NOATIME);
+
+        /* the run being resumed emptied it before writing any chunk */
+        int out_fd = (in_fd < 0 || resumed > 0) ? -1 : DCOPY_open_output_fd(op);
+
+        if(out_fd >= 0) {
+            if(ftruncate64(out_fd, 0) < 0) {
+                LOG(DCOPY_LOG_DBG, "Failed to empty destination of `%s'. errno=%d %s", \
+                    op->operand, errno, strerror(errno));
+            }
+
+            close(out_fd);
+        }
+    }
+    else if(DCOPY_user_opts.preallocate && file_size > 0 && \
+            DCOPY_stat_preallocate(op, file_size)) {
+        /* direct I/O pads the tail past the size, so it still truncates */
+        if(!DCOPY_user_opts.direct) {
+            flags |= DCOPY_OP_PREALLOCATED;
+        }
+    }
+
+    /* Encode and enqueue each chunk which holds data. */
+    while(chunk_index <= last_chunk) {
+        off64_t data_end = file_size;
+        off64_t data = chunk_index * chunk_size;
+
+        if(in_fd >= 0) {
+            data = DCOPY_seek_data(in_fd, data, file_size, &data_end);
+        }
+
+        if(data >= file_size) {
+            break;
+        }
+
+        /* Enqueue every chunk this run of data touches. */
+        int64_t first = data / chunk_size;
+        int64_t last = (data_end - 1) / chunk_size;
+
+        DCOPY_stat_manifest_holes(op, chunk_index, first, file_size, chunk_size);
+        enqueued += DCOPY_stat_enqueue_chunks(op, statbuf, first, last, chunk_size, flags, \
+                                              resumed > 0, handle);
+        chunk_index = last + 1;
+    }
+
+    /* The last chunk truncates the file, so it is needed even as a hole. */
+    if(chunk_index <= last_chunk) {
+        DCOPY_stat_manifest_holes(op, chunk_index, last_chunk, file_size, chunk_size);
+        enqueued += DCOPY_stat_enqueue_chunks(op, statbuf, last_chunk, last_chunk, chunk_size, \
+                                              flags, resumed > 0, handle);
+    }
+
+    if(in_fd >= 0) {
+        close(in_fd);
+    }
+
+    /* the chunks may already be done, and then this finishes the file */
+    if(counted) {
+        DCOPY_cleanup_finish_chunks(op, DCOPY_FILE_PENDING_HOLD - enqueued);
+    }
+}
+
+/*
+ * Encode and enqueue a batch of small files found in the directory of op,
+ * and count it as pending work of the directory.
+ */
+static void DCOPY_stat_enqueue_batch(DCOPY_operation_t* op, \
+                                     char* batch, \
+                                     CIRCLE_handle* handle)
+{
+    char* newop = DCOPY_encode_operation(BATCH, 0, op->operand, \
+                                         op->source_base_offset, \
+                                         op->dest_base_appendix, 0, 0, batch, 0, 0, \
+                                         &op->parent);
+    DCOPY_dir_table_update(&op->parent, 1);
+    handle->enqueue(newop);
+    free(newop);
+}
+
 /**
  * This function reads the contents of a directory and generates appropriate
  * libcircle operations for every object in the directory. It then places those
  * operations on the libcircle queue and returns.
+ *
+ * Small files and links are not walked individually. Instead, their names
+ * are collected into batch operations which are copied in a single pass.
  */
 void DCOPY_stat_process_dir(DCOPY_operation_t* op,
                             const struct stat64* statbuf,
@@ -239,18 +719,45 @@ void DCOPY_stat_process_dir(DCOPY_operation_t* op,
 
     const char* dest_path = op->dest_full_path;
 
-    /* first, create the destination directory */
-    LOG(DCOPY_LOG_DBG, "Creating directory: %s", dest_path);
-    int rc = mkdir(dest_path, DCOPY_DEF_PERMS_DIR);
-    if(rc != 0) {
-        LOG(DCOPY_LOG_ERR, "Failed to create directory: %s (errno=%d %s)", \
-            dest_path, errno, strerror(errno));
-        return;
+    /* names of small files to copy as a batch, separated by '/' */
+    char batch[CIRCLE_MAX_STRING_LEN];
+    size_t batch_len = 0;
+    int64_t batch_bytes = 0;
+
+    /* leave room for the other fields of the batch operation */
+    long batch_room = CIRCLE_MAX_STRING_LEN - DCOPY_BATCH_OVERHEAD - \
+                      (long) strlen(op->operand);
+
+    if(op->dest_base_appendix != NULL) {
+        batch_room -= (long) strlen(op->dest_base_appendix);
     }
 
-    /* copy extended attributes on directory */
-    if (DCOPY_user_opts.preserve) {
-        DCOPY_copy_xattrs(op, statbuf, dest_path);
+    /* first, create the destination directory, or look for what the
+     * existing one has that the source doesn't */
+    if(DCOPY_user_opts.compare_only) {
+        DCOPY_diff_extras(op);
+    }
+    else {
+        LOG(DCOPY_LOG_DBG, "Creating directory: %s", dest_path);
+        int rc = mkdir(dest_path, DCOPY_DEF_PERMS_DIR);
+
+        /* an existing directory is merged into */
+        struct stat64 dest_sb;
+        if(rc != 0 && errno == EEXIST && lstat64(dest_path, &dest_sb) == 0 && \
+                S_ISDIR(dest_sb.st_mode)) {
+            rc = 0;
+        }
+
+        if(rc != 0) {
+            LOG(DCOPY_LOG_ERR, "Failed to create directory: %s (errno=%d %s)", \
+                dest_path, errno, strerror(errno));
+            return;
+        }
+
+        /* copy extended attributes on directory */
+        if (DCOPY_user_opts.preserve) {
+            DCOPY_copy_xattrs(op, statbuf, dest_path);
+        }
     }
 
     /* iterate through source directory and add items to queue */
@@ -264,6 +771,10 @@ void DCOPY_stat_process_dir(DCOPY_operation_t* op,
         return;
     }
     else {
+        /* everything inside is counted in an entry of the directory table,
+         * which takes the place of this walk in the parent directory */
+        op->parent = DCOPY_dir_table_add(dest_path, statbuf, &op->parent);
+
         while((curr_ent = readdir(curr_dir)) != NULL) {
             curr_dir_name = curr_ent->d_name;
 
@@ -273,11 +784,51 @@ void DCOPY_stat_process_dir(DCOPY_operation_t* op,
                 /* build new object name */
                 sprintf(newop_path, "%s/%s", op->operand, curr_dir_name);
 
+                /* see if this object can go into the current batch */
+                struct stat64 child_sb;
+                long name_len = (long) strlen(curr_dir_name) + 1;
+
+                if(DCOPY_user_opts.batch_threshold > 0 && \
+                        curr_ent->d_type != DT_DIR && \
+                        name_len <= batch_room && \
+                        lstat64(newop_path, &child_sb) == 0 && \
+                        DCOPY_stat_is_batchable(&child_sb)) {
+
+                    int64_t child_size = S_ISREG(child_sb.st_mode) ? child_sb.st_size : 0;
+
+                    /* send the current batch off if this one won't fit */
+                    if(batch_len > 0 && \
+                            ((long) batch_len + name_len > batch_room || \
+                             batch_bytes + child_size > DCOPY_BATCH_MAX_BYTES)) {
+                        DCOPY_stat_enqueue_batch(op, batch, handle);
+                        batch_len = 0;
+                        batch_bytes = 0;
+                    }
+
+                    /* append name, using '/' as a separator since it can't
+                     * appear in a file name */
+                    if(batch_len > 0) {
+                        batch[batch_len++] = '/';
+                    }
+
+                    strcpy(batch + batch_len, curr_dir_name);
+                    batch_len += strlen(curr_dir_name);
+                    batch_bytes += child_size;
+
+                    if(S_ISREG(child_sb.st_mode)) {
+                        DCOPY_stat_count_size(child_size);
+                    }
+
+                    continue;
+                }
+
                 LOG(DCOPY_LOG_DBG, "Stat operation is enqueueing `%s'", newop_path);
 
                 /* Distributed recursion here. */
                 newop = DCOPY_encode_operation(TREEWALK, 0, newop_path, \
-                                               op->source_base_offset, op->dest_base_appendix, op->file_size);
+                                               op->source_base_offset, op->dest_base_appendix, op->file_size, 0, NULL, 0, 0, \
+                                               &op->parent);
+                DCOPY_dir_table_update(&op->parent, 1);
                 handle->enqueue(newop);
 
                 free(newop);
@@ -285,6 +836,11 @@ void DCOPY_stat_process_dir(DCOPY_operation_t* op,
         }
     }
 
+    /* send off the last batch */
+    if(batch_len > 0) {
+        DCOPY_stat_enqueue_batch(op, batch, handle);
+    }
+
     closedir(curr_dir);
     return;
 }
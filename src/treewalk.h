@@ -8,6 +8,19 @@
 void DCOPY_do_treewalk(DCOPY_operation_t* op, \
                        CIRCLE_handle* handle);
 
+int DCOPY_compute_depth(const char* path);
+
+void DCOPY_stat_record(const char* dest_path, \
+                       const struct stat64* statbuf);
+
+bool DCOPY_stat_unchanged(DCOPY_operation_t* op, \
+                          const struct stat64* statbuf);
+
+bool DCOPY_stat_is_batchable(const struct stat64* statbuf);
+
+void DCOPY_stat_create_file(DCOPY_operation_t* op, \
+                            const struct stat64* statbuf);
+
 void DCOPY_stat_process_link(DCOPY_operation_t* op, \
                              const struct stat64* statbuf,
                              CIRCLE_handle* handle);
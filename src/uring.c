@@ -0,0 +1,502 @@
+/*
+ * This file contains the io_uring copy engine. It keeps several reads and
+ * writes of one chunk in flight at once, so a rank is no longer limited to
+ * a single outstanding request on high latency filesystems.
+ *
+ * The ring is driven through the raw system calls so that no extra library
+ * is required. Each rank sets up one ring on first use and keeps it until
+ * the copy is finished.
+ *
+ * See the file "COPYING" for the full license governing this code.
+ */
+
+#include "uring.h"
+#include "digest.h"
+#include "dcp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+/** Options specified by the user. */
+extern DCOPY_options_t DCOPY_user_opts;
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+/* State of one buffer in the ring. */
+typedef enum {
+    DCOPY_SLOT_IDLE, DCOPY_SLOT_READING, DCOPY_SLOT_WRITING
+} DCOPY_slot_state_t;
+
+typedef struct {
+    DCOPY_slot_state_t state;
+    char*   buf;
+    off64_t offset; /* where the data in buf starts in the file */
+    size_t  len;    /* bytes of the range this slot covers at offset */
+    size_t  io_len; /* bytes to ask for, len rounded up for direct I/O */
+    size_t  filled; /* bytes read into buf */
+    size_t  wlen;   /* bytes of buf to write, filled padded for direct I/O */
+    size_t  done;   /* bytes of buf written out */
+    bool    eof;    /* the read ran into the end of the file */
+} DCOPY_uring_slot_t;
+
+typedef struct {
+    int fd;
+    unsigned depth;
+
+    /* submission queue */
+    void* sq_ptr;
+    size_t sq_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    /* completion queue */
+    void* cq_ptr;
+    size_t cq_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /* buffers, registered with the kernel if it allows */
+    char* buffers;
+    bool fixed_buffers;
+    DCOPY_uring_slot_t* slots;
+} DCOPY_uring_t;
+
+/* The ring for this rank, set up on first use. */
+static DCOPY_uring_t* DCOPY_ring = NULL;
+
+/* Set once setting up a ring failed, so we don't try again. */
+static bool DCOPY_uring_unavailable = false;
+
+/* Tear down a ring, whether or not it was fully set up. */
+static void DCOPY_uring_destroy(DCOPY_uring_t* ring)
+{
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if(ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+
+    if(ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+
+    if(ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    free(ring->buffers);
+    free(ring->slots);
+    free(ring);
+}
+
+/* Set up a ring with depth buffers of FD_BLOCK_SIZE bytes each. */
+static DCOPY_uring_t* DCOPY_uring_create(unsigned depth)
+{
+    struct io_uring_params params;
+    DCOPY_uring_t* ring = (DCOPY_uring_t*) calloc(1, sizeof(DCOPY_uring_t));
+
+    if(ring == NULL) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+
+    ring->depth = depth;
+    ring->fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+
+    if(ring->fd < 0) {
+        LOG(DCOPY_LOG_DBG, "Could not set up io_uring. errno=%d %s", \
+            errno, strerror(errno));
+        DCOPY_uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, \
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(ring->sq_ptr == MAP_FAILED) {
+        LOG(DCOPY_LOG_DBG, "Could not map io_uring submission queue. errno=%d %s", \
+            errno, strerror(errno));
+        DCOPY_uring_destroy(ring);
+        return NULL;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, \
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if(ring->cq_ptr == MAP_FAILED) {
+            LOG(DCOPY_LOG_DBG, "Could not map io_uring completion queue. errno=%d %s", \
+                errno, strerror(errno));
+            DCOPY_uring_destroy(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, \
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, \
+                 ring->fd, IORING_OFF_SQES);
+
+    if(ring->sqes == MAP_FAILED) {
+        LOG(DCOPY_LOG_DBG, "Could not map io_uring entries. errno=%d %s", \
+            errno, strerror(errno));
+        DCOPY_uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_head  = (unsigned*)((char*) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail  = (unsigned*)((char*) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask  = (unsigned*)((char*) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*) ring->sq_ptr + params.sq_off.array);
+
+    ring->cq_head  = (unsigned*)((char*) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail  = (unsigned*)((char*) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask  = (unsigned*)((char*) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)((char*) ring->cq_ptr + params.cq_off.cqes);
+
+    ring->slots = (DCOPY_uring_slot_t*) calloc(depth, sizeof(DCOPY_uring_slot_t));
+
+    if(ring->slots == NULL || \
+            posix_memalign((void**) &ring->buffers, 4096, (size_t) depth * FD_BLOCK_SIZE) != 0) {
+        LOG(DCOPY_LOG_ERR, "Failed to allocate io_uring buffers.");
+        ring->buffers = NULL;
+        DCOPY_uring_destroy(ring);
+        return NULL;
+    }
+
+    struct iovec* iovecs = (struct iovec*) calloc(depth, sizeof(struct iovec));
+    unsigned i;
+
+    for(i = 0; i < depth; i++) {
+        ring->slots[i].buf = ring->buffers + (size_t) i * FD_BLOCK_SIZE;
+
+        if(iovecs != NULL) {
+            iovecs[i].iov_base = ring->slots[i].buf;
+            iovecs[i].iov_len = FD_BLOCK_SIZE;
+        }
+    }
+
+    /*
+     * Registered buffers save the kernel from mapping them on every request,
+     * but need locked memory. Plain requests work fine without them.
+     */
+    ring->fixed_buffers = iovecs != NULL && \
+                          syscall(__NR_io_uring_register, ring->fd, \
+                                  IORING_REGISTER_BUFFERS, iovecs, depth) == 0;
+
+    if(!ring->fixed_buffers) {
+        LOG(DCOPY_LOG_DBG, "Using io_uring without registered buffers. errno=%d %s", \
+            errno, strerror(errno));
+    }
+
+    free(iovecs);
+
+    return ring;
+}
+
+/* Queue a read or write of the given slot. */
+static void DCOPY_uring_prep(DCOPY_uring_t* ring, \
+                             unsigned index, \
+                             int fd)
+{
+    DCOPY_uring_slot_t* slot = &ring->slots[index];
+    unsigned tail = *ring->sq_tail;
+    unsigned sqe_index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[sqe_index];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    if(slot->state == DCOPY_SLOT_READING) {
+        sqe->opcode = ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->addr = (unsigned long)(slot->buf + slot->filled);
+        sqe->len = (unsigned)(slot->io_len - slot->filled);
+        sqe->off = (unsigned long long)(slot->offset + (off64_t) slot->filled);
+    }
+    else {
+        sqe->opcode = ring->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->addr = (unsigned long)(slot->buf + slot->done);
+        sqe->len = (unsigned)(slot->wlen - slot->done);
+        sqe->off = (unsigned long long)(slot->offset + (off64_t) slot->done);
+    }
+
+    sqe->fd = fd;
+    sqe->buf_index = (unsigned short) index;
+    sqe->user_data = index;
+
+    ring->sq_array[sqe_index] = sqe_index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit everything queued and wait for at least one completion. Returns
+ * -1 with errno set on error.
+ */
+static int DCOPY_uring_enter(DCOPY_uring_t* ring, \
+                             unsigned to_submit)
+{
+    for(;;) {
+        long rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, \
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if(rc >= 0) {
+            return 0;
+        }
+
+        if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+
+        /* Anything accepted before the interruption is already submitted. */
+        to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+}
+
+/*
+ * Copy [*pos, end) with up to depth reads and writes in flight. Every slot
+ * reads one block and then writes it out, so while one block is being
+ * written the next ones are already being read. With direct I/O, the tail
+ * of the file is read and written as a whole aligned block and the cleanup
+ * stage truncates the padding off.
+ */
+static int DCOPY_uring_run(DCOPY_uring_t* ring, \
+                           DCOPY_operation_t* op, \
+                           int in_fd, \
+                           int out_fd, \
+                           off64_t* pos, \
+                           off64_t end)
+{
+    off64_t next = *pos;
+    off64_t copied = 0;
+    unsigned in_flight = 0;
+    unsigned queued = 0;
+    bool eof = false;
+    bool failed = false;
+    unsigned i;
+
+    for(i = 0; i < ring->depth; i++) {
+        ring->slots[i].state = DCOPY_SLOT_IDLE;
+    }
+
+    for(;;) {
+        /* Hand out the next blocks of the range to idle slots. */
+        for(i = 0; i < ring->depth && !eof && !failed && next < end; i++) {
+            DCOPY_uring_slot_t* slot = &ring->slots[i];
+
+            if(slot->state != DCOPY_SLOT_IDLE) {
+                continue;
+            }
+
+            slot->state = DCOPY_SLOT_READING;
+            slot->offset = next;
+            slot->len = FD_BLOCK_SIZE;
+            slot->filled = 0;
+            slot->done = 0;
+            slot->eof = false;
+
+            if((off64_t) slot->len > end - next) {
+                slot->len = (size_t)(end - next);
+            }
+
+            next += (off64_t) slot->len;
+            slot->io_len = DCOPY_user_opts.direct ? DCOPY_DIRECT_ROUND(slot->len) : slot->len;
+
+            DCOPY_uring_prep(ring, i, in_fd);
+            in_flight++;
+            queued++;
+        }
+
+        if(in_flight == 0) {
+            break;
+        }
+
+        if(DCOPY_uring_enter(ring, queued) < 0) {
+            LOG(DCOPY_LOG_ERR, "io_uring submit failed when copying from `%s'. errno=%d %s", \
+                op->operand, errno, strerror(errno));
+            /* Requests still in flight point into our buffers; drop the ring. */
+            return -2;
+        }
+
+        queued = 0;
+
+        /* Reap completions and queue whatever each slot needs next. */
+        unsigned head = *ring->cq_head;
+
+        while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned index = (unsigned) cqe->user_data;
+            int res = cqe->res;
+            DCOPY_uring_slot_t* slot = &ring->slots[index];
+
+            head++;
+            in_flight--;
+
+            if(res == -EINTR || res == -EAGAIN) {
+                /* Nothing happened; ask again. */
+            }
+            else if(res < 0) {
+                LOG(DCOPY_LOG_ERR, "%s error when copying from `%s'. errno=%d %s", \
+                    slot->state == DCOPY_SLOT_READING ? "Read" : "Write", \
+                    op->operand, -res, strerror(-res));
+                slot->state = DCOPY_SLOT_IDLE;
+                failed = true;
+            }
+            else if(slot->state == DCOPY_SLOT_READING) {
+                slot->filled += (size_t) res;
+
+                /* A direct read that ends off alignment is the end of the file. */
+                if(res == 0 || (DCOPY_user_opts.direct && slot->filled % DCOPY_DIRECT_ALIGN != 0)) {
+                    /* The source shrank; cleanup truncates to the size we walked. */
+                    slot->eof = true;
+                    eof = true;
+                }
+
+                if(slot->eof || slot->filled >= slot->len) {
+                    if(slot->filled > slot->len) {
+                        slot->filled = slot->len;
+                    }
+
+                    /* the chunk digest doesn't care what order blocks come in */
+                    if(op->flags & DCOPY_OP_DIGEST) {
+                        op->digest ^= DCOPY_digest_block(slot->offset, slot->buf, slot->filled);
+                    }
+
+                    slot->wlen = slot->filled;
+
+                    if(DCOPY_user_opts.direct) {
+                        slot->wlen = DCOPY_DIRECT_ROUND(slot->filled);
+                        memset(slot->buf + slot->filled, 0, slot->wlen - slot->filled);
+                    }
+
+                    slot->state = slot->filled > 0 ? DCOPY_SLOT_WRITING : DCOPY_SLOT_IDLE;
+                }
+            }
+            else {
+                slot->done += (size_t) res;
+
+                if(slot->done >= slot->wlen) {
+                    copied += (off64_t) slot->filled;
+                    slot->state = DCOPY_SLOT_IDLE;
+                }
+            }
+
+            if(slot->state != DCOPY_SLOT_IDLE && !(failed && slot->state == DCOPY_SLOT_READING)) {
+                DCOPY_uring_prep(ring, index, \
+                                 slot->state == DCOPY_SLOT_READING ? in_fd : out_fd);
+                in_flight++;
+                queued++;
+            }
+            else {
+                slot->state = DCOPY_SLOT_IDLE;
+            }
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    *pos += copied;
+
+    return failed ? -1 : 1;
+}
+
+/*
+ * Copy [*pos, end) through io_uring. Returns 1 when the range is done, 0 if
+ * io_uring is not available and the caller should use another engine, and
+ * -1 on error.
+ */
+int DCOPY_uring_copy(DCOPY_operation_t* op, \
+                     int in_fd, \
+                     int out_fd, \
+                     off64_t* pos, \
+                     off64_t end)
+{
+    if(DCOPY_uring_unavailable) {
+        return 0;
+    }
+
+    if(DCOPY_ring == NULL) {
+        DCOPY_ring = DCOPY_uring_create((unsigned) DCOPY_user_opts.queue_depth);
+
+        if(DCOPY_ring == NULL) {
+            LOG(DCOPY_LOG_WARN, "io_uring is not available, using the rw copy engine.");
+            DCOPY_uring_unavailable = true;
+            return 0;
+        }
+    }
+
+    int rc = DCOPY_uring_run(DCOPY_ring, op, in_fd, out_fd, pos, end);
+
+    if(rc == -2) {
+        DCOPY_uring_destroy(DCOPY_ring);
+        DCOPY_ring = NULL;
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/* Release the ring and its buffers. */
+void DCOPY_uring_finalize(void)
+{
+    if(DCOPY_ring != NULL) {
+        DCOPY_uring_destroy(DCOPY_ring);
+        DCOPY_ring = NULL;
+    }
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+int DCOPY_uring_copy(DCOPY_operation_t* op, \
+                     int in_fd, \
+                     int out_fd, \
+                     off64_t* pos, \
+                     off64_t end)
+{
+    (void) op;
+    (void) in_fd;
+    (void) out_fd;
+    (void) pos;
+    (void) end;
+
+    return 0;
+}
+
+void DCOPY_uring_finalize(void)
+{
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* EOF */
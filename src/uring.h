@@ -0,0 +1,16 @@
+/* See the file "COPYING" for the full license governing this code. */
+
+#ifndef __DCP_URING_H
+#define __DCP_URING_H
+
+#include "common.h"
+
+int DCOPY_uring_copy(DCOPY_operation_t* op, \
+                     int in_fd, \
+                     int out_fd, \
+                     off64_t* pos, \
+                     off64_t end);
+
+void DCOPY_uring_finalize(void);
+
+#endif /* __DCP_URING_H */
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if a job-wide bandwidth limit slows a copy down, and if
+#   the copy is still correct with both the job-wide and per-rank limits.
+#
+# Expected behavior:
+#
+#   The destination files must match the source file byte for byte. Copying
+#   and comparing 20MB at 10MB per second must take at least three seconds.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a 20MB file which contains random data and for its
+# copies.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_bandwidth_limit.$RANDOM.tmp"
+PATH_B_COPY="$DCP_TEST_TMP/dcp_test_bandwidth_limit.$RANDOM.tmp"
+PATH_C_COPY="$DCP_TEST_TMP/dcp_test_bandwidth_limit.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_RANDOM path at: $PATH_A_RANDOM"
+echo "B_COPY path at: $PATH_B_COPY"
+echo "C_COPY path at: $PATH_C_COPY"
+
+# Create the random file.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=1M count=20
+
+##############################################################################
+# Test copying with a job-wide limit.
+
+SECONDS=0
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=1M --max-bandwidth=10M \
+    $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with a job-wide limit (A -> B)."
+    exit 1;
+fi
+
+if [[ $SECONDS -lt 3 ]]; then
+    echo "Copying with a job-wide limit took only $SECONDS seconds (A -> B)."
+    exit 1
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with a job-wide limit (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Test copying with both limits.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=1M --max-bandwidth=40M \
+    --max-rank-bandwidth=20M $PATH_A_RANDOM $PATH_C_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with both limits (A -> C)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_C_COPY
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with both limits (A -> C)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
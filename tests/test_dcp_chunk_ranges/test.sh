@@ -0,0 +1,94 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp will copy a file of many chunks, which the treewalk
+#   stage sends as ranges of chunks that are split up as they are worked on.
+#   The file has holes, so it is sent as several ranges.
+#
+# Expected behavior:
+#
+#   The destination file must match the source file byte for byte, and a
+#   comparison against it must find every chunk, including a changed one in
+#   the middle of a range.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for:
+#   * A sparse file of 100 chunks with three runs of random data.
+#   * A destination file.
+#   * A list of differences.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_chunk_ranges.$RANDOM.tmp"
+PATH_B_COPY="$DCP_TEST_TMP/dcp_test_chunk_ranges.$RANDOM.tmp"
+PATH_C_DIFF="$DCP_TEST_TMP/dcp_test_chunk_ranges.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_RANDOM path at: $PATH_A_RANDOM"
+echo "B_COPY   path at: $PATH_B_COPY"
+echo "C_DIFF   path at: $PATH_C_DIFF"
+
+# Create the sparse file, which ends in a hole.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=1M count=37
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=1M count=21 seek=45 conv=notrunc
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=4099 count=300 seek=20000 conv=notrunc
+truncate -s 100M $PATH_A_RANDOM
+
+##############################################################################
+# Test copying a file of many chunks with more ranks than ranges.
+
+$DCP_MPIRUN_BIN -np 4 $DCP_TEST_BIN --chunk-size=1M $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying ranges of chunks (A -> B)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying ranges of chunks (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Test comparing with a copy changed in the middle of a range.
+
+printf 'X' | dd of=$PATH_B_COPY bs=1 seek=52428900 conv=notrunc
+
+$DCP_MPIRUN_BIN -np 4 $DCP_TEST_BIN --chunk-size=1M --compare-only \
+    --diff-list=$PATH_C_DIFF $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -eq 0 ]]; then
+    echo "No error returned when comparing with a changed copy (A, B)."
+    exit 1;
+fi
+
+if [[ $(grep -vc '^#' $PATH_C_DIFF) -ne 1 ]]; then
+    echo "Unexpected differences listed (A, B)."
+    exit 1
+fi
+
+grep -q "^D 52428800 1048576 " $PATH_C_DIFF
+if [[ $? -ne 0 ]]; then
+    echo "Changed chunk not listed (A, B)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
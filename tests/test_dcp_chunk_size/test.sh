@@ -0,0 +1,80 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp will copy files whose size is not a multiple of
+#   the chunk size, both with a fixed chunk size and with adaptive sizing.
+#
+# Expected behavior:
+#
+#   The destination files must match the source files byte for byte no
+#   matter how the files are split into chunks.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for:
+#   * A file which contains random data and is not a multiple of 1MB.
+#   * Two destination files.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_chunk_size.$RANDOM.tmp"
+PATH_B_FIXED="$DCP_TEST_TMP/dcp_test_chunk_size.$RANDOM.tmp"
+PATH_C_ADAPTIVE="$DCP_TEST_TMP/dcp_test_chunk_size.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_RANDOM   path at: $PATH_A_RANDOM"
+echo "B_FIXED    path at: $PATH_B_FIXED"
+echo "C_ADAPTIVE path at: $PATH_C_ADAPTIVE"
+
+# Create the random file.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=4099 count=1500
+
+##############################################################################
+# Test copying with a fixed chunk size which does not divide the file size.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=1M $PATH_A_RANDOM $PATH_B_FIXED
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with a fixed chunk size (A -> B)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_FIXED
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with a fixed chunk size (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Test copying with adaptive chunk sizes.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN $PATH_A_RANDOM $PATH_C_ADAPTIVE
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with adaptive chunk sizes (A -> C)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_C_ADAPTIVE
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with adaptive chunk sizes (A -> C)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
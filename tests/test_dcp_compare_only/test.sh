@@ -0,0 +1,112 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if compare-only mode finds the differences between a
+#   directory and a copy of it, without changing the copy.
+#
+# Expected behavior:
+#
+#   Comparing with an untouched copy must succeed. After the copy is changed,
+#   the compare must fail, list every difference, and leave the copy as it
+#   was.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a directory with a large file and some small files,
+# for its copy, and for the list of differences.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_compare_only.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_compare_only.$RANDOM.tmp"
+PATH_C_DIFF="$DCP_TEST_TMP/dcp_test_compare_only.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+echo "C_DIFF path at: $PATH_C_DIFF"
+
+# Create the directory and copy it.
+mkdir $PATH_A_DIR
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=4099 count=5000
+
+for i in $(seq 1 20); do
+    dd if=/dev/urandom of=$PATH_A_DIR/file.$i bs=1000 count=$i
+done
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying (A -> B)."
+    exit 1;
+fi
+
+##############################################################################
+# Test comparing with an untouched copy.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=4M --compare-only \
+    --diff-list=$PATH_C_DIFF $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when comparing with an untouched copy (A, B)."
+    exit 1;
+fi
+
+if [[ $(grep -vc '^#' $PATH_C_DIFF) -ne 0 ]]; then
+    echo "Differences listed for an untouched copy (A, B)."
+    exit 1
+fi
+
+##############################################################################
+# Test comparing with a changed copy.
+
+printf 'X' | dd of=$PATH_B_DIR_COPY/large bs=1 seek=12345678 conv=notrunc
+printf 'X' | dd of=$PATH_B_DIR_COPY/file.3 bs=1 seek=10 conv=notrunc
+echo "more" >> $PATH_B_DIR_COPY/file.5
+rm $PATH_B_DIR_COPY/file.7
+echo "extra" > $PATH_B_DIR_COPY/extra
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=4M --compare-only \
+    --diff-list=$PATH_C_DIFF $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -eq 0 ]]; then
+    echo "No error returned when comparing with a changed copy (A, B)."
+    exit 1;
+fi
+
+for line in "D 8388608 4194304 large" "D 0 3000 file.3" "S file.5" \
+            "M file.7" "X extra"; do
+    grep -qx "$line" $PATH_C_DIFF
+    if [[ $? -ne 0 ]]; then
+        echo "Difference \`$line' not listed (A, B)."
+        exit 1
+    fi
+done
+
+if [[ $(grep -vc '^#' $PATH_C_DIFF) -ne 5 ]]; then
+    echo "Unexpected differences listed (A, B)."
+    exit 1
+fi
+
+# The compare must not have touched the copy.
+if [[ -e $PATH_B_DIR_COPY/file.7 ]]; then
+    echo "Compare-only mode created a missing file (B)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if every copy engine copies a file which spans several
+#   chunks and is not a multiple of the block size.
+#
+# Expected behavior:
+#
+#   The destination files must match the source file byte for byte with the
+#   rw, kernel, and uring engines. Engines which are not available on this
+#   system fall back to reads and writes, so this must pass everywhere.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the path for a file which contains random data and is not a
+# multiple of 1MB.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_copy_engines.$RANDOM.tmp"
+
+# Print out the generated path to make debugging easier.
+echo "A_RANDOM path at: $PATH_A_RANDOM"
+
+# Create the random file.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=4099 count=1500
+
+##############################################################################
+# Test copying with each engine, with a small queue depth for io_uring.
+
+for ENGINE in rw kernel uring; do
+    PATH_B_COPY="$DCP_TEST_TMP/dcp_test_copy_engines.$ENGINE.$RANDOM.tmp"
+    echo "B_COPY path for $ENGINE at: $PATH_B_COPY"
+
+    $DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=2M --copy-engine=$ENGINE \
+        --queue-depth=2 $PATH_A_RANDOM $PATH_B_COPY
+    if [[ $? -ne 0 ]]; then
+        echo "Error returned when copying with the $ENGINE engine (A -> B)."
+        exit 1;
+    fi
+
+    $DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_COPY
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch when copying with the $ENGINE engine (A -> B)."
+        exit 1
+    fi
+done
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,89 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if a delta brings existing copies of large files up to
+#   date while only rewriting the blocks which changed.
+#
+# Expected behavior:
+#
+#   After the sources are changed in place, grown, and shrunk, the copies
+#   must match them again, and far fewer bytes must have been rewritten than
+#   were compared.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a directory of files and for its copy.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_delta.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_delta.$RANDOM.tmp"
+PATH_C_LOG="$DCP_TEST_TMP/dcp_test_delta.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+echo "C_LOG path at: $PATH_C_LOG"
+
+# Create the directory with a few large files.
+mkdir $PATH_A_DIR
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=1M count=20
+dd if=/dev/urandom of=$PATH_A_DIR/grows bs=1M count=6
+dd if=/dev/urandom of=$PATH_A_DIR/shrinks bs=1M count=6
+
+##############################################################################
+# Make the first copy.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when making the first copy (A -> B)."
+    exit 1;
+fi
+
+##############################################################################
+# Change the sources in place and bring the copy up to date.
+
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=4099 count=2 seek=1000 conv=notrunc
+dd if=/dev/urandom of=$PATH_A_DIR/grows bs=1M count=1 seek=6 conv=notrunc
+truncate -s 3000000 $PATH_A_DIR/shrinks
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --delta -R $PATH_A_DIR $PATH_B_DIR_COPY > $PATH_C_LOG
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when updating the copy (A -> B)."
+    exit 1;
+fi
+
+for f in large grows shrinks; do
+    $DCP_CMP_BIN $PATH_A_DIR/$f $PATH_B_DIR_COPY/$f
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch after updating the copy (A -> B, $f)."
+        exit 1
+    fi
+done
+
+# Only the two blocks of large and the new one of grows differ.
+REWRITTEN=$(sed -n "s/.*Rewrote \`\([0-9]*\)' of.*/\1/p" $PATH_C_LOG)
+if [[ -z "$REWRITTEN" || "$REWRITTEN" -gt 3145728 ]]; then
+    echo "The delta rewrote \`$REWRITTEN' bytes instead of only those which changed."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
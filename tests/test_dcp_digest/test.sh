@@ -0,0 +1,53 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if the chunk digests the compare stage checks the
+#   destination against catch blocks in the wrong place and corrupted blocks.
+#
+# Expected behavior:
+#
+#   The digest_check program next to the dcp binary must find that the digest
+#   of a chunk doesn't depend on the order its blocks are added in, and that
+#   swapping two blocks, corrupting one, or corrupting two the same way all
+#   change it. It is built first if it isn't there.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+
+DIGEST_CHECK_BIN="$(dirname $DCP_TEST_BIN)/digest_check"
+echo "Using digest_check binary at: $DIGEST_CHECK_BIN"
+
+##############################################################################
+# Build the check if needed, and run it.
+
+if [[ ! -x $DIGEST_CHECK_BIN ]]; then
+    make -C $(dirname $DCP_TEST_BIN) digest_check
+    if [[ $? -ne 0 ]]; then
+        echo "Error returned when building digest_check."
+        exit 1;
+    fi
+fi
+
+$DIGEST_CHECK_BIN
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when checking the chunk digests."
+    exit 1;
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
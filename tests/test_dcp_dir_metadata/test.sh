@@ -0,0 +1,92 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp will preserve the permissions and modification
+#   times of every directory in a deep tree, which are set as soon as the
+#   work below each directory is done rather than level by level at the end.
+#
+# Expected behavior:
+#
+#   Each directory of the copy must have the mode and modification time of
+#   its source, including read-only ones and one its owner can't search, and
+#   the files must match their sources.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a tree of directories and for its copy.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_dir_metadata.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_dir_metadata.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+
+# Create a tree six levels deep, with a few files and a large one in each
+# directory, and give the directories old times and different modes.
+mkdir $PATH_A_DIR
+DIR=$PATH_A_DIR
+
+for depth in $(seq 1 6); do
+    for i in $(seq 1 3); do
+        mkdir $DIR/dir.$i
+        dd if=/dev/urandom of=$DIR/dir.$i/file bs=1000 count=$i
+    done
+
+    dd if=/dev/urandom of=$DIR/large bs=4099 count=1000
+    DIR=$DIR/dir.1
+done
+
+find $PATH_A_DIR -depth -type d | while read d; do
+    touch -d "2001-02-03 04:05:06" $d
+done
+
+chmod 0555 $PATH_A_DIR/dir.1/dir.2
+chmod 0700 $PATH_A_DIR/dir.1/dir.1/dir.3
+chmod 0644 $PATH_A_DIR/dir.2
+
+##############################################################################
+# Test copying the tree with its metadata.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -p -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying the tree (A -> B)."
+    exit 1;
+fi
+
+for d in $(cd $PATH_A_DIR && find . -type d); do
+    if [[ "$(stat -c '%a %Y' $PATH_A_DIR/$d)" != "$(stat -c '%a %Y' $PATH_B_DIR_COPY/$d)" ]]; then
+        echo "Metadata mismatch after copying the tree (A -> B, $d)."
+        exit 1
+    fi
+done
+
+for f in $(cd $PATH_A_DIR && find . -type f); do
+    $DCP_CMP_BIN $PATH_A_DIR/$f $PATH_B_DIR_COPY/$f
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch after copying the tree (A -> B, $f)."
+        exit 1
+    fi
+done
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
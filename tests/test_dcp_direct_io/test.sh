@@ -0,0 +1,68 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if direct I/O copies a file whose size is not a multiple
+#   of the direct I/O alignment, so the unaligned tail has to be padded and
+#   truncated off again.
+#
+# Expected behavior:
+#
+#   The destination files must match the source file byte for byte with
+#   every copy engine. Filesystems without O_DIRECT support fall back to the
+#   page cache, so this must pass everywhere.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the path for a file which contains random data and is not a
+# multiple of 1MB.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_direct_io.$RANDOM.tmp"
+
+# Print out the generated path to make debugging easier.
+echo "A_RANDOM path at: $PATH_A_RANDOM"
+
+# Create the random file.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=4099 count=1500
+
+##############################################################################
+# Test copying with direct I/O and each engine.
+
+for ENGINE in rw kernel uring; do
+    PATH_B_COPY="$DCP_TEST_TMP/dcp_test_direct_io.$ENGINE.$RANDOM.tmp"
+    echo "B_COPY path for $ENGINE at: $PATH_B_COPY"
+
+    $DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=2M --copy-engine=$ENGINE \
+        --direct $PATH_A_RANDOM $PATH_B_COPY
+    if [[ $? -ne 0 ]]; then
+        echo "Error returned when copying with direct I/O and the $ENGINE engine (A -> B)."
+        exit 1;
+    fi
+
+    $DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_COPY
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch when copying with direct I/O and the $ENGINE engine (A -> B)."
+        exit 1
+    fi
+done
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
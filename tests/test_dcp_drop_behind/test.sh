@@ -0,0 +1,90 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if copying with drop-behind still produces the right
+#   contents, both for a large file copied in slices and for a directory of
+#   small files copied in batches.
+#
+# Expected behavior:
+#
+#   The destination must match the source byte for byte. The page cache is
+#   only a hint, so how much of the files stays cached is not checked.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a file which contains random data and is not a
+# multiple of 1MB, for a directory of small files, and for their copies.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_drop_behind.$RANDOM.tmp"
+PATH_B_COPY="$DCP_TEST_TMP/dcp_test_drop_behind.$RANDOM.tmp"
+PATH_C_DIR="$DCP_TEST_TMP/dcp_test_drop_behind.$RANDOM.tmp"
+PATH_D_DIR_COPY="$DCP_TEST_TMP/dcp_test_drop_behind.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_RANDOM path at: $PATH_A_RANDOM"
+echo "B_COPY path at: $PATH_B_COPY"
+echo "C_DIR path at: $PATH_C_DIR"
+echo "D_DIR_COPY path at: $PATH_D_DIR_COPY"
+
+# Create the random file and the directory of small files.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=4099 count=10000
+
+mkdir $PATH_C_DIR
+for i in $(seq 1 50); do
+    dd if=/dev/urandom of=$PATH_C_DIR/file.$i bs=1000 count=$i
+done
+
+##############################################################################
+# Test copying a large file in slices.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=8M --drop-behind \
+    $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with drop-behind (A -> B)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with drop-behind (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Test copying a directory of small files.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --drop-behind -R $PATH_C_DIR $PATH_D_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with drop-behind (C -> D)."
+    exit 1;
+fi
+
+for i in $(seq 1 50); do
+    $DCP_CMP_BIN $PATH_C_DIR/file.$i $PATH_D_DIR_COPY/file.$i
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch when copying with drop-behind (C -> D, file.$i)."
+        exit 1
+    fi
+done
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
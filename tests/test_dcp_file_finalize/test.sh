@@ -0,0 +1,90 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp will give files of many chunks the ownership,
+#   permissions, and timestamps of their sources, which the rank that
+#   finishes the last chunk of each file sets through its descriptor.
+#
+# Expected behavior:
+#
+#   Each file of the copy must match its source byte for byte, and have its
+#   mode and modification time down to the nanosecond, including a read-only
+#   file and a sparse one, with and without flushing files to disk.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a directory of large files and for two copies.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_file_finalize.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_file_finalize.$RANDOM.tmp"
+PATH_C_DIR_COPY="$DCP_TEST_TMP/dcp_test_file_finalize.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+echo "C_DIR_COPY path at: $PATH_C_DIR_COPY"
+
+# Create files of many chunks with different modes and times.
+mkdir $PATH_A_DIR
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=1M count=20
+dd if=/dev/urandom of=$PATH_A_DIR/read_only bs=4099 count=2000
+dd if=/dev/urandom of=$PATH_A_DIR/sparse bs=1M count=3 seek=5
+truncate -s 17M $PATH_A_DIR/sparse
+
+chmod 0444 $PATH_A_DIR/read_only
+chmod 0600 $PATH_A_DIR/sparse
+touch -d "2005-06-07 08:09:10.123456789" $PATH_A_DIR/large
+touch -d "2006-07-08 09:10:11.987654321" $PATH_A_DIR/read_only
+touch -d "2007-08-09 10:11:12.5" $PATH_A_DIR/sparse
+
+##############################################################################
+# Test copying the files with their metadata, with and without flushing them.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -p --chunk-size=1M -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying the files (A -> B)."
+    exit 1;
+fi
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -p -F --chunk-size=1M -R $PATH_A_DIR $PATH_C_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying and flushing the files (A -> C)."
+    exit 1;
+fi
+
+for copy in $PATH_B_DIR_COPY $PATH_C_DIR_COPY; do
+    for f in large read_only sparse; do
+        $DCP_CMP_BIN $PATH_A_DIR/$f $copy/$f
+        if [[ $? -ne 0 ]]; then
+            echo "CMP mismatch after copying the files ($copy/$f)."
+            exit 1
+        fi
+
+        if [[ "$(stat -c '%a %y' $PATH_A_DIR/$f)" != "$(stat -c '%a %y' $copy/$f)" ]]; then
+            echo "Metadata mismatch after copying the files ($copy/$f)."
+            exit 1
+        fi
+    done
+done
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
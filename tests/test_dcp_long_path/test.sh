@@ -0,0 +1,76 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if files are copied when their paths are nearly as long
+#   as the system allows, which is longer than what fits in a libcircle
+#   message along with the other fields of a work operation.
+#
+# Expected behavior:
+#
+#   The tree must be copied into an existing directory, and its deepest file
+#   must match the original.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a deep directory and for the directory to copy it into.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_long_path.$RANDOM.tmp"
+PATH_B_DIR_EMPTY="$DCP_TEST_TMP/dcp_test_long_path.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_EMPTY path at: $PATH_B_DIR_EMPTY"
+
+# Nest directories until the destination of the deepest file is 4090 bytes.
+NAME=$(printf 'd%.0s' $(seq 1 99))
+FILE=$(basename $PATH_A_DIR)
+DEEP=""
+
+mkdir $PATH_A_DIR
+mkdir $PATH_B_DIR_EMPTY
+
+while [[ $(( ${#PATH_B_DIR_EMPTY} + ${#FILE} + ${#DEEP} + 100 + 40 )) -lt 4090 ]]; do
+    DEEP="$DEEP/$NAME"
+done
+
+DEEP="$DEEP/$(printf 'f%.0s' $(seq 1 $(( 4090 - ${#PATH_B_DIR_EMPTY} - ${#FILE} - ${#DEEP} - 2 ))))"
+
+mkdir -p $(dirname $PATH_A_DIR$DEEP)
+dd if=/dev/urandom of=$PATH_A_DIR$DEEP bs=1M count=3
+
+##############################################################################
+# Copy the deep directory into the existing one.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -R $PATH_A_DIR $PATH_B_DIR_EMPTY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying the deep directory (A -> B)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_DIR$DEEP $PATH_B_DIR_EMPTY/$FILE$DEEP
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch of the deepest file (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
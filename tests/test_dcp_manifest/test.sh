@@ -0,0 +1,94 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if a manifest written during a copy verifies the copy,
+#   and stops verifying it once the copy has been changed.
+#
+# Expected behavior:
+#
+#   Verifying the untouched copy must succeed. Verifying must fail after a
+#   byte of a copied file is changed, and after a copied file is removed.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a directory with a large file and some small files,
+# for its copy, and for the manifest.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_manifest.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_manifest.$RANDOM.tmp"
+PATH_C_MANIFEST="$DCP_TEST_TMP/dcp_test_manifest.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+echo "C_MANIFEST path at: $PATH_C_MANIFEST"
+
+# Create the directory, with a large file that has a hole in it.
+mkdir $PATH_A_DIR
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=4099 count=5000
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=1M count=3 seek=40 conv=notrunc
+
+for i in $(seq 1 20); do
+    dd if=/dev/urandom of=$PATH_A_DIR/file.$i bs=1000 count=$i
+done
+
+##############################################################################
+# Test copying with a manifest and verifying the copy against it.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=4M -R \
+    --manifest=$PATH_C_MANIFEST $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with a manifest (A -> B)."
+    exit 1;
+fi
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --verify=$PATH_C_MANIFEST $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when verifying an untouched copy (B)."
+    exit 1;
+fi
+
+##############################################################################
+# Test that a changed byte is caught.
+
+printf 'X' | dd of=$PATH_B_DIR_COPY/large bs=1 seek=12345678 conv=notrunc
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --verify=$PATH_C_MANIFEST $PATH_B_DIR_COPY
+if [[ $? -eq 0 ]]; then
+    echo "No error returned when verifying a changed copy (B)."
+    exit 1;
+fi
+
+##############################################################################
+# Test that a removed file is caught.
+
+cp $PATH_A_DIR/large $PATH_B_DIR_COPY/large
+rm $PATH_B_DIR_COPY/file.7
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --verify=$PATH_C_MANIFEST $PATH_B_DIR_COPY
+if [[ $? -eq 0 ]]; then
+    echo "No error returned when verifying a copy with a missing file (B)."
+    exit 1;
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp will copy a directory full of small files, empty
+#   files, and links, both with and without batching.
+#
+# Expected behavior:
+#
+#   The destination directory must match the source directory, including the
+#   targets of links, whether the small files are copied in batches or one by
+#   one.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for:
+#   * A directory full of small files, an empty file, and a link.
+#   * Two destination directories.
+PATH_A_DIRECTORY="$DCP_TEST_TMP/dcp_test_many_small_files.$RANDOM.tmp"
+PATH_B_BATCHED="$DCP_TEST_TMP/dcp_test_many_small_files.$RANDOM.tmp"
+PATH_C_UNBATCHED="$DCP_TEST_TMP/dcp_test_many_small_files.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIRECTORY  path at: $PATH_A_DIRECTORY"
+echo "B_BATCHED    path at: $PATH_B_BATCHED"
+echo "C_UNBATCHED  path at: $PATH_C_UNBATCHED"
+
+# Create the source directory.
+mkdir $PATH_A_DIRECTORY
+
+for i in $(seq 1 300); do
+    dd if=/dev/urandom of=$PATH_A_DIRECTORY/small.$i bs=$i count=7 2> /dev/null
+done
+
+touch $PATH_A_DIRECTORY/empty
+ln -s small.1 $PATH_A_DIRECTORY/link
+
+##############################################################################
+# Test copying the directory with batching (the default).
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -R $PATH_A_DIRECTORY $PATH_B_BATCHED
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying small files in batches (A -> B)."
+    exit 1;
+fi
+
+diff -r --no-dereference $PATH_A_DIRECTORY $PATH_B_BATCHED
+if [[ $? -ne 0 ]]; then
+    echo "Mismatch when copying small files in batches (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Test copying the directory with batching turned off.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -b 0 -R $PATH_A_DIRECTORY $PATH_C_UNBATCHED
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying small files one by one (A -> C)."
+    exit 1;
+fi
+
+diff -r --no-dereference $PATH_A_DIRECTORY $PATH_C_UNBATCHED
+if [[ $? -ne 0 ]]; then
+    echo "Mismatch when copying small files one by one (A -> C)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,82 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp will preserve the permissions and modification
+#   times of many files when it keeps almost none of the records for the
+#   metadata pass in memory, so most of them are spilled to local disk.
+#
+# Expected behavior:
+#
+#   Every file of the copy must have the mode and modification time of its
+#   source, and nothing may be left behind in the spill directory.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for:
+#   * A directory of files with long random names.
+#   * A copy of the directory.
+#   * A directory to spill to.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_metadata_spill.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_metadata_spill.$RANDOM.tmp"
+PATH_C_SPILL="$DCP_TEST_TMP/dcp_test_metadata_spill.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+echo "C_SPILL path at: $PATH_C_SPILL"
+
+# Create more files than one segment of records holds, with names that share
+# no prefix, and give them different modes and times.
+mkdir $PATH_A_DIR $PATH_C_SPILL
+
+i=0
+for name in $(tr -dc 'a-zA-Z0-9' < /dev/urandom | fold -w 200 | head -n 6000); do
+    echo $i > $PATH_A_DIR/$name
+    chmod 06$((i % 8))$((i % 5)) $PATH_A_DIR/$name
+    touch -d "@$((1000000000 + i * 977))" $PATH_A_DIR/$name
+    i=$((i + 1))
+done
+
+##############################################################################
+# Test copying the directory with its metadata.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN -p --metadata-memory=1 \
+    --spill-dir=$PATH_C_SPILL -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying the directory (A -> B)."
+    exit 1;
+fi
+
+if [[ "$(cd $PATH_A_DIR && stat -c '%n %a %Y' * | sort)" != \
+      "$(cd $PATH_B_DIR_COPY && stat -c '%n %a %Y' * | sort)" ]]; then
+    echo "Metadata mismatch after copying the directory (A -> B)."
+    exit 1
+fi
+
+if [[ -n "$(ls -A $PATH_C_SPILL)" ]]; then
+    echo "Spill files left behind (C)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,89 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if preallocated destination files end up with the right
+#   contents and size, both when the destination is new and when it already
+#   exists and is longer than the source.
+#
+# Expected behavior:
+#
+#   The destination files must match the source file byte for byte.
+#   Filesystems without fallocate support grow files as they are written, so
+#   this must pass everywhere.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a file which contains random data and is not a
+# multiple of 1MB, and for its copies.
+PATH_A_RANDOM="$DCP_TEST_TMP/dcp_test_preallocate.$RANDOM.tmp"
+PATH_B_COPY="$DCP_TEST_TMP/dcp_test_preallocate.$RANDOM.tmp"
+PATH_C_LONGER="$DCP_TEST_TMP/dcp_test_preallocate.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_RANDOM path at: $PATH_A_RANDOM"
+echo "B_COPY path at: $PATH_B_COPY"
+echo "C_LONGER path at: $PATH_C_LONGER"
+
+# Create the random file, and a longer file to copy over.
+dd if=/dev/urandom of=$PATH_A_RANDOM bs=4099 count=5000
+dd if=/dev/urandom of=$PATH_C_LONGER bs=1M count=30
+
+##############################################################################
+# Test copying into a new, preallocated destination.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=2M --preallocate \
+    $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with preallocation (A -> B)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_B_COPY
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with preallocation (A -> B)."
+    exit 1
+fi
+
+# Show how many extents the copy ended up with, if we can.
+if which filefrag > /dev/null 2>&1; then
+    filefrag $PATH_B_COPY
+fi
+
+##############################################################################
+# Test copying over a longer destination, which must still be cut short.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=2M --preallocate \
+    $PATH_A_RANDOM $PATH_C_LONGER
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying with preallocation (A -> C)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_RANDOM $PATH_C_LONGER
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying with preallocation (A -> C)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,97 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if a copy which is stopped at its walltime can be resumed
+#   from its journal.
+#
+# Expected behavior:
+#
+#   The first run must stop early, fail, and keep its journal. The resumed run
+#   must finish the copy, including a file which was changed in between, and
+#   remove the journal.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a directory of files, its copy, and the journal.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_resume.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_resume.$RANDOM.tmp"
+PATH_C_JOURNAL="$DCP_TEST_TMP/dcp_test_resume.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+echo "C_JOURNAL path at: $PATH_C_JOURNAL"
+
+# Create the directory with large files and some small ones.
+mkdir $PATH_A_DIR
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=1M count=40
+dd if=/dev/urandom of=$PATH_A_DIR/changed bs=1M count=20
+
+for i in $(seq 1 20); do
+    dd if=/dev/urandom of=$PATH_A_DIR/file.$i bs=1000 count=$i
+done
+
+# The journal only trusts sources older than the run that wrote it.
+sleep 1
+
+##############################################################################
+# Start the copy with a walltime it can't make.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --journal=$PATH_C_JOURNAL --walltime=2 \
+    --max-bandwidth=10M -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -eq 0 ]]; then
+    echo "No error returned when stopping at the walltime (A -> B)."
+    exit 1;
+fi
+
+if [[ ! -e $PATH_C_JOURNAL.0 ]]; then
+    echo "The journal was not kept for a resume."
+    exit 1;
+fi
+
+##############################################################################
+# Change a file in place and resume the copy.
+
+dd if=/dev/urandom of=$PATH_A_DIR/changed bs=1M count=1 seek=2 conv=notrunc
+
+$DCP_MPIRUN_BIN -np 2 $DCP_TEST_BIN --journal=$PATH_C_JOURNAL --resume -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when resuming the copy (A -> B)."
+    exit 1;
+fi
+
+for f in large changed $(seq -f "file.%g" 1 20); do
+    $DCP_CMP_BIN $PATH_A_DIR/$f $PATH_B_DIR_COPY/$f
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch after resuming the copy (A -> B, $f)."
+        exit 1
+    fi
+done
+
+if [[ -e $PATH_C_JOURNAL.0 ]]; then
+    echo "The journal was not removed after the copy finished."
+    exit 1;
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
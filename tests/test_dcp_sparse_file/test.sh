@@ -0,0 +1,76 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if dcp keeps the holes of a sparse file, including a
+#   leading hole, a hole in the middle, and a trailing hole, when the
+#   destination already exists and holds data.
+#
+# Expected behavior:
+#
+#   The destination file must match the source file byte for byte and must
+#   not take up more blocks than the data in it needs.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for:
+#   * A sparse file with two small runs of random data.
+#   * A destination file which already holds random data.
+PATH_A_SPARSE="$DCP_TEST_TMP/dcp_test_sparse_file.$RANDOM.tmp"
+PATH_B_EXISTING="$DCP_TEST_TMP/dcp_test_sparse_file.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_SPARSE   path at: $PATH_A_SPARSE"
+echo "B_EXISTING path at: $PATH_B_EXISTING"
+
+# Create the sparse file and the existing destination.
+dd if=/dev/urandom of=$PATH_A_SPARSE bs=4096 count=3 seek=1024
+dd if=/dev/urandom of=$PATH_A_SPARSE bs=4096 count=5 seek=4096 conv=notrunc
+truncate -s 40M $PATH_A_SPARSE
+dd if=/dev/urandom of=$PATH_B_EXISTING bs=1M count=48
+
+##############################################################################
+# Test copying the sparse file over the existing destination.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --chunk-size=2M --batch-threshold=0 \
+    $PATH_A_SPARSE $PATH_B_EXISTING
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when copying a sparse file (A -> B)."
+    exit 1;
+fi
+
+$DCP_CMP_BIN $PATH_A_SPARSE $PATH_B_EXISTING
+if [[ $? -ne 0 ]]; then
+    echo "CMP mismatch when copying a sparse file (A -> B)."
+    exit 1
+fi
+
+# Only check the allocation where the source itself is sparse.
+SOURCE_KB=$(du -k $PATH_A_SPARSE | cut -f1)
+DEST_KB=$(du -k $PATH_B_EXISTING | cut -f1)
+if [[ $SOURCE_KB -lt 40960 && $DEST_KB -gt 4096 ]]; then
+    echo "Holes were filled in when copying a sparse file (A -> B)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+##############################################################################
+# Description:
+#
+#   A test to check if an update brings an earlier copy of a directory up to
+#   date, copying only the files which changed.
+#
+# Expected behavior:
+#
+#   After the source is changed and the copy is updated, the copy must match
+#   the source again, and a file which did not change must not have been
+#   written to.
+#
+# Reminder:
+#
+#   Lines that echo to the terminal will only be available if DEBUG is enabled
+#   in the test runner (test_all.sh).
+##############################################################################
+
+# Turn on verbose output
+#set -x
+
+# Print out the basic paths we'll be using.
+echo "Using dcp binary at: $DCP_TEST_BIN"
+echo "Using mpirun binary at: $DCP_MPIRUN_BIN"
+echo "Using cmp binary at: $DCP_CMP_BIN"
+echo "Using tmp directory at: $DCP_TEST_TMP"
+
+##############################################################################
+# Generate the paths for a directory of files and for its copy.
+PATH_A_DIR="$DCP_TEST_TMP/dcp_test_update.$RANDOM.tmp"
+PATH_B_DIR_COPY="$DCP_TEST_TMP/dcp_test_update.$RANDOM.tmp"
+
+# Print out the generated paths to make debugging easier.
+echo "A_DIR path at: $PATH_A_DIR"
+echo "B_DIR_COPY path at: $PATH_B_DIR_COPY"
+
+# Create the directory with a large file and some small ones.
+mkdir $PATH_A_DIR
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=4099 count=5000
+
+for i in $(seq 1 20); do
+    dd if=/dev/urandom of=$PATH_A_DIR/file.$i bs=1000 count=$i
+done
+
+##############################################################################
+# Make the first copy.
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --update -p -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when making the first copy (A -> B)."
+    exit 1;
+fi
+
+##############################################################################
+# Change the source and update the copy. The copy of file.1 is given a
+# different content of the same size and time, so it shows whether file.1
+# was copied again.
+
+sleep 1
+dd if=/dev/urandom of=$PATH_A_DIR/large bs=4099 count=10 seek=100 conv=notrunc
+echo "changed" >> $PATH_A_DIR/file.2
+dd if=/dev/urandom of=$PATH_A_DIR/file.21 bs=1000 count=21
+mkdir $PATH_A_DIR/new_dir
+dd if=/dev/urandom of=$PATH_A_DIR/new_dir/file bs=1000 count=5
+
+dd if=/dev/zero of=$PATH_B_DIR_COPY/file.1 bs=1000 count=1 conv=notrunc
+touch -r $PATH_A_DIR/file.1 $PATH_B_DIR_COPY/file.1
+
+$DCP_MPIRUN_BIN -np 3 $DCP_TEST_BIN --update -p -R $PATH_A_DIR $PATH_B_DIR_COPY
+if [[ $? -ne 0 ]]; then
+    echo "Error returned when updating the copy (A -> B)."
+    exit 1;
+fi
+
+for f in large file.2 file.21 new_dir/file $(seq -f "file.%g" 3 20); do
+    $DCP_CMP_BIN $PATH_A_DIR/$f $PATH_B_DIR_COPY/$f
+    if [[ $? -ne 0 ]]; then
+        echo "CMP mismatch after updating the copy (A -> B, $f)."
+        exit 1
+    fi
+done
+
+$DCP_CMP_BIN -s $PATH_A_DIR/file.1 $PATH_B_DIR_COPY/file.1
+if [[ $? -eq 0 ]]; then
+    echo "An up to date file was copied again (A -> B, file.1)."
+    exit 1
+fi
+
+##############################################################################
+# Since we didn't find any problems, exit with success.
+
+exit 0
+
+# EOF